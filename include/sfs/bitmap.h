@@ -0,0 +1,125 @@
+// bitmap.h: Word-packed free block bitmap
+
+#pragma once
+
+#include <vector>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// claim, claim_range and release may run from several threads at once,
+// alongside the read-only calls; every other call that changes the bitmap
+// needs it to itself
+
+class Bitmap {
+public:
+    // Number of bits per region (one bitmap block worth)
+    const static size_t REGION_BITS  = 32768;
+    const static size_t REGION_WORDS = REGION_BITS / 64;
+
+private:
+    std::vector<uint64_t> Words;	// One bit per block, set if in use
+    std::vector<uint32_t> RegionFree;	// Number of free bits per region
+    std::vector<uint8_t>  RegionDirty;	// Whether region changed since last take_dirty
+    std::vector<uint32_t> RegionHint;	// No free bit lives below this word of the region (claim)
+    size_t  Bits;	    // Number of valid bits
+    size_t  Free;	    // Number of free bits
+    size_t  Hint;	    // No free bit lives below this word
+
+    // Return index of first word at or after start that is not full,
+    // or Words.size()
+    size_t scan_words(size_t start, size_t end) const;
+
+    // Recompute free counts from Words
+    void recount();
+
+    // Account for bits claimed or released in a word
+    void account(size_t word, size_t bits, bool claimed);
+
+public:
+    // Default constructor
+    Bitmap() : Bits(0), Free(0), Hint(0) {}
+
+    // Resize bitmap and mark every bit free (or every bit in use)
+    // @param	bits	    Number of bits
+    // @param	used	    Whether to mark bits in use instead of free
+    void resize(size_t bits, bool used = false);
+
+    // Replace contents with saved words
+    // @param	words	    At least (bits + 63) / 64 words
+    // @param	bits	    Number of bits
+    void load(const uint64_t *words, size_t bits);
+
+    // Return number of bits
+    size_t size() const { return Bits; }
+
+    // Return number of free bits
+    size_t free() const { return __atomic_load_n(&Free, __ATOMIC_RELAXED); }
+
+    // Return number of free bits in region
+    size_t region_free(size_t region) const { return __atomic_load_n(&RegionFree[region], __ATOMIC_RELAXED); }
+
+    // Return number of regions
+    size_t regions() const { return RegionFree.size(); }
+
+    // Return whether or not bit is set (in use)
+    bool test(size_t bit) const { return (__atomic_load_n(&Words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1; }
+
+    // Mark bit in use
+    void set(size_t bit);
+
+    // Mark bit free
+    void clear(size_t bit);
+
+    // Mark a run of bits in use
+    // @param	start	    First bit
+    // @param	count	    Number of bits
+    // @return	Number of bits that were already in use
+    size_t set_range(size_t start, size_t count);
+
+    // Return number of consecutive free bits at start, at most max
+    // @param	start	    First bit to consider
+    // @param	max	    Longest run of interest
+    size_t run_length(size_t start, size_t max) const;
+
+    // Return first free bit at or after start, or -1 if there is none
+    // @param	start	    First bit to consider
+    ssize_t find_free(size_t start = 0);
+
+    // Return first free bit at or after start without moving the hint, or
+    // -1 if there is none
+    // @param	start	    First bit to consider
+    ssize_t next_free(size_t start) const;
+
+    // Atomically mark the first free bit of a region in use
+    // @param	region	    Region to claim from
+    // @return	Bit claimed, or -1 if the region is full
+    ssize_t claim(size_t region);
+
+    // Atomically mark in use the run of free bits at start, at most max
+    // @param	start	    First bit of the run
+    // @param	max	    Longest run wanted
+    // @return	Number of bits claimed (0 if start is in use)
+    size_t claim_range(size_t start, size_t max);
+
+    // Atomically mark bit free
+    void release(size_t bit);
+
+    // Mark every bit set in other (same size) as in use
+    // @param	other	    Bitmap to merge
+    // @return	Number of bits that were already in use in both
+    size_t merge(const Bitmap &other);
+
+    // Return raw words (bits past size() are always set)
+    const std::vector<uint64_t> &words() const { return Words; }
+
+    // Copy the words of a region
+    // @param	region	    Region to copy
+    // @param	words	    At least REGION_WORDS words
+    // @return	Number of words copied
+    size_t copy_region(size_t region, uint64_t *words) const;
+
+    // Collect regions changed since the last call, in ascending order
+    void take_dirty(std::vector<size_t> &regions);
+};
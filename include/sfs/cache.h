@@ -0,0 +1,76 @@
+// cache.h: Block buffer cache
+
+#pragma once
+
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include <stdlib.h>
+
+class BlockCache {
+private:
+    struct Entry {
+    	int	BlockNum;   // Block held in this slot
+    	bool	Dirty;	    // Whether slot is newer than disk
+    	char   *Data;	    // Slot buffer
+    };
+
+    typedef std::list<Entry>::iterator Slot;
+
+    size_t  Capacity;	    // Number of slots
+    size_t  BlockSize;	    // Number of bytes per slot
+    std::vector<char>		Slab;	// Backing storage for all slots
+    std::vector<char *>		Free;	// Unused slot buffers
+    std::list<Entry>		LRU;	// Most recently used at front
+    std::unordered_map<int, Slot> Index;	// Block number to slot
+
+public:
+    // Constructor
+    // @param	capacity    Number of blocks to cache
+    // @param	block_size  Number of bytes per block
+    BlockCache(size_t capacity, size_t block_size);
+
+    // Return number of slots
+    size_t capacity() const { return Capacity; }
+
+    // Return number of cached blocks
+    size_t size() const { return LRU.size(); }
+
+    // Return whether or not every slot is in use
+    bool full() const { return LRU.size() >= Capacity; }
+
+    // Return whether or not block is cached
+    bool contains(int blocknum) const { return Index.count(blocknum) > 0; }
+
+    // Copy cached block and mark it most recently used
+    // @param	blocknum    Block to look up
+    // @param	data	    Buffer to copy into
+    // @return	Whether or not block was cached
+    bool lookup(int blocknum, char *data);
+
+    // Cache block, replacing any previous copy; caller must evict first
+    // when the cache is full
+    // @param	blocknum    Block to cache
+    // @param	data	    Block contents
+    // @param	dirty	    Whether block must be written back later
+    void insert(int blocknum, const char *data, bool dirty);
+
+    // Return least recently used block
+    // @param	blocknum    Set to victim block number
+    // @param	data	    Set to victim contents
+    // @return	Whether or not victim is dirty
+    bool victim(int *blocknum, const char **data) const;
+
+    // Drop block from cache (dirty contents are discarded)
+    void remove(int blocknum);
+
+    // Collect dirty blocks in ascending order
+    void dirty(std::vector<int> &blocks) const;
+
+    // Return cached contents of block, or NULL
+    const char *peek(int blocknum) const;
+
+    // Mark block as written back
+    void clean(int blocknum);
+};
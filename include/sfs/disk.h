@@ -2,15 +2,79 @@
 
 #pragma once
 
+#include "sfs/cache.h"
+#include "sfs/trace.h"
+#include "sfs/uring.h"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/types.h>
 
 class Disk {
+public:
+    // How blocks move between memory and the disk image
+    enum Backend {
+    	BACKEND_PREAD,	    // pread/pwrite system calls
+    	BACKEND_MMAP,	    // memcpy to and from a shared mapping of the image
+    	BACKEND_URING,	    // pread/pwrite, with queued requests batched on io_uring
+    };
+
+    // What a block holds, as told by the file system; reads and writes are
+    // also counted per kind
+    enum Kind {
+    	KIND_DATA,	    // File data, or free (the default)
+    	KIND_SUPER,	    // Superblock
+    	KIND_INODE,	    // Inode table
+    	KIND_BITMAP,	    // Free block bitmap and reference table
+    	KIND_INDIRECT,	    // Pointer or extent block
+    	KINDS
+    };
+
 private:
+    struct Fill {
+    	size_t	Readers;    // Threads reading the block after a miss
+    	bool	Stale;	    // Whether a write or discard reached the block meanwhile
+    };
+
+    struct Request {
+    	int	BlockNum;   // Block to transfer
+    	char   *Data;	    // Buffer to transfer to or from
+    	bool	Write;	    // Whether request is a write
+    };
+
     int	    FileDescriptor; // File descriptor of disk image
+    Backend Mode;	    // Backend chosen at open
+    char   *Mapping;	    // Mapped disk image (BACKEND_MMAP only)
     size_t  Blocks;	    // Number of blocks in disk image
-    size_t  Reads;	    // Number of reads performed
-    size_t  Writes;	    // Number of writes performed
-    size_t  Mounts;	    // Number of mounts
+    std::atomic<size_t> Reads;		// Number of reads performed
+    std::atomic<size_t> Writes;		// Number of writes performed
+    std::atomic<size_t> CacheHits;	// Number of reads served by cache
+    std::atomic<size_t> CacheMisses;	// Number of reads that went to disk image
+    std::atomic<size_t> CacheEvictions;	// Number of blocks evicted from cache
+    std::atomic<size_t> Discards;	// Number of blocks discarded
+    std::atomic<size_t> KindReads[KINDS];	// Reads per block kind
+    std::atomic<size_t> KindWrites[KINDS];	// Writes per block kind
+    std::vector<uint8_t> Kinds;	    // Kind of each block
+    std::atomic<bool> Tracing;	    // Whether requests are being traced
+    FILE   *TraceFile;		    // Trace being written (NULL if not tracing)
+    std::vector<TraceRecord> TraceBuffer; // Records not yet written to TraceFile
+    std::chrono::steady_clock::time_point TraceStart;
+    std::mutex	TraceLock;  // Guards TraceFile and TraceBuffer
+    std::atomic<size_t> Mounts;	// Number of mounts
+    BlockCache *Cache;	    // Block cache (NULL if disabled)
+    std::mutex	CacheLock;  // Serializes cache access between threads
+    std::unordered_map<int, Fill> Filling; // Cache misses being read without CacheLock
+    IoRing *Ring;	    // io_uring (BACKEND_URING only)
+    std::mutex	RingLock;   // Serializes use of the ring between threads
+    std::unordered_map<std::thread::id, std::vector<Request>> Queues; // Requests waiting for submit(), per thread
+    std::mutex	QueueLock;  // Guards Queues
 
     // Check parameters
     // @param	blocknum    Block to operate on
@@ -18,21 +82,68 @@ private:
     // Throws invalid_argument exception on error.
     void sanity_check(int blocknum, char *data);
 
+    // Transfer blocks to or from disk image, bypassing cache; safe to call
+    // from several threads
+    void read_block(int blocknum, char *data);
+    void write_block(int blocknum, const char *data);
+    void read_run(int start, size_t count, char **buffers);
+    void write_run(int start, size_t count, char **buffers);
+    void transfer_run(int start, size_t count, char **buffers, bool write);
+
+    // Count run of blocks read or written, in total and per kind
+    void count(int start, size_t count, bool write);
+
+    // Record request in the trace, if tracing
+    void trace(TraceType type, int start, size_t count);
+
+    // Write out buffered trace records; caller holds TraceLock
+    void trace_flush();
+
+    // Return number of leading consecutive block numbers
+    static size_t run_length(const int *blocknums, size_t count);
+
+    // Add block to cache, writing back the evicted block if dirty; caller
+    // holds CacheLock
+    void cache_insert(int blocknum, const char *data, bool dirty);
+
+    // Cache misses are read without CacheLock: fill_begin registers the
+    // block, and fill_end caches what was read (data NULL if the read
+    // failed) unless the block was written or discarded meanwhile, copying
+    // a newer cached copy into data instead; caller holds CacheLock
+    void fill_begin(int blocknum);
+    void fill_end(int blocknum, char *data);
+
+    // Write back dirty cached blocks; caller holds CacheLock
+    void flush_cache();
+
+    // Complete queued requests on io_uring or synchronously
+    void submit_ring(std::vector<Request> &queue);
+    void submit_sync(std::vector<Request> &queue);
+
 public:
     // Number of bytes per block
     const static size_t BLOCK_SIZE = 4096;
+
+    // Number of io_uring requests kept in flight
+    const static unsigned URING_DEPTH = 64;
     
     // Default constructor
-    Disk() : FileDescriptor(0), Blocks(0), Reads(0), Writes(0), Mounts(0) {}
+    Disk() : FileDescriptor(0), Mode(BACKEND_PREAD), Mapping(NULL), Blocks(0),
+    	     Reads(0), Writes(0), CacheHits(0), CacheMisses(0), CacheEvictions(0),
+    	     Discards(0), Tracing(false), TraceFile(NULL), Mounts(0), Cache(NULL), Ring(NULL) { reset_kinds(); }
     
-    // Destructor
+    // Destructor; syncs first, reporting a failed write-back on stderr
     ~Disk();
 
     // Open disk image
     // @param	path	    Path to disk image
     // @param	nblocks	    Number of blocks in disk image
+    // @param	backend	    How blocks are transferred
     // Throws runtime_error exception on error.
-    void open(const char *path, size_t nblocks);
+    void open(const char *path, size_t nblocks, Backend backend = BACKEND_PREAD);
+
+    // Return backend in use (BACKEND_PREAD if io_uring was unavailable)
+    Backend backend() const { return Mode; }
 
     // Return size of disk (in terms of blocks)
     size_t size() const { return Blocks; }
@@ -43,8 +154,49 @@ public:
     // Increment mounts
     void mount() { Mounts++; }
 
-    // Decrement mounts
-    void unmount() { if (Mounts > 0) Mounts--; }
+    // Decrement mounts, flushing the cache on last unmount
+    void unmount();
+
+    // Enable write-back block cache (0 disables it); flushes old cache
+    // @param	nblocks	    Number of blocks to cache
+    void set_cache(size_t nblocks);
+
+    // Write all dirty cached blocks and queued requests to disk image
+    void flush();
+
+    // Flush, then msync the mapping
+    void sync();
+
+    // I/O counters
+    size_t reads() const { return Reads; }
+    size_t writes() const { return Writes; }
+    size_t cache_hits() const { return CacheHits; }
+    size_t cache_misses() const { return CacheMisses; }
+    size_t cache_evictions() const { return CacheEvictions; }
+    size_t discards() const { return Discards; }
+    size_t reads(Kind kind) const { return KindReads[kind]; }
+    size_t writes(Kind kind) const { return KindWrites[kind]; }
+
+    // Zero the per-kind counters (the totals above keep counting)
+    void reset_kinds();
+
+    // Record what a run of blocks holds
+    // @param	start	    First block
+    // @param	count	    Number of blocks
+    // @param	kind	    What they hold
+    void set_kind(size_t start, size_t count, Kind kind);
+
+    // Record every read, write and discard of a run of blocks to a trace
+    // file (see trace.h), until stop_trace or the disk is closed
+    // @param	path	    Path to trace file (replaced if it exists)
+    // @return	Whether or not the trace file could be created
+    bool start_trace(const char *path);
+
+    // Write out and close the trace, if any
+    void stop_trace();
+
+    // Every call may be made from several threads at once. Each thread has
+    // its own queue: submit() issues only the requests its caller queued.
 
     // Read block from disk
     // @param	blocknum    Block to read from
@@ -55,4 +207,66 @@ public:
     // @param	blocknum    Block to write to
     // @param	data	    Buffer to write from
     void write(int blocknum, char *data);
+
+    // Read run of consecutive blocks with one vectored call
+    // @param	start	    First block to read from
+    // @param	count	    Number of blocks
+    // @param	buffers	    One buffer per block to read into
+    void readv(int start, size_t count, char **buffers);
+
+    // Write run of consecutive blocks with one vectored call
+    // @param	start	    First block to write to
+    // @param	count	    Number of blocks
+    // @param	buffers	    One buffer per block to write from
+    void writev(int start, size_t count, char **buffers);
+
+    // Read scatter list; consecutive block numbers are coalesced into runs
+    // @param	blocknums   Blocks to read from
+    // @param	count	    Number of blocks
+    // @param	buffers	    One buffer per block to read into
+    void readv(const int *blocknums, size_t count, char **buffers);
+
+    // Write scatter list; consecutive block numbers are coalesced into runs
+    // @param	blocknums   Blocks to write to
+    // @param	count	    Number of blocks
+    // @param	buffers	    One buffer per block to write from
+    void writev(const int *blocknums, size_t count, char **buffers);
+
+    // Discard run of blocks: drop them from the cache and punch a hole in
+    // the disk image so they read back as zeros (falls back to writing
+    // zeros where holes are unsupported)
+    // @param	start	    First block to discard
+    // @param	count	    Number of blocks
+    void discard(int start, size_t count);
+
+    // Return pointer to bytes of the mapped image, or NULL unless BACKEND_MMAP;
+    // only current after flush()
+    // @param	offset	    Byte offset in disk image
+    const char *mapped(off_t offset) const { return Mapping ? Mapping + offset : NULL; }
+
+    // Copy bytes of the disk image to a file descriptor at its current
+    // offset without passing them through user memory (copy_file_range, then
+    // sendfile, then pread/write where neither applies); flushes first
+    // @param	offset	    Byte offset in disk image
+    // @param	length	    Number of bytes
+    // @param	fd	    File descriptor to write to
+    // @return	Number of bytes copied, or -1 on error
+    ssize_t copy_range(off_t offset, size_t length, int fd);
+
+    // Queue block read; data is filled in by the next submit()
+    // @param	blocknum    Block to read from
+    // @param	data	    Buffer to read into
+    void queue_read(int blocknum, char *data);
+
+    // Queue block write; data must stay valid until the next submit()
+    // @param	blocknum    Block to write to
+    // @param	data	    Buffer to write from
+    void queue_write(int blocknum, char *data);
+
+    // Issue all requests queued by this thread and wait for them to
+    // complete. Requests in one batch must not depend on each other.
+    void submit();
+
+    // Return number of requests queued by this thread
+    size_t queued();
 };
@@ -2,9 +2,18 @@
 
 #pragma once
 
+#include "sfs/bitmap.h"
 #include "sfs/disk.h"
+#include "sfs/rwlock.h"
+#include "sfs/stats.h"
+
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
 
 #include <stdint.h>
+#include <string.h>
 
 class FileSystem {
 public:
@@ -12,6 +21,108 @@ public:
     const static uint32_t INODES_PER_BLOCK   = 128;
     const static uint32_t POINTERS_PER_INODE = 5;
     const static uint32_t POINTERS_PER_BLOCK = 1024;
+    const static size_t   FORMAT_RUN_BLOCKS  = 1024;
+    const static uint32_t SCAN_BATCH_BLOCKS  = 64;
+
+    // On-disk format revisions; revision 0 images have no feature flags
+    const static uint32_t FORMAT_REVISION    = 1;
+
+    // Format features (SuperBlock.Features)
+    const static uint32_t FEATURE_BITMAP     = 1 << 0;	// Free bitmap kept on disk
+    const static uint32_t FEATURE_EXTENTS    = 1 << 1;	// Inodes map data with extents
+    const static uint32_t FEATURE_LARGE      = 1 << 2;	// Double/triple indirect, 64-bit sizes
+    const static uint32_t FEATURE_INLINE     = 1 << 3;	// Small files kept inside the inode
+    const static uint32_t FEATURE_COMPRESS   = 1 << 4;	// Data blocks compressed a cluster at a time
+    const static uint32_t FEATURE_DEDUP      = 1 << 5;	// Data blocks with equal contents shared
+    const static uint32_t FEATURES	     = FEATURE_BITMAP | FEATURE_EXTENTS | FEATURE_LARGE | FEATURE_INLINE |
+                                               FEATURE_COMPRESS | FEATURE_DEDUP;
+
+    // Extent inodes keep EXTENTS_PER_INODE extents in Direct[0..3], the
+    // extent count in Direct[4] and the rest in the block at Indirect
+    const static uint32_t EXTENTS_PER_INODE  = 2;
+    const static uint32_t EXTENTS_PER_BLOCK  = 512;
+
+    // Large inodes keep LARGE_DIRECT direct pointers in Direct[0..2], the
+    // double indirect pointer in Direct[3], the triple indirect pointer in
+    // Direct[4], and Size bits 32-55 in Valid bits 8-31
+    const static uint32_t LARGE_DIRECT	     = 3;
+    const static uint32_t LARGE_TREES	     = 3;	// Single, double, triple indirect
+
+    // Inline inodes (INODE_INLINE set in Valid) keep up to INLINE_BYTES of
+    // file data in Direct and Indirect instead of pointers; a write past
+    // INLINE_BYTES moves the data to a block and clears the flag for good
+    const static uint32_t INODE_INLINE	     = 1 << 1;
+    const static uint32_t INLINE_BYTES	     = (POINTERS_PER_INODE + 1) * sizeof(uint32_t);
+
+    // Compressed files (FEATURE_COMPRESS) are written a cluster of
+    // CLUSTER_BLOCKS file blocks at a time. A cluster that compresses into
+    // fewer blocks keeps them in its first pointers, each flagged with
+    // COMPRESSED_BLOCK, and zeros in the rest; other clusters are stored
+    // as is. Not available with extents
+    const static uint32_t CLUSTER_BLOCKS     = 8;
+    const static uint32_t COMPRESSED_BLOCK   = 1u << 31;
+
+    // Deduplicated images (FEATURE_DEDUP) keep a reference table after the
+    // free bitmap: one entry per block with the number of pointers to it and
+    // a hash of its contents, or zeros for a block with at most one pointer
+    // and no known hash. A written data block whose contents match a counted
+    // block (compared in full) shares it instead; shared blocks are copied
+    // on write and freed with their last reference. Needs the free bitmap,
+    // and pointers: not available with extents or compression
+    const static uint32_t REFS_PER_BLOCK     = 512;
+
+    const static size_t   SCRUB_BATCH_BLOCKS = 64;
+    enum FreePolicy {		// What happens to the contents of freed blocks
+    	FREE_ZERO,		// Overwrite with zeros while removing
+    	FREE_LAZY,		// Leave as is; only bitmap and inode change
+    	FREE_DISCARD,		// Punch holes in the disk image, one call per run
+    	FREE_SCRUB,		// Queue and overwrite with zeros a batch at a time later
+    };
+
+    // Sequential reads stage data ahead of the reader; the window starts at
+    // READAHEAD_MIN_BLOCKS and doubles on each sequential read
+    const static uint32_t READAHEAD_MIN_BLOCKS = 8;
+    const static uint32_t READAHEAD_MAX_BLOCKS = 256;
+    const static uint32_t READAHEAD_STAGES     = 8;	// Stages shared by inode number
+    const static uint32_t READAHEAD_STREAMS    = 1024;	// Inodes whose read pattern is kept
+    enum AccessHint {		// Expected access pattern (see advise)
+    	HINT_NORMAL,		// Detect sequential streams
+    	HINT_SEQUENTIAL,	// Read ahead with the full window at once
+    	HINT_RANDOM,		// Never read ahead
+    	HINT_WILLNEED,		// Stage a range now
+    };
+
+    // Locks are striped: inode i uses node lock i % NODE_LOCK_STRIPES and
+    // inode block b uses inode block lock b % INODE_LOCK_STRIPES
+    const static uint32_t NODE_LOCK_STRIPES  = 256;
+    const static uint32_t INODE_LOCK_STRIPES = 64;
+
+    class File;			// Open inode (see open)
+
+    struct ScanStats {		// Result of an inode table scan
+    	unsigned Threads;	// Number of workers used
+    	double	 Seconds;	// Elapsed time
+    	size_t	 Inodes;	// Number of valid inodes
+    	size_t	 Blocks;	// Number of blocks in use, including metadata
+    	size_t	 Invalid;	// Number of pointers past the end of the disk
+    	size_t	 Duplicates;	// Number of blocks claimed more than once
+    	std::vector<size_t> Reads; // Block reads per worker
+    };
+
+    struct CheckReport {	// Result of a consistency check (see check)
+    	ScanStats Scan;		// Inodes, blocks in use, invalid pointers and duplicates
+    	size_t	  BadSizes;	// Number of inodes whose size ends before their last block
+    	size_t	  Leaked;	// Number of unused blocks marked in use (FEATURE_BITMAP)
+    	size_t	  Lost;		// Number of used blocks marked free (FEATURE_BITMAP)
+    	size_t	  BadRefs;	// Number of reference counts that disagree with the pointers (FEATURE_DEDUP)
+    	size_t	  Repairs;	// Number of words, bitmap and reference table blocks rewritten (repair only)
+    };
+
+    struct Span {		// Run of file bytes in the disk image (see spans)
+    	uint64_t    Offset;	// Byte offset in disk image (0 for a hole)
+    	size_t	    Length;	// Number of bytes
+    	const char *Data;	// Bytes in the image mapping (NULL for a hole or unmapped image)
+    };
 
 private:
     struct SuperBlock {		// Superblock structure
@@ -19,6 +130,13 @@ private:
     	uint32_t Blocks;	// Number of blocks in file system
     	uint32_t InodeBlocks;	// Number of blocks reserved for inodes
     	uint32_t Inodes;	// Number of inodes in file system
+    	uint32_t Revision;	// On-disk format revision
+    	uint32_t Features;	// Format features (FEATURE_*)
+    	uint32_t BitmapStart;	// First free bitmap block (FEATURE_BITMAP)
+    	uint32_t BitmapBlocks;	// Number of free bitmap blocks (FEATURE_BITMAP)
+    	uint32_t Clean;		// Whether last unmount was clean (FEATURE_BITMAP)
+    	uint32_t RefStart;	// First reference table block (FEATURE_DEDUP)
+    	uint32_t RefBlocks;	// Number of reference table blocks (FEATURE_DEDUP)
     };
 
     struct Inode {
@@ -28,31 +146,276 @@ private:
     	uint32_t Indirect;	// Indirect pointer
     };
 
+    struct Reference {		// Reference table entry (FEATURE_DEDUP)
+    	uint32_t Count;		// Number of pointers to the block (0 if never shared)
+    	uint32_t Hash;		// Hash of the block contents (see block_hash)
+    };
+
+    struct Extent {		// Run of file blocks
+    	uint32_t Start;		// First disk block (0 for a hole)
+    	uint32_t Length;	// Number of blocks
+    };
+
     union Block {
     	SuperBlock  Super;			    // Superblock
     	Inode	    Inodes[INODES_PER_BLOCK];	    // Inode block
     	uint32_t    Pointers[POINTERS_PER_BLOCK];   // Pointer block
+    	Extent	    Extents[EXTENTS_PER_BLOCK];	    // Extent block
+    	Reference   Refs[REFS_PER_BLOCK];	    // Reference table block
     	char	    Data[Disk::BLOCK_SIZE];	    // Data block
     };
 
-    // TODO: Internal helper functions
+    struct ClusterHeader {	// Start of the first block of a compressed cluster
+    	uint32_t Length;	// Number of compressed bytes that follow
+    	uint32_t Blocks;	// Number of file blocks they hold
+    };
+
+    struct Pending {		// Block written by a request, not yet indexed (see shared_write)
+    	uint32_t    Block;	// Disk block
+    	const char *Data;	// Contents being written
+    };
+
+    struct TreeCache {		// Pointer blocks read by one request (FEATURE_LARGE)
+    	uint32_t BlockNum[LARGE_TREES][LARGE_TREES]; // Cached block per tree and level (0 if none)
+    	bool	 Dirty[LARGE_TREES][LARGE_TREES];    // Whether cached block needs writing
+    	Block	 Blocks[LARGE_TREES][LARGE_TREES];
+    	TreeCache() { memset(BlockNum, 0, sizeof(BlockNum)); memset(Dirty, 0, sizeof(Dirty)); }
+    };
+
+    struct ScanRecord {		// Valid inode found by a scan
+    	uint32_t Inumber;	// Inode number
+    	Inode	 Node;		// Inode contents
+    	std::vector<uint32_t> Pointers[LARGE_TREES]; // Non-zero data pointers below each indirect tree
+    	std::vector<Extent> Extents;	// Extents (FEATURE_EXTENTS)
+    };
 
-    // TODO: Internal member variables
+    struct Repair {		// Word of a block to rewrite (see check)
+    	uint32_t Block;		// Inode or pointer block
+    	uint32_t Word;		// Index of the 32-bit word in the block
+    	uint32_t Value;		// New contents
+    };
+
+    struct CheckState {		// Problems found by a checking scan
+    	size_t	 BadSizes;	// Number of inodes whose size ends before their last block
+    	std::vector<Repair> Repairs; // Words to rewrite to fix invalid pointers and sizes
+    };
+
+    struct ScanWorker;		// Per-thread scan state (scan.cpp)
+
+    struct Stream {		// Read pattern of one inode
+    	size_t	   Next;	// Offset just past the last read
+    	uint32_t   Window;	// Blocks to read ahead (0 if not streaming)
+    	AccessHint Hint;	// Hint given with advise
+    };
+
+    struct Stage {		// Data blocks read ahead for one inode
+    	std::mutex Lock;	// Held while the stage is filled or read
+    	size_t	 Inumber;	// Inode the blocks belong to
+    	size_t	 First;		// First file block staged
+    	size_t	 Count;		// Number of blocks staged (0 if empty)
+    	std::vector<Block> Blocks;
+    	Stage() : Inumber(0), First(0), Count(0) {}
+    };
+
+    // Internal helper functions
+    bool open_node(File *file);
+    ssize_t read_file(File *file, char *data, size_t length, size_t offset);
+    ssize_t write_file(File *file, char *data, size_t length, size_t offset);
+    void flush_file(File *file);
+    std::vector<Extent> &file_extents(File *file);
+    void map_blocks(File *file, size_t first, size_t count, std::vector<int> &blocks);
+    uint32_t stream_window(size_t inumber, size_t offset, size_t length);
+    bool staged(size_t inumber, size_t first, size_t last) const;
+    void stage_fill(File *file, size_t first, size_t count);
+    void stage_drop(size_t inumber);
+    ssize_t stage_read(File *file, size_t size, size_t window, char *data, size_t length, size_t offset);
+    Stage &stage_of(size_t inumber) { return this->stages[inumber % READAHEAD_STAGES]; }
+    RWLock &node_lock(size_t inumber) { return this->node_locks[inumber % NODE_LOCK_STRIPES]; }
+    std::mutex &inode_block_lock(uint32_t index) { return this->inode_block_locks[index % INODE_LOCK_STRIPES]; }
+    File *find_file(size_t inumber);
+    ssize_t map_spans(File *file, size_t offset, size_t length, std::vector<Span> &spans);
+    ssize_t copy_read(File *file, int fd);
+    void load_extents(Inode *node, std::vector<Extent> &extents);
+    bool save_extents(Inode *node, const std::vector<Extent> &extents);
+    bool allocate_extents(File *file, size_t first, size_t last, std::vector<int> &blocks, std::vector<int> &fresh);
+    int allocate_run(uint32_t goal, uint32_t want, uint32_t *got);
+    int tree_block(Inode *node, TreeCache &cache, size_t index, bool allocate, std::vector<int> *fresh);
+    uint32_t *tree_slot(Inode *node, TreeCache &cache, size_t index, bool allocate, bool **dirty);
+    void tree_flush(TreeCache &cache);
+    void free_tree(uint32_t block_num, uint32_t level, std::vector<int> &freed);
+    static uint32_t *tree_root(Inode *node, uint32_t tree);
+    static bool is_inline(const Inode *node, uint32_t features);
+    static char *inline_data(Inode *node) { return (char *)node->Direct; }
+    bool unpack_inline(File *file);
+    uint32_t *block_slot(File *file, size_t index, bool allocate, bool **dirty);
+    void cluster_map(File *file, size_t base, size_t count, uint32_t *slots);
+    bool cluster_load(const uint32_t *slots, size_t count, unsigned wanted, Block *cluster);
+    bool cluster_write(File *file, size_t base, size_t count, const char *data, size_t length, size_t offset);
+    ssize_t compressed_read(File *file, char *data, size_t length, size_t offset);
+    ssize_t compressed_write(File *file, char *data, size_t length, size_t offset, size_t max_blocks);
+    static uint32_t data_mask(uint32_t features) { return (features & FEATURE_COMPRESS) ? ~COMPRESSED_BLOCK : ~0u; }
+    static uint32_t block_hash(const char *data);
+    uint32_t share_block(uint32_t old, const char *data, std::unordered_map<uint32_t, Pending> &written,
+                         std::vector<int> &dropped, bool *write);
+    void unindex(uint32_t block_num);
+    ssize_t shared_write(File *file, char *data, size_t length, size_t offset, size_t max_blocks);
+    void drop_references(std::vector<int> &freed);
+    void set_reference(uint32_t block_num, uint32_t count, uint32_t hash);
+    void count_references(const std::vector<uint32_t> &counts);
+    bool load_references();
+    void save_references();
+    static uint64_t node_size(const Inode *node, uint32_t features);
+    static void set_node_size(Inode *node, uint64_t size, uint32_t features);
+    static void map_extents(const std::vector<Extent> &extents, size_t first, size_t count, std::vector<int> &blocks);
+    static void append_extent(std::vector<Extent> &extents, Extent extent);
+    static void splice_extent(std::vector<Extent> &extents, uint32_t logical, uint32_t start, uint32_t count);
+    Block *load_inode_block(uint32_t index);
+    void mark_dirty(uint32_t index);
+    void flush_inodes();
+    static size_t allocation_group(size_t groups);
+    int allocate_block();
+    void release_blocks(std::vector<int> &freed);
+    bool load_bitmap();
+    void save_bitmap();
+    void write_super(bool clean);
+    uint32_t metadata_end() const { return this->bitmap_start + this->bitmap_blocks + this->ref_blocks; }
+    static void clear_blocks(Disk *disk, size_t start, size_t end);
+    static void mark_layout(Disk *disk, const SuperBlock &super);
+    void mark_indirect(uint32_t block_num) { this->disk->set_kind(block_num, 1, Disk::KIND_INDIRECT); }
+    static void write_bitmap_block(Disk *disk, const Bitmap &bitmap, uint32_t bitmap_start, size_t region);
+    static bool valid_super(const SuperBlock &super, uint32_t blocks);
+    static void scan_inodes(Disk *disk, const SuperBlock &super, unsigned threads, Bitmap *bitmap,
+                            Bitmap *inode_map, std::vector<ScanRecord> *records, ScanStats *stats,
+                            CheckState *check = NULL, std::vector<uint32_t> *counts = NULL);
+
+    // Internal member variables
     Disk *disk;
     uint32_t blocks;
     uint32_t inode_blocks;
     uint32_t inodes;
-    int bitmap[200];
+    uint32_t features;
+    uint32_t bitmap_start;
+    uint32_t bitmap_blocks;
+    uint32_t ref_blocks;
+    unsigned scan_threads;
+    FreePolicy free_policy;
+    std::vector<int> scrub_queue;	    // Freed blocks still to be zeroed (FREE_SCRUB)
+
+    // Free block bitmap. Each bitmap region is an allocation group with its
+    // own free count; blocks are claimed and released with atomic updates
+    // of the bitmap words, so writers never wait for each other to allocate
+    Bitmap bitmap;
+
+    // Reference table (FEATURE_DEDUP), resident while mounted and written
+    // back at unmount and sync; index maps the hash of each block with
+    // references to it. A mount after an unclean unmount counts references
+    // from the inode table again
+    std::vector<Reference> refs;
+    std::vector<uint8_t> refs_dirty;	    // Table blocks changed since last save
+    std::unordered_map<uint32_t, uint32_t> ref_index; // Content hash -> block
+
+    // Resident inode table: inode blocks are read once, kept in inode_cache
+    // and written back together at the end of each operation. A deque keeps
+    // blocks in place as it grows, so they can be used outside inode_lock
+    std::deque<Block> inode_cache;	    // Resident inode blocks
+    std::vector<uint32_t> inode_slots;	    // Inode block -> inode_cache index + 1, 0 if not resident
+    std::vector<uint32_t> inode_dirty;	    // Inode blocks changed since last flush
+    Bitmap inode_map;			    // Set if inode is valid (or not yet known)
+    uint32_t inode_known;		    // Inode blocks below this are in inode_map
+
+    std::unordered_map<size_t, File *> files;	// Open handles by inode
+    Stats op_stats;				// Operation counts, latencies and bytes copied
+
+    // Readahead state (readahead.cpp)
+    std::unordered_map<size_t, Stream> streams;
+    Stage stages[READAHEAD_STAGES];
+
+    // Locks, in the order they are taken: mount_lock (exclusive for mount,
+    // unmount, sync and policy changes, shared otherwise), then one node
+    // lock (shared to read an inode, exclusive to change it), then a
+    // handle's Lock, a stage's Lock, and last any one of the rest
+    RWLock mount_lock;
+    RWLock node_locks[NODE_LOCK_STRIPES];
+    std::mutex inode_block_locks[INODE_LOCK_STRIPES];	// Contents of resident inode blocks
+    std::mutex inode_lock;	    // inode_cache, inode_slots, inode_dirty, inode_map, inode_known
+    mutable std::mutex alloc_lock;  // scrub_queue and free bitmap block writes
+    std::mutex files_lock;	    // files
+    std::mutex stream_lock;	    // streams
+    std::mutex ref_lock;	    // refs, refs_dirty, ref_index
 
 public:
-    static void debugInodeBlock(Disk *disk, int inode_block_num);
-    static void readIndirectBlock(Disk *disk, int block_num);
-    static void debug(Disk *disk);
-    static bool format(Disk *disk);
+    // Every FileSystem call may be made from several threads at once, except
+    // that mount, unmount and sync wait for all other calls. A handle may be
+    // shared between threads too, but its offset is not kept consistent:
+    // threads sharing an open inode should use read and write below, which
+    // take explicit offsets
+    class File {
+    public:
+    	// Read or write at the current offset and move past the data
+    	ssize_t read(char *data, size_t length);
+    	ssize_t write(char *data, size_t length);
+
+    	// Set current offset; returns it
+    	size_t seek(size_t offset) { Offset = offset; return Offset; }
+    	size_t tell() const { return Offset; }
+
+    	// Return size of file, or -1 once the file system is unmounted
+    	ssize_t size() const;
+
+    	// Write back inode and pointer blocks changed since open
+    	bool fsync();
+
+    	// Write back, then free the handle
+    	bool close();
+
+    private:
+    	friend class FileSystem;
+    	File(FileSystem *fs, size_t inumber, bool transient);
+
+    	FileSystem *FS;		// Owning file system (NULL once unmounted)
+    	std::mutex Lock;	// Serializes readers filling the caches below
+    	size_t	   Inumber;	// Inode number
+    	size_t	   Offset;	// Current offset
+    	bool	   Transient;	// Made for a single read or write call
+    	Inode	   Node;	// Decoded inode
+    	bool	   NodeDirty;	// Whether Node needs saving
+    	Block	   Indirect;	// Indirect pointer block (legacy inodes)
+    	bool	   IndirectLoaded;
+    	bool	   IndirectDirty;
+    	std::vector<Extent> Extents;	// Extent list (FEATURE_EXTENTS)
+    	bool	   ExtentsLoaded;
+    	TreeCache  Tree;	// Pointer blocks (FEATURE_LARGE)
+    };
+
+    FileSystem() : disk(NULL), blocks(0), inode_blocks(0), inodes(0), features(0),
+                   bitmap_start(0), bitmap_blocks(0), ref_blocks(0), scan_threads(1),
+                   free_policy(FREE_ZERO), inode_known(0) {}
+    ~FileSystem() { unmount(); }
+
+    static void debug(Disk *disk, unsigned threads = 1);
+    static bool scan(Disk *disk, unsigned threads, ScanStats *stats);
+
+    // Check an unmounted image: superblock geometry, every pointer for
+    // range and duplicates, inode sizes against their blocks and the free
+    // bitmap against the blocks in use; a block shared as the reference
+    // table records (FEATURE_DEDUP) is no duplicate. With repair, invalid
+    // pointers are cleared, sizes extended over their blocks and the free
+    // bitmap and reference table rewritten; duplicates are only reported.
+    // Returns false if the disk is mounted or the superblock is invalid
+    static bool check(Disk *disk, unsigned threads, bool repair, CheckReport *report);
+    static bool format(Disk *disk, uint32_t features = 0, bool fast = false);
     // static bool remove_inode(Disk *disk, int inumber);
 
     void get_bitmap(Block block);
+    void set_scan_threads(unsigned threads) { scan_threads = threads > 0 ? threads : 1; }
+    unsigned get_scan_threads() const { return scan_threads; }
+    void set_free_policy(FreePolicy policy);
+    FreePolicy get_free_policy() const { return free_policy; }
+    size_t scrub(size_t max);
+    size_t scrub_pending() const;
     bool mount(Disk *disk);
+    void unmount();
+    void sync();
     ssize_t load_node(size_t inumber, Inode *node);
     bool save_node(size_t inumber, Inode *node);
     void init_data_block(int block_num);
@@ -63,5 +426,27 @@ public:
 
     ssize_t read(size_t inumber, char *data, size_t length, size_t offset);
     ssize_t write(size_t inumber, char *data, size_t length, size_t offset);
+    bool    advise(size_t inumber, size_t offset, size_t length, AccessHint hint);
+
+    // Append runs of the disk image holding file bytes [offset, offset +
+    // length), after flushing pending writes so the image is current;
+    // returns number of bytes mapped, or -1 if the inode is invalid or its
+    // data is compressed (FEATURE_COMPRESS)
+    ssize_t spans(size_t inumber, size_t offset, size_t length, std::vector<Span> &spans);
+
+    // Copy whole file to fd at its current offset, straight from the disk
+    // image (through read for compressed data); returns number of bytes
+    // copied, or -1 on error
+    ssize_t copy_to(size_t inumber, int fd);
+
+    // Copy out call counts and latencies of create, remove, stat, read,
+    // write and mount, and bytes copied; disk I/O per block kind is kept by
+    // the Disk (Disk::reads(Kind)). reset_stats zeroes both
+    void get_stats(Stats::Snapshot *snapshot) const;
+    void reset_stats();
+
+    // Open inode for a series of reads and writes; NULL if it is invalid or
+    // already open. Release with File::close
+    File   *open(size_t inumber);
     int get_free_block();
 };
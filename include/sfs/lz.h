@@ -0,0 +1,41 @@
+// lz.h: Small LZ77 block codec
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+// Blocks are a series of sequences, as in LZ4: a token byte holding the
+// literal count and the match length - MIN_MATCH (15 in either half means
+// more length bytes follow, 255 meaning yet more), the literals, then a
+// 16-bit match offset; the last sequence stops after its literals
+
+class LZ {
+public:
+    const static size_t MIN_MATCH  = 4;
+    const static size_t MAX_OFFSET = 65535;
+
+    // Compress a buffer
+    // @param	src	    Bytes to compress
+    // @param	length	    Number of bytes
+    // @param	dst	    Buffer for the compressed block
+    // @param	capacity    Size of dst
+    // @return	Compressed length, or 0 if it does not fit in capacity
+    static size_t compress(const char *src, size_t length, char *dst, size_t capacity);
+
+    // Decompress a block
+    // @param	src	    Compressed block
+    // @param	length	    Length of the block
+    // @param	dst	    Buffer for the bytes
+    // @param	capacity    Size of dst
+    // @return	Decompressed length, or -1 if the block is corrupt or does
+    //		not fit in capacity
+    static ssize_t decompress(const char *src, size_t length, char *dst, size_t capacity);
+
+private:
+    const static size_t HASH_BITS = 12;
+
+    // Append one sequence to out, unless it would pass end
+    static bool emit(uint8_t *&out, uint8_t *end, const uint8_t *literals, size_t count, size_t offset, size_t match);
+};
@@ -0,0 +1,41 @@
+// rwlock.h: Reader-writer lock
+
+#pragma once
+
+#include <pthread.h>
+
+class RWLock {
+private:
+    pthread_rwlock_t Lock;
+
+public:
+    // Constructor
+    RWLock() { pthread_rwlock_init(&Lock, NULL); }
+
+    // Destructor
+    ~RWLock() { pthread_rwlock_destroy(&Lock); }
+
+    RWLock(const RWLock &) = delete;
+    RWLock &operator=(const RWLock &) = delete;
+
+    // Take or release lock exclusively (usable with std::lock_guard)
+    void lock() { pthread_rwlock_wrlock(&Lock); }
+    void unlock() { pthread_rwlock_unlock(&Lock); }
+
+    // Take or release lock shared with other readers
+    void lock_shared() { pthread_rwlock_rdlock(&Lock); }
+    void unlock_shared() { pthread_rwlock_unlock(&Lock); }
+};
+
+// Hold an RWLock shared for the lifetime of the guard
+class SharedGuard {
+private:
+    RWLock &Lock;
+
+public:
+    explicit SharedGuard(RWLock &lock) : Lock(lock) { Lock.lock_shared(); }
+    ~SharedGuard() { Lock.unlock_shared(); }
+
+    SharedGuard(const SharedGuard &) = delete;
+    SharedGuard &operator=(const SharedGuard &) = delete;
+};
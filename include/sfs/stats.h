@@ -0,0 +1,107 @@
+// stats.h: File system operation statistics
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// Counters are updated with relaxed atomic adds from any thread; a snapshot
+// taken while operations run may mix counts from before and after them
+
+class Stats {
+public:
+    // Operations timed
+    enum Operation {
+    	OP_CREATE,
+    	OP_REMOVE,
+    	OP_STAT,
+    	OP_READ,
+    	OP_WRITE,
+    	OP_MOUNT,
+    	OPERATIONS
+    };
+
+    // Latency buckets: bucket i counts calls that took [2^i, 2^(i+1)) ns
+    const static size_t BUCKETS = 40;
+
+    // Counts of one operation, copied out of Stats
+    struct Histogram {
+    	uint64_t Calls;		    // Number of calls
+    	uint64_t Nanoseconds;	    // Total time spent
+    	uint64_t Max;		    // Longest call (ns)
+    	uint64_t Buckets[BUCKETS];  // Calls per latency bucket
+
+    	// Return upper bound of the bucket holding percentile p (0 to 1) of
+    	// calls, in nanoseconds, or 0 without calls
+    	uint64_t percentile(double p) const;
+    };
+
+    // Copy of every counter at one point in time
+    struct Snapshot {
+    	Histogram Operations[OPERATIONS];
+    	uint64_t  BytesRead;	    // Bytes copied out of files
+    	uint64_t  BytesWritten;	    // Bytes copied into files
+    };
+
+    // Times one call, recording it when it goes out of scope; meanwhile
+    // current() returns its operation
+    class Timer {
+    public:
+    	Timer(Stats &stats, Operation op) : Owner(stats), Op(op), Previous(enter(op)), Start(std::chrono::steady_clock::now()) {}
+    	~Timer() {
+    	    Owner.record(Op, std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count());
+    	    enter(Previous);
+    	}
+
+    	Timer(const Timer &) = delete;
+    	Timer &operator=(const Timer &) = delete;
+
+    private:
+    	Stats	 &Owner;
+    	Operation Op;
+    	Operation Previous;
+    	std::chrono::steady_clock::time_point Start;
+    };
+
+    // Return name of operation
+    static const char *name(Operation op);
+
+    // Return operation the calling thread is timing, or OPERATIONS if none
+    static Operation current();
+
+    // Default constructor
+    Stats() { reset(); }
+
+    // Record one call
+    // @param	op	    Operation called
+    // @param	nanoseconds Time it took
+    void record(Operation op, uint64_t nanoseconds);
+
+    // Count bytes copied out of or into files
+    void add_read(uint64_t bytes) { BytesRead.fetch_add(bytes, std::memory_order_relaxed); }
+    void add_written(uint64_t bytes) { BytesWritten.fetch_add(bytes, std::memory_order_relaxed); }
+
+    // Copy out every counter
+    void snapshot(Snapshot *snapshot) const;
+
+    // Zero every counter
+    void reset();
+
+private:
+    // Make op the calling thread's current operation; returns the last one
+    static Operation enter(Operation op);
+
+    struct Counters {
+    	std::atomic<uint64_t> Calls;
+    	std::atomic<uint64_t> Nanoseconds;
+    	std::atomic<uint64_t> Max;
+    	std::atomic<uint64_t> Buckets[BUCKETS];
+    };
+
+    Counters Operations[OPERATIONS];
+    std::atomic<uint64_t> BytesRead;
+    std::atomic<uint64_t> BytesWritten;
+};
@@ -0,0 +1,36 @@
+// trace.h: Block I/O trace format
+
+#pragma once
+
+#include <stdint.h>
+
+// A trace is a TraceHeader followed by TraceRecords in the order requests
+// reached the Disk; each record is one read, write or discard of a run of
+// consecutive blocks
+
+const char     TRACE_MAGIC[8] = {'S', 'F', 'S', 'T', 'R', 'A', 'C', 'E'};
+const uint32_t TRACE_VERSION  = 1;
+
+enum TraceType {
+    TRACE_READ,		// Read run (through the cache, if any)
+    TRACE_WRITE,	// Write run (through the cache, if any)
+    TRACE_DISCARD,	// Discard run
+};
+
+struct TraceHeader {
+    char     Magic[8];	    // TRACE_MAGIC
+    uint32_t Version;	    // TRACE_VERSION
+    uint32_t BlockSize;	    // Bytes per block
+    uint64_t Blocks;	    // Blocks in the traced disk image
+    uint64_t Reserved;
+};
+
+struct TraceRecord {
+    uint64_t Time;	    // Nanoseconds since tracing started
+    uint32_t Block;	    // First block
+    uint32_t Count;	    // Number of blocks
+    uint32_t Thread;	    // Calling thread, numbered from 0 in order of first request
+    uint8_t  Type;	    // TraceType
+    uint8_t  Operation;	    // Stats::Operation the thread was in, or Stats::OPERATIONS
+    uint16_t Reserved;
+};
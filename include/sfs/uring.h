@@ -0,0 +1,77 @@
+// uring.h: Minimal io_uring submission/completion ring
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+class IoRing {
+private:
+    int	    RingFd;	    // io_uring file descriptor (-1 if unavailable)
+    unsigned Entries;	    // Number of submission queue entries
+
+    // Submission queue
+    void     *SqRing;
+    size_t    SqRingSize;
+    unsigned *SqHead;
+    unsigned *SqTail;
+    unsigned *SqMask;
+    unsigned *SqArray;
+    void     *Sqes;
+    size_t    SqesSize;
+
+    // Completion queue
+    void     *CqRing;
+    size_t    CqRingSize;
+    unsigned *CqHead;
+    unsigned *CqTail;
+    unsigned *CqMask;
+    void     *Cqes;
+
+    unsigned  Queued;	    // Entries prepared but not yet submitted
+
+public:
+    // Default constructor
+    IoRing() : RingFd(-1), Entries(0), SqRing(NULL), SqRingSize(0), Sqes(NULL),
+    	       SqesSize(0), CqRing(NULL), CqRingSize(0), Queued(0) {}
+
+    // Destructor
+    ~IoRing();
+
+    // Create ring
+    // @param	entries	    Queue depth
+    // @return	Whether or not io_uring is available
+    bool setup(unsigned entries);
+
+    // Return whether or not ring was created
+    bool ready() const { return RingFd >= 0; }
+
+    // Return queue depth
+    unsigned depth() const { return Entries; }
+
+    // Prepare vectored read or write; iov must stay valid until completion
+    // @param	write	    Whether to write instead of read
+    // @param	fd	    File to transfer to or from
+    // @param	iov	    Buffers
+    // @param	nr	    Number of buffers
+    // @param	offset	    File offset
+    // @param	user_data   Value returned with the completion
+    void prepare(bool write, int fd, const struct iovec *iov, unsigned nr, off_t offset, uint64_t user_data);
+
+    // Submit prepared entries and wait for completions
+    // @param	min_complete	Number of completions to wait for
+    // @return	Number of entries submitted, or -1 with errno set
+    int submit(unsigned min_complete);
+
+    // Take back entries prepared but not submitted, after submit failed
+    // @return	Number of entries withdrawn (the last ones prepared)
+    unsigned withdraw();
+
+    // Pop one completion
+    // @param	user_data   Set to value given to prepare
+    // @param	result	    Set to bytes transferred or -errno
+    // @return	Whether or not a completion was available
+    bool reap(uint64_t *user_data, int *result);
+};
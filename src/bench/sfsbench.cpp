@@ -0,0 +1,521 @@
+// sfsbench.cpp: Simple file system benchmarks
+
+#include "sfs/disk.h"
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <string>
+#include <stdexcept>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Macros
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+// Benchmark settings
+
+struct Options {
+    std::string     Path;	// Scratch disk image
+    size_t	    Blocks;	// Size of scratch disk image
+    uint32_t	    Features;	// Features to format with
+    Disk::Backend   Backend;	// How blocks move to and from the image
+    size_t	    Cache;	// Block cache size (0 disables it)
+    size_t	    Files;	// Inodes per create/remove storm
+    size_t	    FileSize;	// Bytes per file for read, write and copy benchmarks
+    size_t	    Rounds;	// Repetitions of format, mount and copy benchmarks
+    unsigned	    Seed;	// Seed for random offsets
+    bool	    Machine;	// Print tab-separated results
+    bool	    Keep;	// Keep the scratch image
+};
+
+// Measurements of one benchmark
+
+struct Result {
+    std::string		Name;
+    std::vector<double> Latencies;	// Seconds per operation
+    size_t		Bytes;		// Bytes moved by all operations
+    size_t		Reads;		// Disk block reads by all operations
+    size_t		Writes;		// Disk block writes by all operations
+};
+
+// Times operations one at a time, counting only the disk I/O they do
+
+class Recorder {
+private:
+    Disk       &Device;
+    Result	Current;
+    size_t	Reads;
+    size_t	Writes;
+    std::chrono::steady_clock::time_point Start;
+
+public:
+    Recorder(Disk &disk, const std::string &name) : Device(disk), Reads(0), Writes(0) {
+    	Current.Name   = name;
+    	Current.Bytes  = 0;
+    	Current.Reads  = 0;
+    	Current.Writes = 0;
+    }
+
+    void begin() {
+    	Reads  = Device.reads();
+    	Writes = Device.writes();
+    	Start  = std::chrono::steady_clock::now();
+    }
+
+    void end(size_t bytes = 0) {
+    	Current.Latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count());
+    	Current.Bytes  += bytes;
+    	Current.Reads  += Device.reads() - Reads;
+    	Current.Writes += Device.writes() - Writes;
+    }
+
+    const Result &result() const { return Current; }
+};
+
+// Benchmark prototypes
+
+typedef void (*Benchmark)(Disk &disk, const Options &options, std::vector<Result> &results);
+
+void bench_format(Disk &disk, const Options &options, std::vector<Result> &results);
+void bench_mount(Disk &disk, const Options &options, std::vector<Result> &results);
+void bench_create(Disk &disk, const Options &options, std::vector<Result> &results);
+void bench_io(Disk &disk, const Options &options, std::vector<Result> &results);
+void bench_copy(Disk &disk, const Options &options, std::vector<Result> &results);
+void bench_full(Disk &disk, const Options &options, std::vector<Result> &results);
+
+bool selected(const std::vector<std::string> &names, const char *name);
+bool parse_features(char *list, uint32_t *features);
+void report(const Options &options, const std::vector<Result> &results);
+void usage(const char *program);
+
+// Benchmarks, in the order they run; mount-full goes last as it fills the disk
+
+struct Entry {
+    const char *Name;
+    Benchmark	Run;
+} BENCHMARKS[] = {
+    {"format",	    bench_format},
+    {"mount",	    bench_mount},
+    {"create",	    bench_create},
+    {"io",	    bench_io},
+    {"copy",	    bench_copy},
+    {"full",	    bench_full},
+};
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    Options options;
+    options.Path     = "sfsbench." + std::to_string(getpid()) + ".img";
+    options.Blocks   = 20000;
+    options.Features = 0;
+    options.Backend  = Disk::BACKEND_PREAD;
+    options.Cache    = 0;
+    options.Files    = 1000;
+    options.FileSize = 0;
+    options.Rounds   = 10;
+    options.Seed     = 1;
+    options.Machine  = false;
+    options.Keep     = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "b:B:c:d:f:F:kmn:r:s:h")) != -1) {
+    	switch (c) {
+    	    case 'b': options.Blocks = strtoul(optarg, NULL, 0); break;
+    	    case 'c': options.Cache = strtoul(optarg, NULL, 0); break;
+    	    case 'd': options.Path = optarg; break;
+    	    case 'k': options.Keep = true; break;
+    	    case 'm': options.Machine = true; break;
+    	    case 'n': options.Files = strtoul(optarg, NULL, 0); break;
+    	    case 'r': options.Rounds = std::max(1ul, strtoul(optarg, NULL, 0)); break;
+    	    case 's': options.FileSize = strtoul(optarg, NULL, 0); break;
+    	    case 'F': options.Seed = strtoul(optarg, NULL, 0); break;
+    	    case 'f':
+		if (!parse_features(optarg, &options.Features)) {
+		    fprintf(stderr, "Unknown feature in %s\n", optarg);
+		    return EXIT_FAILURE;
+		}
+		break;
+    	    case 'B':
+		if (streq(optarg, "mmap")) {
+		    options.Backend = Disk::BACKEND_MMAP;
+		} else if (streq(optarg, "uring")) {
+		    options.Backend = Disk::BACKEND_URING;
+		} else if (!streq(optarg, "pread")) {
+		    fprintf(stderr, "Unknown backend: %s\n", optarg);
+		    return EXIT_FAILURE;
+		}
+		break;
+    	    default:
+		usage(argv[0]);
+		return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+    }
+
+    // Files default to a quarter of the disk, at most 4 MiB
+    if (options.FileSize == 0) {
+    	options.FileSize = std::min((size_t)4 << 20, options.Blocks * Disk::BLOCK_SIZE / 4);
+    }
+
+    // Benchmarks named on the command line, or all of them
+    std::vector<std::string> names(argv + optind, argv + argc);
+    for (size_t i = 0; i < names.size(); i++) {
+    	bool known = false;
+    	for (size_t j = 0; j < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); j++) {
+    	    known = known || names[i] == BENCHMARKS[j].Name;
+	}
+    	if (!known) {
+    	    fprintf(stderr, "Unknown benchmark: %s\n", names[i].c_str());
+    	    return EXIT_FAILURE;
+	}
+    }
+
+    // Disk prints its totals when it goes away, ahead of the results
+    std::vector<Result> results;
+    {
+    	Disk disk;
+    	unlink(options.Path.c_str());
+    	try {
+    	    disk.open(options.Path.c_str(), options.Blocks, options.Backend);
+	} catch (std::runtime_error &e) {
+	    fprintf(stderr, "Unable to open disk %s: %s\n", options.Path.c_str(), e.what());
+	    return EXIT_FAILURE;
+	}
+    	disk.set_cache(options.Cache);
+    	if (!FileSystem::format(&disk, options.Features)) {
+    	    fprintf(stderr, "Unable to format disk %s with features %u\n", options.Path.c_str(), options.Features);
+    	    unlink(options.Path.c_str());
+    	    return EXIT_FAILURE;
+	}
+
+    	for (size_t i = 0; i < sizeof(BENCHMARKS) / sizeof(BENCHMARKS[0]); i++) {
+    	    if (selected(names, BENCHMARKS[i].Name)) {
+    	    	BENCHMARKS[i].Run(disk, options, results);
+	    }
+	}
+    }
+    report(options, results);
+
+    if (!options.Keep) {
+    	unlink(options.Path.c_str());
+    }
+    return EXIT_SUCCESS;
+}
+
+// Benchmark functions
+
+void bench_format(Disk &disk, const Options &options, std::vector<Result> &results) {
+    const char *names[] = {"format", "format-fast"};
+    for (int fast = 0; fast < 2; fast++) {
+    	Recorder recorder(disk, names[fast]);
+    	for (size_t i = 0; i < options.Rounds; i++) {
+    	    recorder.begin();
+    	    FileSystem::format(&disk, options.Features, fast);
+    	    recorder.end();
+	}
+    	results.push_back(recorder.result());
+    }
+}
+
+void bench_mount(Disk &disk, const Options &options, std::vector<Result> &results) {
+    FileSystem::format(&disk, options.Features);
+
+    Recorder recorder(disk, "mount-empty");
+    for (size_t i = 0; i < options.Rounds; i++) {
+    	FileSystem fs;
+    	recorder.begin();
+    	fs.mount(&disk);
+    	recorder.end();
+    	fs.unmount();
+    }
+    results.push_back(recorder.result());
+}
+
+void bench_create(Disk &disk, const Options &options, std::vector<Result> &results) {
+    FileSystem::format(&disk, options.Features);
+    FileSystem fs;
+    fs.mount(&disk);
+
+    // Each inode gets one block, so removes have data to free
+    char data[Disk::BLOCK_SIZE];
+    memset(data, 'c', sizeof(data));
+    std::vector<ssize_t> inodes;
+    Recorder creates(disk, "create");
+    for (size_t i = 0; i < options.Files; i++) {
+    	creates.begin();
+    	ssize_t inumber = fs.create();
+    	creates.end();
+    	if (inumber < 0) {
+    	    break;
+	}
+    	fs.write(inumber, data, sizeof(data), 0);
+    	inodes.push_back(inumber);
+    }
+    results.push_back(creates.result());
+
+    Recorder removes(disk, "remove");
+    for (size_t i = 0; i < inodes.size(); i++) {
+    	removes.begin();
+    	fs.remove(inodes[i]);
+    	removes.end();
+    }
+    results.push_back(removes.result());
+    fs.unmount();
+}
+
+void bench_io(Disk &disk, const Options &options, std::vector<Result> &results) {
+    const size_t sizes[] = {4096, 65536, 1 << 20};
+    const char  *labels[] = {"4k", "64k", "1m"};
+    std::mt19937 random(options.Seed);
+
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    	size_t size = sizes[s];
+    	if (size > options.FileSize) {
+    	    break;
+	}
+    	FileSystem::format(&disk, options.Features);
+    	FileSystem fs;
+    	fs.mount(&disk);
+    	ssize_t inumber = fs.create();
+    	std::vector<char> buffer(size, 'w');
+    	std::string label = labels[s];
+
+    	Recorder seq_write(disk, "seq-write-" + label);
+    	for (size_t offset = 0; offset + size <= options.FileSize; offset += size) {
+    	    seq_write.begin();
+    	    ssize_t result = fs.write(inumber, buffer.data(), size, offset);
+    	    seq_write.end(std::max(result, (ssize_t)0));
+	}
+    	results.push_back(seq_write.result());
+
+    	// Random offsets stay within what was written and on size boundaries
+    	size_t length = std::max(fs.stat(inumber), (ssize_t)size);
+    	size_t count  = std::max(length / size, (size_t)64);
+    	std::uniform_int_distribution<size_t> slot(0, length / size - 1);
+
+    	Recorder seq_read(disk, "seq-read-" + label);
+    	for (size_t offset = 0; offset + size <= length; offset += size) {
+    	    seq_read.begin();
+    	    ssize_t result = fs.read(inumber, buffer.data(), size, offset);
+    	    seq_read.end(std::max(result, (ssize_t)0));
+	}
+    	results.push_back(seq_read.result());
+
+    	Recorder rand_write(disk, "rand-write-" + label);
+    	for (size_t i = 0; i < count; i++) {
+    	    size_t offset = slot(random) * size;
+    	    rand_write.begin();
+    	    ssize_t result = fs.write(inumber, buffer.data(), size, offset);
+    	    rand_write.end(std::max(result, (ssize_t)0));
+	}
+    	results.push_back(rand_write.result());
+
+    	Recorder rand_read(disk, "rand-read-" + label);
+    	for (size_t i = 0; i < count; i++) {
+    	    size_t offset = slot(random) * size;
+    	    rand_read.begin();
+    	    ssize_t result = fs.read(inumber, buffer.data(), size, offset);
+    	    rand_read.end(std::max(result, (ssize_t)0));
+	}
+    	results.push_back(rand_read.result());
+    	fs.unmount();
+    }
+}
+
+void bench_copy(Disk &disk, const Options &options, std::vector<Result> &results) {
+    // Host files live next to the image
+    std::string input  = options.Path + ".in";
+    std::string output = options.Path + ".out";
+    FILE *stream = fopen(input.c_str(), "w");
+    if (stream == nullptr) {
+    	fprintf(stderr, "Unable to open %s: %s\n", input.c_str(), strerror(errno));
+    	return;
+    }
+    std::vector<char> pattern(options.FileSize);
+    for (size_t i = 0; i < pattern.size(); i++) {
+    	pattern[i] = 'a' + i % 26;
+    }
+    fwrite(pattern.data(), 1, pattern.size(), stream);
+    fclose(stream);
+
+    FileSystem::format(&disk, options.Features);
+    FileSystem fs;
+    fs.mount(&disk);
+    ssize_t inumber = fs.create();
+
+    // copyin: stream the host file through a handle, as sfssh does
+    Recorder copyin(disk, "copyin");
+    for (size_t i = 0; i < options.Rounds; i++) {
+    	char buffer[4*BUFSIZ];
+    	size_t copied = 0;
+    	copyin.begin();
+    	FILE *source = fopen(input.c_str(), "r");
+    	FileSystem::File *file = fs.open(inumber);
+    	while (file) {
+    	    ssize_t result = fread(buffer, 1, sizeof(buffer), source);
+    	    if (result <= 0 || file->write(buffer, result) != result) {
+    	    	break;
+	    }
+	    copied += result;
+	}
+    	if (file) {
+    	    file->close();
+	}
+    	fclose(source);
+    	copyin.end(copied);
+    }
+    results.push_back(copyin.result());
+
+    // copyout: data runs go straight from the image to the host file
+    Recorder copyout(disk, "copyout");
+    for (size_t i = 0; i < options.Rounds; i++) {
+    	copyout.begin();
+    	int fd = ::open(output.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    	ssize_t result = fd < 0 ? -1 : fs.copy_to(inumber, fd);
+    	if (fd >= 0) {
+    	    close(fd);
+	}
+    	copyout.end(std::max(result, (ssize_t)0));
+    }
+    results.push_back(copyout.result());
+
+    fs.unmount();
+    unlink(input.c_str());
+    unlink(output.c_str());
+}
+
+void bench_full(Disk &disk, const Options &options, std::vector<Result> &results) {
+    FileSystem::format(&disk, options.Features);
+
+    // Fill the disk with files until it runs out of inodes or blocks
+    {
+    	FileSystem fs;
+    	fs.mount(&disk);
+    	std::vector<char> data(std::min(options.FileSize, (size_t)256 << 10), 'f');
+    	while (true) {
+    	    ssize_t inumber = fs.create();
+    	    if (inumber < 0 || fs.write(inumber, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+    	    	break;
+	    }
+	}
+    	fs.unmount();
+    }
+
+    Recorder recorder(disk, "mount-full");
+    for (size_t i = 0; i < options.Rounds; i++) {
+    	FileSystem fs;
+    	recorder.begin();
+    	fs.mount(&disk);
+    	recorder.end();
+    	fs.unmount();
+    }
+    results.push_back(recorder.result());
+}
+
+// Utility functions
+
+bool selected(const std::vector<std::string> &names, const char *name) {
+    return names.empty() || std::find(names.begin(), names.end(), name) != names.end();
+}
+
+bool parse_features(char *list, uint32_t *features) {
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    	if (streq(name, "bitmap")) {
+    	    *features |= FileSystem::FEATURE_BITMAP;
+	} else if (streq(name, "extents")) {
+	    *features |= FileSystem::FEATURE_EXTENTS;
+	} else if (streq(name, "large")) {
+	    *features |= FileSystem::FEATURE_LARGE;
+	} else if (streq(name, "inline")) {
+	    *features |= FileSystem::FEATURE_INLINE;
+	} else if (streq(name, "compress")) {
+	    *features |= FileSystem::FEATURE_COMPRESS;
+	} else if (streq(name, "dedup")) {
+	    *features |= FileSystem::FEATURE_DEDUP;
+	} else {
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Return latency at percentile p of sorted latencies, in microseconds
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+    	return 0;
+    }
+    size_t rank = std::max((size_t)1, (size_t)(p * sorted.size() + 0.999999));
+    return sorted[std::min(rank, sorted.size()) - 1] * 1e6;
+}
+
+void report(const Options &options, const std::vector<Result> &results) {
+    const char *backends[] = {"pread", "mmap", "uring"};
+    if (options.Machine) {
+    	printf("# blocks=%lu features=%u backend=%s cache=%lu files=%lu filesize=%lu rounds=%lu\n",
+    	       options.Blocks, options.Features, backends[options.Backend], options.Cache,
+    	       options.Files, options.FileSize, options.Rounds);
+    	printf("name\tops\tbytes\tseconds\tops_per_sec\tmb_per_sec\tp50_us\tp90_us\tp99_us\tmax_us\treads_per_op\twrites_per_op\n");
+    } else {
+    	printf("%-16s %8s %10s %10s %10s %10s %10s %10s %10s %10s\n", "benchmark", "ops", "ops/s", "MB/s",
+    	       "p50 us", "p90 us", "p99 us", "max us", "reads/op", "writes/op");
+    }
+
+    for (size_t i = 0; i < results.size(); i++) {
+    	const Result &result = results[i];
+    	std::vector<double> sorted(result.Latencies);
+    	std::sort(sorted.begin(), sorted.end());
+    	double seconds = 0;
+    	for (size_t j = 0; j < sorted.size(); j++) {
+    	    seconds += sorted[j];
+	}
+    	size_t ops	  = sorted.size();
+    	double rate	  = seconds > 0 ? ops / seconds : 0;
+    	double bandwidth  = seconds > 0 ? result.Bytes / seconds / (1 << 20) : 0;
+    	double reads	  = ops ? (double)result.Reads / ops : 0;
+    	double writes	  = ops ? (double)result.Writes / ops : 0;
+    	if (options.Machine) {
+    	    printf("%s\t%lu\t%lu\t%.6f\t%.1f\t%.2f\t%.1f\t%.1f\t%.1f\t%.1f\t%.2f\t%.2f\n",
+    	    	   result.Name.c_str(), ops, result.Bytes, seconds, rate, bandwidth,
+    	    	   percentile(sorted, 0.50), percentile(sorted, 0.90), percentile(sorted, 0.99),
+    	    	   percentile(sorted, 1.00), reads, writes);
+	} else {
+	    printf("%-16s %8lu %10.1f %10.2f %10.1f %10.1f %10.1f %10.1f %10.2f %10.2f\n",
+	    	   result.Name.c_str(), ops, rate, bandwidth,
+	    	   percentile(sorted, 0.50), percentile(sorted, 0.90), percentile(sorted, 0.99),
+	    	   percentile(sorted, 1.00), reads, writes);
+	}
+    }
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] [benchmark...]\n", program);
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -b <blocks>     Size of scratch disk image (default 20000)\n");
+    fprintf(stderr, "    -B <backend>    pread, mmap or uring (default pread)\n");
+    fprintf(stderr, "    -c <blocks>     Block cache size (default 0)\n");
+    fprintf(stderr, "    -d <path>       Scratch disk image (default sfsbench.<pid>.img)\n");
+    fprintf(stderr, "    -f <feature,..> Features to format with\n");
+    fprintf(stderr, "    -F <seed>       Seed for random offsets (default 1)\n");
+    fprintf(stderr, "    -k              Keep the scratch disk image\n");
+    fprintf(stderr, "    -m              Print tab-separated results\n");
+    fprintf(stderr, "    -n <files>      Inodes per create/remove storm (default 1000)\n");
+    fprintf(stderr, "    -r <rounds>     Repetitions of format, mount and copy (default 10)\n");
+    fprintf(stderr, "    -s <bytes>      File size for read, write and copy (default 4 MiB)\n");
+    fprintf(stderr, "Benchmarks:\n");
+    fprintf(stderr, "    format          format and format fast\n");
+    fprintf(stderr, "    mount           mount of an empty image\n");
+    fprintf(stderr, "    create          create and remove storms\n");
+    fprintf(stderr, "    io              sequential and random reads and writes of 4k, 64k and 1m\n");
+    fprintf(stderr, "    copy            copyin and copyout of a host file\n");
+    fprintf(stderr, "    full            mount of an image filled with files\n");
+}
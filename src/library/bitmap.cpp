@@ -0,0 +1,340 @@
+// bitmap.cpp: Word-packed free block bitmap
+
+#include "sfs/bitmap.h"
+
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SFS_HAVE_AVX2
+#endif
+
+// Word scanners: return first word in [start, end) with a clear bit, or end
+
+static size_t scan_words_scalar(const uint64_t *words, size_t start, size_t end) {
+    while (start < end && words[start] == ~0ULL) {
+    	start++;
+    }
+    return start;
+}
+
+#ifdef SFS_HAVE_AVX2
+__attribute__((target("avx2")))
+static size_t scan_words_avx2(const uint64_t *words, size_t start, size_t end) {
+    const __m256i full = _mm256_set1_epi64x(-1);
+
+    // Compare four words at a time against all ones
+    while (start + 4 <= end) {
+    	__m256i chunk = _mm256_loadu_si256((const __m256i *)(words + start));
+    	unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi64(chunk, full));
+    	if (mask != 0xffffffffu) {
+    	    return start + __builtin_ctz(~mask) / 8;
+	}
+    	start += 4;
+    }
+    return scan_words_scalar(words, start, end);
+}
+
+static bool have_avx2() {
+    static bool result = __builtin_cpu_supports("avx2");
+    return result;
+}
+#endif
+
+size_t Bitmap::scan_words(size_t start, size_t end) const {
+#ifdef SFS_HAVE_AVX2
+    if (have_avx2()) {
+    	return scan_words_avx2(Words.data(), start, end);
+    }
+#endif
+    return scan_words_scalar(Words.data(), start, end);
+}
+
+void Bitmap::resize(size_t bits, bool used) {
+    Bits = bits;
+    Free = used ? 0 : bits;
+    Hint = 0;
+    Words.assign((bits + 63) / 64, used ? ~0ULL : 0);
+
+    // Bits past the end read as in use so they are never allocated
+    if (bits % 64) {
+    	Words.back() |= ~0ULL << (bits % 64);
+    }
+
+    RegionFree.assign((bits + REGION_BITS - 1) / REGION_BITS, used ? 0 : REGION_BITS);
+    if (bits % REGION_BITS && !used) {
+    	RegionFree.back() = bits % REGION_BITS;
+    }
+    RegionDirty.assign(RegionFree.size(), 0);
+    RegionHint.assign(RegionFree.size(), 0);
+}
+
+void Bitmap::load(const uint64_t *words, size_t bits) {
+    resize(bits);
+    std::copy(words, words + Words.size(), Words.begin());
+    if (bits % 64) {
+    	Words.back() |= ~0ULL << (bits % 64);
+    }
+    recount();
+}
+
+void Bitmap::recount() {
+    // Count free bits per region, discounting padding past the end
+    Free = 0;
+    for (size_t region = 0; region < RegionFree.size(); region++) {
+    	size_t end  = std::min((region + 1) * REGION_WORDS, Words.size());
+    	size_t bits = std::min((size_t)REGION_BITS, Bits - region * REGION_BITS);
+    	size_t used = 0;
+    	for (size_t word = region * REGION_WORDS; word < end; word++) {
+    	    used += __builtin_popcountll(Words[word]);
+	}
+    	size_t padding = (end - region * REGION_WORDS) * 64 - bits;
+    	RegionFree[region] = bits - (used - padding);
+    	Free += RegionFree[region];
+    }
+}
+
+size_t Bitmap::merge(const Bitmap &other) {
+    size_t overlap = 0;
+    for (size_t word = 0; word < Words.size(); word++) {
+    	uint64_t both = Words[word] & other.Words[word];
+    	if (word + 1 == Words.size() && Bits % 64) {
+    	    both &= ~(~0ULL << (Bits % 64));
+	}
+    	overlap += __builtin_popcountll(both);
+    	if (other.Words[word] & ~Words[word]) {
+    	    Words[word] |= other.Words[word];
+    	    RegionDirty[word / REGION_WORDS] = 1;
+	}
+    }
+    recount();
+    return overlap;
+}
+
+void Bitmap::take_dirty(std::vector<size_t> &regions) {
+    // A region claimed from after its flag is taken is flagged again
+    for (size_t region = 0; region < RegionDirty.size(); region++) {
+    	if (__atomic_exchange_n(&RegionDirty[region], 0, __ATOMIC_ACQ_REL)) {
+    	    regions.push_back(region);
+	}
+    }
+}
+
+size_t Bitmap::copy_region(size_t region, uint64_t *words) const {
+    size_t first = region * REGION_WORDS;
+    size_t count = std::min(Words.size() - first, (size_t)REGION_WORDS);
+    for (size_t i = 0; i < count; i++) {
+    	words[i] = __atomic_load_n(&Words[first + i], __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
+void Bitmap::set(size_t bit) {
+    uint64_t mask = 1ULL << (bit % 64);
+    if (!(Words[bit / 64] & mask)) {
+    	Words[bit / 64] |= mask;
+    	RegionFree[bit / REGION_BITS]--;
+    	RegionDirty[bit / REGION_BITS] = 1;
+    	Free--;
+    }
+}
+
+void Bitmap::clear(size_t bit) {
+    uint64_t mask = 1ULL << (bit % 64);
+    if (Words[bit / 64] & mask) {
+    	Words[bit / 64] &= ~mask;
+    	RegionFree[bit / REGION_BITS]++;
+    	RegionDirty[bit / REGION_BITS] = 1;
+    	Free++;
+    	Hint = std::min(Hint, bit / 64);
+    	RegionHint[bit / REGION_BITS] = std::min(RegionHint[bit / REGION_BITS], (uint32_t)(bit / 64 % REGION_WORDS));
+    }
+}
+
+size_t Bitmap::set_range(size_t start, size_t count) {
+    size_t used = 0;
+    size_t end  = start + count;
+    while (start < end) {
+    	// Mask of bits [start, end) within this word
+    	size_t   word = start / 64;
+    	size_t   bits = std::min(end - word * 64, (size_t)64) - start % 64;
+    	uint64_t mask = (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (start % 64);
+    	uint64_t hit  = Words[word] & mask;
+    	used += __builtin_popcountll(hit);
+    	if (hit != mask) {
+    	    size_t fresh = bits - __builtin_popcountll(hit);
+    	    Words[word] |= mask;
+    	    RegionFree[word / REGION_WORDS] -= fresh;
+    	    RegionDirty[word / REGION_WORDS] = 1;
+    	    Free -= fresh;
+	}
+    	start += bits;
+    }
+    return used;
+}
+
+size_t Bitmap::run_length(size_t start, size_t max) const {
+    size_t length = 0;
+    while (length < max && start + length < Bits) {
+    	size_t   bit  = start + length;
+    	uint64_t used = __atomic_load_n(&Words[bit / 64], __ATOMIC_RELAXED) >> (bit % 64);
+    	if (used == 0) {
+    	    length += 64 - bit % 64;
+    	    continue;
+	}
+    	length += __builtin_ctzll(used);
+    	break;
+    }
+    return std::min(std::min(length, max), Bits > start ? Bits - start : 0);
+}
+
+ssize_t Bitmap::find_free(size_t start) {
+    if (Free == 0 || start >= Bits) {
+    	return -1;
+    }
+
+    // Searches that begin at or below the hint may move it forward
+    size_t word = start / 64;
+    bool from_hint = start <= Hint * 64;
+    if (from_hint) {
+    	word  = Hint;
+    	start = word * 64;
+    }
+    if (word >= Words.size()) {
+    	return -1;
+    }
+
+    // First word may be partial
+    uint64_t avail = ~Words[word] & (~0ULL << (start % 64));
+    if (avail == 0) {
+    	word++;
+    }
+
+    // Skip full regions, then scan words within the region
+    while (avail == 0 && word < Words.size()) {
+    	size_t region = word / REGION_WORDS;
+    	size_t end    = std::min((region + 1) * REGION_WORDS, Words.size());
+    	if (RegionFree[region] > 0) {
+    	    word = scan_words(word, end);
+	} else {
+	    word = end;
+	}
+    	if (word < end) {
+    	    avail = ~Words[word];
+	}
+    }
+
+    if (from_hint) {
+    	Hint = word;
+    }
+    if (avail == 0) {
+    	return -1;
+    }
+    return word * 64 + __builtin_ctzll(avail);
+}
+
+ssize_t Bitmap::next_free(size_t start) const {
+    for (size_t word = start / 64; word < Words.size(); word++) {
+    	if (region_free(word / REGION_WORDS) == 0) {
+    	    word = (word / REGION_WORDS + 1) * REGION_WORDS - 1;
+    	    continue;
+	}
+    	uint64_t avail = ~__atomic_load_n(&Words[word], __ATOMIC_RELAXED);
+    	if (word == start / 64) {
+    	    avail &= ~0ULL << (start % 64);
+	}
+    	if (avail) {
+    	    return word * 64 + __builtin_ctzll(avail);
+	}
+    }
+    return -1;
+}
+
+// Concurrent claims: each word changes with one compare-and-swap, so two
+// threads never get the same bit; counts and hints follow the words
+
+void Bitmap::account(size_t word, size_t bits, bool claimed) {
+    size_t region = word / REGION_WORDS;
+    if (claimed) {
+    	__atomic_fetch_sub(&RegionFree[region], bits, __ATOMIC_RELAXED);
+    	__atomic_fetch_sub(&Free, bits, __ATOMIC_RELAXED);
+    } else {
+    	__atomic_fetch_add(&RegionFree[region], bits, __ATOMIC_RELAXED);
+    	__atomic_fetch_add(&Free, bits, __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&RegionDirty[region], 1, __ATOMIC_RELEASE);
+}
+
+ssize_t Bitmap::claim(size_t region) {
+    size_t begin = region * REGION_WORDS;
+    size_t end   = std::min(begin + REGION_WORDS, Words.size());
+
+    // Scan from the hint; a release racing with the hint update may leave a
+    // free bit below it, so a region that still counts free bits is scanned
+    // again from its start
+    for (int pass = 0; pass < 2 && region_free(region) > 0; pass++) {
+    	size_t word = pass == 0 ? begin + __atomic_load_n(&RegionHint[region], __ATOMIC_RELAXED) : begin;
+    	for (; word < end; word++) {
+    	    uint64_t value = __atomic_load_n(&Words[word], __ATOMIC_RELAXED);
+    	    while (value != ~0ULL) {
+    	    	uint64_t bit = ~value & (value + 1);
+    	    	if (__atomic_compare_exchange_n(&Words[word], &value, value | bit, false,
+    	    					__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    	    	    account(word, 1, true);
+    	    	    __atomic_store_n(&RegionHint[region], (uint32_t)(word - begin), __ATOMIC_RELAXED);
+    	    	    return word * 64 + __builtin_ctzll(bit);
+		}
+	    }
+	}
+    }
+    return -1;
+}
+
+size_t Bitmap::claim_range(size_t start, size_t max) {
+    size_t got = 0;
+    while (got < max && start + got < Bits) {
+    	size_t   word  = (start + got) / 64;
+    	size_t   shift = (start + got) % 64;
+    	size_t   run   = 0;
+    	uint64_t value = __atomic_load_n(&Words[word], __ATOMIC_RELAXED);
+    	while (true) {
+    	    // Free bits from shift up to the first bit in use
+    	    uint64_t avail = ~value >> shift;
+    	    run = avail == ~0ULL ? 64 : __builtin_ctzll(~avail);
+    	    run = std::min(run, max - got);
+    	    if (run == 0) {
+    	    	return got;
+	    }
+    	    uint64_t mask = (run == 64 ? ~0ULL : ((1ULL << run) - 1)) << shift;
+    	    if (__atomic_compare_exchange_n(&Words[word], &value, value | mask, false,
+    	    				    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+    	    	break;
+	    }
+	}
+    	account(word, run, true);
+    	got += run;
+    	if (shift + run < 64) {
+    	    break;
+	}
+    }
+    return got;
+}
+
+void Bitmap::release(size_t bit) {
+    size_t   word = bit / 64;
+    uint64_t mask = 1ULL << (bit % 64);
+    if (!(__atomic_fetch_and(&Words[word], ~mask, __ATOMIC_ACQ_REL) & mask)) {
+    	return;
+    }
+    account(word, 1, false);
+
+    // Lower both hints to this word unless another release got lower
+    size_t hint = __atomic_load_n(&Hint, __ATOMIC_RELAXED);
+    while (word < hint && !__atomic_compare_exchange_n(&Hint, &hint, word, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+    uint32_t *region_hint = &RegionHint[word / REGION_WORDS];
+    uint32_t offset = word % REGION_WORDS;
+    uint32_t current = __atomic_load_n(region_hint, __ATOMIC_RELAXED);
+    while (offset < current && !__atomic_compare_exchange_n(region_hint, &current, offset, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
@@ -0,0 +1,84 @@
+// cache.cpp: Block buffer cache
+
+#include "sfs/cache.h"
+
+#include <algorithm>
+
+#include <string.h>
+
+BlockCache::BlockCache(size_t capacity, size_t block_size)
+    : Capacity(capacity), BlockSize(block_size), Slab(capacity*block_size) {
+    for (size_t i = 0; i < Capacity; i++) {
+    	Free.push_back(&Slab[i*BlockSize]);
+    }
+}
+
+bool BlockCache::lookup(int blocknum, char *data) {
+    auto it = Index.find(blocknum);
+    if (it == Index.end()) {
+    	return false;
+    }
+
+    LRU.splice(LRU.begin(), LRU, it->second);
+    memcpy(data, it->second->Data, BlockSize);
+    return true;
+}
+
+void BlockCache::insert(int blocknum, const char *data, bool dirty) {
+    auto it = Index.find(blocknum);
+    if (it != Index.end()) {
+    	LRU.splice(LRU.begin(), LRU, it->second);
+    	memcpy(it->second->Data, data, BlockSize);
+    	it->second->Dirty = it->second->Dirty || dirty;
+    	return;
+    }
+
+    if (Free.empty()) {
+    	return;
+    }
+
+    Entry entry = {blocknum, dirty, Free.back()};
+    Free.pop_back();
+    memcpy(entry.Data, data, BlockSize);
+    LRU.push_front(entry);
+    Index[blocknum] = LRU.begin();
+}
+
+bool BlockCache::victim(int *blocknum, const char **data) const {
+    const Entry &entry = LRU.back();
+    *blocknum = entry.BlockNum;
+    *data     = entry.Data;
+    return entry.Dirty;
+}
+
+void BlockCache::remove(int blocknum) {
+    auto it = Index.find(blocknum);
+    if (it == Index.end()) {
+    	return;
+    }
+
+    Free.push_back(it->second->Data);
+    LRU.erase(it->second);
+    Index.erase(it);
+}
+
+void BlockCache::dirty(std::vector<int> &blocks) const {
+    for (auto &entry : LRU) {
+    	if (entry.Dirty) {
+    	    blocks.push_back(entry.BlockNum);
+	}
+    }
+    std::sort(blocks.begin(), blocks.end());
+}
+
+const char *BlockCache::peek(int blocknum) const {
+    auto it = Index.find(blocknum);
+    return it == Index.end() ? NULL : it->second->Data;
+}
+
+void BlockCache::clean(int blocknum) {
+    auto it = Index.find(blocknum);
+    if (it != Index.end()) {
+    	it->second->Dirty = false;
+    }
+}
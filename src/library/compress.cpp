@@ -0,0 +1,329 @@
+// compress.cpp: Compressed data clusters
+
+#include "sfs/fs.h"
+#include "sfs/lz.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <string.h>
+
+// Files of a FEATURE_COMPRESS image are read and written a cluster of
+// CLUSTER_BLOCKS file blocks at a time: a write loads the rest of each
+// cluster it touches, merges the new bytes in and stores the blocks in use
+// compressed if that saves a block, else as is
+
+// Pointers ---------------------------------------------------------------------
+
+// return the pointer to file block index of a large or legacy inode, and in
+// dirty the flag to set once it changes; with allocate, missing pointer
+// blocks are allocated. NULL where no pointer exists (or could be allocated)
+
+uint32_t *FileSystem::block_slot(File *file, size_t index, bool allocate, bool **dirty)
+{
+    Inode &node = file->Node;
+    if (this->features & FEATURE_LARGE)
+    {
+        uint32_t *slot = this->tree_slot(&node, file->Tree, index, allocate, dirty);
+        if (*dirty == NULL)
+        {
+            *dirty = &file->NodeDirty;
+        }
+        return slot;
+    }
+    *dirty = &file->NodeDirty;
+    if (index < POINTERS_PER_INODE)
+    {
+        return &node.Direct[index];
+    }
+    if (index - POINTERS_PER_INODE >= POINTERS_PER_BLOCK)
+    {
+        return NULL;
+    }
+    if (node.Indirect == 0)
+    {
+        if (!allocate)
+        {
+            return NULL;
+        }
+        int block_num = this->allocate_block();
+        if (block_num <= 0)
+        {
+            return NULL;
+        }
+        // A new indirect block starts out empty; no need to read it
+        node.Indirect = block_num;
+        this->mark_indirect(block_num);
+        memset(file->Indirect.Data, 0, Disk::BLOCK_SIZE);
+        file->IndirectLoaded = true;
+        file->IndirectDirty = true;
+    }
+    else if (!file->IndirectLoaded)
+    {
+        this->mark_indirect(node.Indirect);
+        this->disk->read(node.Indirect, file->Indirect.Data);
+        file->IndirectLoaded = true;
+    }
+    *dirty = &file->IndirectDirty;
+    return &file->Indirect.Pointers[index - POINTERS_PER_INODE];
+}
+
+// copy the pointers of count file blocks from base, flags and all; blocks
+// without a pointer read as holes
+
+void FileSystem::cluster_map(File *file, size_t base, size_t count, uint32_t *slots)
+{
+    for (size_t i = 0; i < CLUSTER_BLOCKS; i++)
+    {
+        bool *dirty;
+        uint32_t *slot = i < count ? this->block_slot(file, base + i, false, &dirty) : NULL;
+        slots[i] = slot ? *slot : 0;
+    }
+}
+
+// Clusters ---------------------------------------------------------------------
+
+// fill cluster with the blocks of a cluster of count blocks: all of them
+// for a compressed cluster, only those with a bit set in wanted otherwise.
+// False if the compressed data is corrupt. Blocks are exactly BLOCK_SIZE
+// bytes, so here, in cluster_write and in compressed_read the array is one
+// buffer from cluster[0].Data, of CLUSTER_BLOCKS blocks
+
+bool FileSystem::cluster_load(const uint32_t *slots, size_t count, unsigned wanted, Block *cluster)
+{
+    int nums[CLUSTER_BLOCKS];
+    char *buffers[CLUSTER_BLOCKS];
+    size_t n = 0;
+    if (!(slots[0] & COMPRESSED_BLOCK))
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!(wanted & (1u << i)))
+            {
+                continue;
+            }
+            if (slots[i] == 0)
+            {
+                memset(cluster[i].Data, 0, Disk::BLOCK_SIZE);
+                continue;
+            }
+            nums[n] = slots[i];
+            buffers[n++] = cluster[i].Data;
+        }
+        if (n > 0)
+        {
+            this->disk->readv(nums, n, buffers);
+        }
+        return true;
+    }
+
+    Block packed[CLUSTER_BLOCKS];
+    for (; n < count && (slots[n] & COMPRESSED_BLOCK); n++)
+    {
+        nums[n] = slots[n] & ~COMPRESSED_BLOCK;
+        buffers[n] = packed[n].Data;
+    }
+    this->disk->readv(nums, n, buffers);
+    const ClusterHeader *header = (const ClusterHeader *)packed[0].Data;
+    if (header->Blocks > count || header->Length > n * Disk::BLOCK_SIZE - sizeof(ClusterHeader))
+    {
+        return false;
+    }
+    size_t bytes = (size_t)header->Blocks * Disk::BLOCK_SIZE;
+    if (LZ::decompress(packed[0].Data + sizeof(ClusterHeader), header->Length, cluster[0].Data, bytes) != (ssize_t)bytes)
+    {
+        return false;
+    }
+    if (header->Blocks < count)
+    {
+        memset(cluster[header->Blocks].Data, 0, (count - header->Blocks) * Disk::BLOCK_SIZE);
+    }
+    return true;
+}
+
+// write length bytes at offset into the cluster of count file blocks from
+// base; false (with nothing changed) if the disk is full or the cluster
+// corrupt. Pointer blocks and the inode are left for the caller to flush
+
+bool FileSystem::cluster_write(File *file, size_t base, size_t count, const char *data, size_t length, size_t offset)
+{
+    uint32_t slots[CLUSTER_BLOCKS];
+    this->cluster_map(file, base, count, slots);
+    bool packed = (slots[0] & COMPRESSED_BLOCK) != 0;
+    uint64_t size = node_size(&file->Node, this->features);
+    uint64_t start = (uint64_t)base * Disk::BLOCK_SIZE;
+    size_t held = size > start ? std::min((uint64_t)count, (size - start + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE) : 0;
+    size_t lo = offset / Disk::BLOCK_SIZE;
+    size_t hi = (offset + length - 1) / Disk::BLOCK_SIZE;
+    size_t used = std::max(held, hi + 1);
+
+    // Load what the write leaves of the blocks in use and merge it in
+    Block cluster[CLUSTER_BLOCKS];
+    unsigned wanted = (1u << used) - 1;
+    for (size_t i = lo; i <= hi; i++)
+    {
+        if (offset <= i * Disk::BLOCK_SIZE && (i + 1) * Disk::BLOCK_SIZE <= offset + length)
+        {
+            wanted &= ~(1u << i);
+        }
+    }
+    if (!this->cluster_load(slots, count, wanted, cluster))
+    {
+        return false;
+    }
+    memcpy(cluster[0].Data + offset, data, length);
+
+    // Compress the blocks in use, unless that saves no block
+    Block compressed[CLUSTER_BLOCKS];
+    size_t packed_blocks = 0;
+    if (used > 1)
+    {
+        ClusterHeader *header = (ClusterHeader *)compressed[0].Data;
+        size_t bytes = LZ::compress(cluster[0].Data, used * Disk::BLOCK_SIZE, compressed[0].Data + sizeof(ClusterHeader),
+                                    (used - 1) * Disk::BLOCK_SIZE - sizeof(ClusterHeader));
+        if (bytes > 0)
+        {
+            header->Length = bytes;
+            header->Blocks = used;
+            bytes += sizeof(ClusterHeader);
+            packed_blocks = (bytes + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+            memset(compressed[0].Data + bytes, 0, packed_blocks * Disk::BLOCK_SIZE - bytes);
+        }
+    }
+
+    // Pick the new pointers: a compressed cluster reuses the blocks the
+    // cluster had, one stored as is keeps them in place and fills holes the
+    // write covers; a cluster no longer compressible is written out whole
+    std::vector<int> old, fresh, freed;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (slots[i] != 0)
+        {
+            old.push_back(slots[i] & ~COMPRESSED_BLOCK);
+        }
+    }
+    uint32_t values[CLUSTER_BLOCKS] = {0};
+    std::vector<int> nums;
+    std::vector<char *> buffers;
+    size_t write_lo = 0;
+    size_t write_hi = used - 1;
+    if (packed_blocks == 0 && !packed)
+    {
+        std::copy(slots, slots + count, values);
+        write_lo = lo;
+        write_hi = hi;
+    }
+    size_t needed = packed_blocks > 0 ? packed_blocks : write_hi + 1;
+    for (size_t i = write_lo; i < needed; i++)
+    {
+        if (packed_blocks > 0 || packed)
+        {
+            values[i] = i < old.size() ? old[i] : 0;
+        }
+        if (values[i] == 0)
+        {
+            int block_num = this->allocate_block();
+            if (block_num <= 0)
+            {
+                for (size_t k = 0; k < fresh.size(); k++)
+                {
+                    this->bitmap.release(fresh[k]);
+                }
+                return false;
+            }
+            values[i] = block_num;
+            fresh.push_back(block_num);
+        }
+        nums.push_back(values[i]);
+        buffers.push_back(packed_blocks > 0 ? compressed[i].Data : cluster[i].Data);
+        if (packed_blocks > 0)
+        {
+            values[i] |= COMPRESSED_BLOCK;
+        }
+    }
+    if (packed_blocks > 0 && old.size() > packed_blocks)
+    {
+        freed.assign(old.begin() + packed_blocks, old.end());
+    }
+
+    // Make sure every pointer exists before any data is written
+    for (size_t i = 0; i < count; i++)
+    {
+        bool *dirty;
+        if (values[i] != 0 && this->block_slot(file, base + i, true, &dirty) == NULL)
+        {
+            for (size_t k = 0; k < fresh.size(); k++)
+            {
+                this->bitmap.release(fresh[k]);
+            }
+            return false;
+        }
+    }
+    this->disk->writev(nums.data(), nums.size(), buffers.data());
+    for (size_t i = 0; i < count; i++)
+    {
+        bool *dirty;
+        uint32_t *slot = this->block_slot(file, base + i, false, &dirty);
+        if (slot != NULL && *slot != values[i])
+        {
+            *slot = values[i];
+            *dirty = true;
+        }
+    }
+    this->release_blocks(freed);
+    return true;
+}
+
+// Read and write ---------------------------------------------------------------
+
+// read [offset, offset + length), which lies within the file, a cluster at a
+// time; -1 if a cluster is corrupt
+
+ssize_t FileSystem::compressed_read(File *file, char *data, size_t length, size_t offset)
+{
+    Block cluster[CLUSTER_BLOCKS];
+    size_t end = offset + length;
+    for (size_t base = offset / Disk::BLOCK_SIZE / CLUSTER_BLOCKS * CLUSTER_BLOCKS; base * Disk::BLOCK_SIZE < end;
+         base += CLUSTER_BLOCKS)
+    {
+        uint32_t slots[CLUSTER_BLOCKS];
+        this->cluster_map(file, base, CLUSTER_BLOCKS, slots);
+        size_t start = std::max(offset, base * Disk::BLOCK_SIZE);
+        size_t stop = std::min(end, (base + CLUSTER_BLOCKS) * Disk::BLOCK_SIZE);
+        size_t lo = start / Disk::BLOCK_SIZE - base;
+        size_t hi = (stop - 1) / Disk::BLOCK_SIZE - base;
+        unsigned wanted = ((1u << (hi + 1)) - 1) & ~((1u << lo) - 1);
+        if (!this->cluster_load(slots, CLUSTER_BLOCKS, wanted, cluster))
+        {
+            return -1;
+        }
+        memcpy(data + (start - offset), cluster[0].Data + (start - base * Disk::BLOCK_SIZE), stop - start);
+    }
+    return length;
+}
+
+// write below max_blocks a cluster at a time, growing the size as each
+// cluster is written; returns number of bytes written, short if the disk
+// fills up
+
+ssize_t FileSystem::compressed_write(File *file, char *data, size_t length, size_t offset, size_t max_blocks)
+{
+    Inode &node = file->Node;
+    size_t end = std::min(offset + length, max_blocks * Disk::BLOCK_SIZE);
+    size_t done = offset;
+    file->NodeDirty = true;
+    for (size_t base = offset / Disk::BLOCK_SIZE / CLUSTER_BLOCKS * CLUSTER_BLOCKS; base * Disk::BLOCK_SIZE < end;
+         base += CLUSTER_BLOCKS)
+    {
+        size_t count = std::min((size_t)CLUSTER_BLOCKS, max_blocks - base);
+        size_t start = std::max(offset, base * Disk::BLOCK_SIZE);
+        size_t stop = std::min(end, (base + count) * Disk::BLOCK_SIZE);
+        if (!this->cluster_write(file, base, count, data + (start - offset), stop - start, start - base * Disk::BLOCK_SIZE))
+        {
+            break;
+        }
+        done = stop;
+        set_node_size(&node, std::max((size_t)node_size(&node, this->features), stop), this->features);
+    }
+    return done - offset;
+}
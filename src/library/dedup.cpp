@@ -0,0 +1,309 @@
+// dedup.cpp: Shared data blocks
+
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <string.h>
+
+// Data blocks of a FEATURE_DEDUP image are written one at a time: each is
+// hashed and, if its contents match a block already counted in the
+// reference table, points there instead of getting a block of its own.
+// References are counted per pointer, so removing a file only frees the
+// blocks nothing else points to
+
+// Reference table --------------------------------------------------------------
+
+// hash a data block: FNV-1a over 64-bit words with the high half folded in
+// after each step, folded to 32 bits. Matches are always compared in full
+
+uint32_t FileSystem::block_hash(const char *data)
+{
+    const uint64_t *words = (const uint64_t *)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < Disk::BLOCK_SIZE / sizeof(uint64_t); i++)
+    {
+        hash = (hash ^ words[i]) * 0x100000001b3ULL;
+        hash ^= hash >> 32;
+    }
+    return (uint32_t)hash;
+}
+
+// set the reference table entry of a block; caller holds ref_lock
+
+void FileSystem::set_reference(uint32_t block_num, uint32_t count, uint32_t hash)
+{
+    Reference &ref = this->refs[block_num];
+    ref.Count = count;
+    ref.Hash = hash;
+    this->refs_dirty[block_num / REFS_PER_BLOCK] = 1;
+}
+
+// drop the index entry of a block, unless the hash now maps to another
+// block; caller holds ref_lock
+
+void FileSystem::unindex(uint32_t block_num)
+{
+    std::unordered_map<uint32_t, uint32_t>::iterator it = this->ref_index.find(this->refs[block_num].Hash);
+    if (it != this->ref_index.end() && it->second == (uint32_t)block_num)
+    {
+        this->ref_index.erase(it);
+    }
+}
+
+// take one reference off each block in freed, leaving only the blocks that
+// had no other reference
+
+void FileSystem::drop_references(std::vector<int> &freed)
+{
+    std::lock_guard<std::mutex> guard(this->ref_lock);
+    size_t kept = 0;
+    for (size_t i = 0; i < freed.size(); i++)
+    {
+        uint32_t block_num = freed[i];
+        Reference &ref = this->refs[block_num];
+        if (ref.Count > 1)
+        {
+            this->set_reference(block_num, ref.Count - 1, ref.Hash);
+            continue;
+        }
+        if (ref.Count == 1)
+        {
+            this->unindex(block_num);
+            this->set_reference(block_num, 0, 0);
+        }
+        freed[kept++] = block_num;
+    }
+    freed.resize(kept);
+}
+
+// rebuild the reference table from the number of pointers to each block,
+// hashing every shared block again
+
+void FileSystem::count_references(const std::vector<uint32_t> &counts)
+{
+    Reference none = {0, 0};
+    this->refs.assign((size_t)this->ref_blocks * REFS_PER_BLOCK, none);
+    this->refs_dirty.assign(this->ref_blocks, 1);
+    this->ref_index.clear();
+    Block block;
+    for (uint32_t i = this->metadata_end(); i < counts.size(); i++)
+    {
+        if (counts[i] > 1)
+        {
+            this->disk->read(i, block.Data);
+            this->set_reference(i, counts[i], block_hash(block.Data));
+            this->ref_index[this->refs[i].Hash] = i;
+        }
+    }
+}
+
+// load the reference table saved on disk and index its blocks; false if an
+// entry counts a metadata or free block
+
+bool FileSystem::load_references()
+{
+    if (!(this->features & FEATURE_DEDUP))
+    {
+        return true;
+    }
+    std::vector<Block> blocks(this->ref_blocks);
+    uint32_t ref_start = this->bitmap_start + this->bitmap_blocks;
+    for (uint32_t i = 0; i < this->ref_blocks; i++)
+    {
+        this->disk->queue_read(ref_start + i, blocks[i].Data);
+    }
+    this->disk->submit();
+    const Reference *table = (const Reference *)blocks.data();
+    this->refs.assign(table, table + (size_t)this->ref_blocks * REFS_PER_BLOCK);
+    this->refs_dirty.assign(this->ref_blocks, 0);
+    this->ref_index.clear();
+    for (uint32_t i = 0; i < this->refs.size(); i++)
+    {
+        if (this->refs[i].Count == 0)
+        {
+            continue;
+        }
+        if (i < this->metadata_end() || i >= this->blocks || !this->bitmap.test(i))
+        {
+            return false;
+        }
+        this->ref_index[this->refs[i].Hash] = i;
+    }
+    return true;
+}
+
+// write changed reference table blocks back to disk
+
+void FileSystem::save_references()
+{
+    if (!(this->features & FEATURE_DEDUP))
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> guard(this->ref_lock);
+    uint32_t ref_start = this->bitmap_start + this->bitmap_blocks;
+    for (uint32_t i = 0; i < this->ref_blocks; i++)
+    {
+        if (this->refs_dirty[i])
+        {
+            this->disk->write(ref_start + i, (char *)&this->refs[(size_t)i * REFS_PER_BLOCK]);
+            this->refs_dirty[i] = 0;
+        }
+    }
+}
+
+// Writes -----------------------------------------------------------------------
+
+// pick the disk block for new contents of a file block that pointed to old
+// (0 if none): a block with the same contents, either written earlier in
+// this request or counted in the table; else old itself if nothing else
+// points to it, else a new block. write says whether data must still be
+// written there; blocks given up are added to dropped. 0 if the disk is full
+
+uint32_t FileSystem::share_block(uint32_t old, const char *data, std::unordered_map<uint32_t, Pending> &written,
+                                 std::vector<int> &dropped, bool *write)
+{
+    uint32_t hash = block_hash(data);
+    std::lock_guard<std::mutex> guard(this->ref_lock);
+    uint32_t match = 0;
+    std::unordered_map<uint32_t, Pending>::iterator mine = written.find(hash);
+    std::unordered_map<uint32_t, uint32_t>::iterator known = this->ref_index.find(hash);
+    if (mine != written.end())
+    {
+        if (memcmp(mine->second.Data, data, Disk::BLOCK_SIZE) == 0)
+        {
+            match = mine->second.Block;
+        }
+    }
+    else if (known != this->ref_index.end())
+    {
+        // Indexed blocks are on disk already and stay unchanged while counted
+        Block block;
+        this->disk->read(known->second, block.Data);
+        if (memcmp(block.Data, data, Disk::BLOCK_SIZE) == 0)
+        {
+            match = known->second;
+        }
+    }
+    *write = false;
+    if (match != 0 && match == old)
+    {
+        return old;
+    }
+    if (match != 0)
+    {
+        this->set_reference(match, this->refs[match].Count + 1, hash);
+        if (old != 0)
+        {
+            dropped.push_back(old);
+        }
+        return match;
+    }
+
+    // New contents: rewritten in place only where no other pointer sees them
+    uint32_t block_num = old;
+    if (old != 0 && this->refs[old].Count <= 1)
+    {
+        this->unindex(old);
+    }
+    else
+    {
+        int fresh = this->allocate_block();
+        if (fresh <= 0)
+        {
+            return 0;
+        }
+        block_num = fresh;
+        if (old != 0)
+        {
+            dropped.push_back(old);
+        }
+    }
+    this->set_reference(block_num, 1, hash);
+    Pending pending = {block_num, data};
+    written.insert(std::make_pair(hash, pending));
+    *write = true;
+    return block_num;
+}
+
+// write below max_blocks a block at a time, sharing blocks whose contents
+// are already on disk; blocks written are indexed once they are out, and
+// blocks given up are released last. Returns number of bytes written, short
+// if the disk fills up. Pointer blocks and the inode are left for the
+// caller to flush
+
+ssize_t FileSystem::shared_write(File *file, char *data, size_t length, size_t offset, size_t max_blocks)
+{
+    Inode &node = file->Node;
+    size_t end = std::min(offset + length, max_blocks * Disk::BLOCK_SIZE);
+    size_t done = offset;
+    std::unordered_map<uint32_t, Pending> written;
+    std::vector<int> dropped;
+    Block head, tail;
+    file->NodeDirty = true;
+    for (size_t i = offset / Disk::BLOCK_SIZE; i * Disk::BLOCK_SIZE < end; i++)
+    {
+        size_t start = std::max(offset, i * Disk::BLOCK_SIZE);
+        size_t stop = std::min(end, (i + 1) * Disk::BLOCK_SIZE);
+        bool *dirty;
+        uint32_t *slot = this->block_slot(file, i, true, &dirty);
+        if (slot == NULL)
+        {
+            break;
+        }
+        uint32_t old = *slot;
+
+        // Partial head and tail blocks merge with what they held
+        const char *buffer = data + (start - offset);
+        if (stop - start < Disk::BLOCK_SIZE)
+        {
+            char *bounce = (start == offset) ? head.Data : tail.Data;
+            if (old != 0)
+            {
+                this->disk->read(old, bounce);
+            }
+            else
+            {
+                memset(bounce, 0, Disk::BLOCK_SIZE);
+            }
+            memcpy(bounce + start % Disk::BLOCK_SIZE, buffer, stop - start);
+            buffer = bounce;
+        }
+        bool write;
+        uint32_t block_num = this->share_block(old, buffer, written, dropped, &write);
+        if (block_num == 0)
+        {
+            break;
+        }
+        if (write)
+        {
+            this->disk->queue_write(block_num, (char *)buffer);
+        }
+        if (block_num != old)
+        {
+            *slot = block_num;
+            *dirty = true;
+        }
+        done = stop;
+    }
+    this->disk->submit();
+    {
+        std::lock_guard<std::mutex> guard(this->ref_lock);
+        for (std::unordered_map<uint32_t, Pending>::iterator it = written.begin(); it != written.end(); it++)
+        {
+            const Reference &ref = this->refs[it->second.Block];
+            if (ref.Count > 0 && ref.Hash == it->first)
+            {
+                this->ref_index[it->first] = it->second.Block;
+            }
+        }
+    }
+    if (done > offset)
+    {
+        set_node_size(&node, std::max((size_t)node_size(&node, this->features), done), this->features);
+    }
+    this->release_blocks(dropped);
+    return done - offset;
+}
@@ -1,15 +1,27 @@
 // disk.cpp: disk emulator
 
 #include "sfs/disk.h"
+#include "sfs/stats.h"
 
+#include <algorithm>
 #include <stdexcept>
+#include <vector>
 
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <sched.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-void Disk::open(const char *path, size_t nblocks) {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define SFS_HAVE_COPY_FILE_RANGE
+#endif
+
+void Disk::open(const char *path, size_t nblocks, Backend backend) {
     FileDescriptor = ::open(path, O_RDWR|O_CREAT, 0600);
     if (FileDescriptor < 0) {
     	char what[BUFSIZ];
@@ -23,18 +35,158 @@ void Disk::open(const char *path, size_t nblocks) {
     	throw std::runtime_error(what);
     }
 
+    if (backend == BACKEND_MMAP && nblocks > 0) {
+    	void *mapping = mmap(NULL, nblocks*BLOCK_SIZE, PROT_READ|PROT_WRITE, MAP_SHARED, FileDescriptor, 0);
+    	if (mapping == MAP_FAILED) {
+    	    char what[BUFSIZ];
+    	    snprintf(what, BUFSIZ, "Unable to mmap %s: %s", path, strerror(errno));
+    	    throw std::runtime_error(what);
+	}
+    	Mapping = (char *)mapping;
+    }
+
+    if (backend == BACKEND_URING) {
+    	Ring = new IoRing();
+    	if (!Ring->setup(URING_DEPTH)) {
+    	    delete Ring;
+    	    Ring    = NULL;
+    	    backend = BACKEND_PREAD;
+	}
+    }
+
+    Mode   = backend;
     Blocks = nblocks;
     Reads  = 0;
     Writes = 0;
+    CacheHits	   = 0;
+    CacheMisses	   = 0;
+    CacheEvictions = 0;
+    Discards	   = 0;
+    Kinds.assign(nblocks, KIND_DATA);
+    reset_kinds();
 }
 
 Disk::~Disk() {
     if (FileDescriptor > 0) {
-    	printf("%lu disk block reads\n", Reads);
-    	printf("%lu disk block writes\n", Writes);
+    	// A destructor must not throw: report a failed write-back instead
+    	try {
+    	    sync();
+	} catch (std::exception &e) {
+	    fprintf(stderr, "Unable to sync disk: %s\n", e.what());
+	}
+    	stop_trace();
+    	printf("%lu disk block reads\n", Reads.load());
+    	printf("%lu disk block writes\n", Writes.load());
+    	if (Cache) {
+    	    printf("%lu cache hits\n", CacheHits.load());
+    	    printf("%lu cache misses\n", CacheMisses.load());
+    	    printf("%lu cache evictions\n", CacheEvictions.load());
+	}
+    	if (Mapping) {
+    	    munmap(Mapping, Blocks*BLOCK_SIZE);
+    	    Mapping = NULL;
+	}
     	close(FileDescriptor);
     	FileDescriptor = 0;
     }
+    delete Cache;
+    delete Ring;
+}
+
+void Disk::unmount() {
+    size_t mounts = Mounts.load();
+    while (mounts > 0 && !Mounts.compare_exchange_weak(mounts, mounts - 1)) {
+    }
+    if (mounts <= 1) {
+    	sync();
+    }
+}
+
+void Disk::set_cache(size_t nblocks) {
+    sync();
+
+    std::lock_guard<std::mutex> guard(CacheLock);
+    delete Cache;
+    Cache = nblocks > 0 ? new BlockCache(nblocks, BLOCK_SIZE) : NULL;
+}
+
+void Disk::flush() {
+    submit();
+
+    if (Cache) {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	flush_cache();
+    }
+}
+
+void Disk::sync() {
+    flush();
+
+    if (Mapping && msync(Mapping, Blocks*BLOCK_SIZE, MS_SYNC) < 0) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to msync: %s", strerror(errno));
+    	throw std::runtime_error(what);
+    }
+}
+
+void Disk::flush_cache() {
+    // Write back dirty blocks in ascending order, one call per run
+    std::vector<int> dirty;
+    std::vector<char *> buffers;
+    Cache->dirty(dirty);
+    for (auto blocknum : dirty) {
+    	buffers.push_back((char *)Cache->peek(blocknum));
+    }
+
+    size_t i = 0;
+    while (i < dirty.size()) {
+    	size_t n = run_length(&dirty[i], dirty.size() - i);
+    	write_run(dirty[i], n, &buffers[i]);
+    	for (size_t j = i; j < i + n; j++) {
+    	    Cache->clean(dirty[j]);
+	}
+    	i += n;
+    }
+}
+
+void Disk::cache_insert(int blocknum, const char *data, bool dirty) {
+    if (Cache->full() && !Cache->contains(blocknum)) {
+    	int victim;
+    	const char *victim_data;
+    	if (Cache->victim(&victim, &victim_data)) {
+    	    write_block(victim, victim_data);
+	}
+    	Cache->remove(victim);
+    	CacheEvictions++;
+    }
+    Cache->insert(blocknum, data, dirty);
+
+    if (dirty) {
+    	auto it = Filling.find(blocknum);
+    	if (it != Filling.end()) {
+    	    it->second.Stale = true;
+	}
+    }
+}
+
+void Disk::fill_begin(int blocknum) {
+    Fill &fill = Filling[blocknum];
+    if (fill.Readers++ == 0) {
+    	fill.Stale = false;
+    }
+}
+
+void Disk::fill_end(int blocknum, char *data) {
+    auto it = Filling.find(blocknum);
+    bool stale = it->second.Stale;
+    if (--it->second.Readers == 0) {
+    	Filling.erase(it);
+    }
+
+    if (data == NULL || Cache == NULL || Cache->lookup(blocknum, data) || stale) {
+    	return;
+    }
+    cache_insert(blocknum, data, false);
 }
 
 void Disk::sanity_check(int blocknum, char *data) {
@@ -58,36 +210,585 @@ void Disk::sanity_check(int blocknum, char *data) {
 
 void Disk::read(int blocknum, char *data) {
     sanity_check(blocknum, data);
+    trace(TRACE_READ, blocknum, 1);
+
+    if (Cache) {
+    	{
+    	    std::lock_guard<std::mutex> guard(CacheLock);
+    	    if (Cache->lookup(blocknum, data)) {
+    	    	CacheHits++;
+    	    	return;
+	    }
+    	    CacheMisses++;
+    	    fill_begin(blocknum);
+	}
+
+    	// Other threads keep using the cache while the miss is read
+    	try {
+    	    read_block(blocknum, data);
+	} catch (...) {
+	    std::lock_guard<std::mutex> guard(CacheLock);
+	    fill_end(blocknum, NULL);
+	    throw;
+	}
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	fill_end(blocknum, data);
+    	return;
+    }
+
+    read_block(blocknum, data);
+}
+
+void Disk::write(int blocknum, char *data) {
+    sanity_check(blocknum, data);
+    trace(TRACE_WRITE, blocknum, 1);
+
+    if (Cache) {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	cache_insert(blocknum, data, true);
+    	return;
+    }
+
+    write_block(blocknum, data);
+}
+
+void Disk::readv(int start, size_t count, char **buffers) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(start + i, buffers[i]);
+    }
+    trace(TRACE_READ, start, count);
+
+    if (Cache == NULL) {
+    	read_run(start, count, buffers);
+    	return;
+    }
+
+    // Serve hits from cache, then read each run of misses at once without
+    // CacheLock
+    std::vector<size_t> misses;
+    {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	for (size_t i = 0; i < count; i++) {
+    	    if (Cache->lookup(start + i, buffers[i])) {
+    	    	CacheHits++;
+	    } else {
+	    	misses.push_back(i);
+	    	fill_begin(start + i);
+	    }
+	}
+    	CacheMisses += misses.size();
+    }
+
+    try {
+    	size_t i = 0;
+    	while (i < misses.size()) {
+    	    size_t j = i + 1;
+    	    while (j < misses.size() && misses[j] == misses[j - 1] + 1) {
+    	    	j++;
+	    }
+    	    read_run(start + misses[i], j - i, buffers + misses[i]);
+    	    i = j;
+	}
+    } catch (...) {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	for (auto i : misses) {
+    	    fill_end(start + i, NULL);
+	}
+    	throw;
+    }
+
+    std::lock_guard<std::mutex> guard(CacheLock);
+    for (auto i : misses) {
+    	fill_end(start + i, buffers[i]);
+    }
+}
+
+void Disk::writev(int start, size_t count, char **buffers) {
+    for (size_t i = 0; i < count; i++) {
+    	sanity_check(start + i, buffers[i]);
+    }
+    trace(TRACE_WRITE, start, count);
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+    if (Cache == NULL) {
+    	write_run(start, count, buffers);
+    	return;
+    }
+
+    std::lock_guard<std::mutex> guard(CacheLock);
+    for (size_t i = 0; i < count; i++) {
+    	cache_insert(start + i, buffers[i], true);
+    }
+}
+
+void Disk::readv(const int *blocknums, size_t count, char **buffers) {
+    size_t i = 0;
+    while (i < count) {
+    	size_t j = run_length(blocknums + i, count - i);
+    	readv(blocknums[i], j, buffers + i);
+    	i += j;
+    }
+}
+
+void Disk::writev(const int *blocknums, size_t count, char **buffers) {
+    size_t i = 0;
+    while (i < count) {
+    	size_t j = run_length(blocknums + i, count - i);
+    	writev(blocknums[i], j, buffers + i);
+    	i += j;
+    }
+}
+
+void Disk::discard(int start, size_t count) {
+    if (count == 0) {
+    	return;
+    }
+    if (start < 0 || start + count > Blocks) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    	snprintf(what, BUFSIZ, "discard of %lu blocks at %d is out of range!", count, start);
+    	throw std::invalid_argument(what);
+    }
+
+    // Queued requests may still refer to these blocks
+    submit();
+    trace(TRACE_DISCARD, start, count);
+
+    if (Cache) {
+    	std::lock_guard<std::mutex> guard(CacheLock);
+    	for (size_t i = 0; i < count; i++) {
+    	    Cache->remove(start + i);
+    	    auto it = Filling.find(start + i);
+    	    if (it != Filling.end()) {
+    	    	it->second.Stale = true;
+	    }
+	}
     }
 
-    if (::read(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (fallocate(FileDescriptor, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+    		  (off_t)start*BLOCK_SIZE, (off_t)count*BLOCK_SIZE) == 0) {
+    	Discards += count;
+    	return;
+    }
+#endif
+
+    // No hole punching: overwrite the run with zeros instead
+    std::vector<char> zero(BLOCK_SIZE, 0);
+    std::vector<char *> buffers(count, zero.data());
+    write_run(start, count, buffers.data());
+}
+
+ssize_t Disk::copy_range(off_t offset, size_t length, int fd) {
+    if (offset < 0 || (size_t)offset + length > Blocks*BLOCK_SIZE) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
-    	throw std::runtime_error(what);
+    	snprintf(what, BUFSIZ, "copy of %lu bytes at %ld is out of range!", length, (long)offset);
+    	throw std::invalid_argument(what);
     }
 
-    Reads++;
+    // Cached and queued writes must reach the image before the kernel reads it
+    flush();
+    trace(TRACE_READ, offset / BLOCK_SIZE, ((size_t)offset % BLOCK_SIZE + length + BLOCK_SIZE - 1) / BLOCK_SIZE);
+
+    // Try each method in turn; one that fails before copying anything
+    // (EXDEV, EINVAL, ENOSYS, ...) hands the rest over to the next
+    enum { COPY_FILE_RANGE, SENDFILE, READ_WRITE } method = COPY_FILE_RANGE;
+    off_t  position = offset;
+    size_t left	    = length;
+    while (left > 0) {
+    	ssize_t n = -1;
+    	if (method == COPY_FILE_RANGE) {
+#ifdef SFS_HAVE_COPY_FILE_RANGE
+    	    n = copy_file_range(FileDescriptor, &position, fd, NULL, left, 0);
+#else
+    	    errno = ENOSYS;
+#endif
+	} else if (method == SENDFILE) {
+	    n = sendfile(fd, FileDescriptor, &position, left);
+	} else {
+	    char buffer[BLOCK_SIZE];
+	    n = pread(FileDescriptor, buffer, std::min(left, (size_t)BLOCK_SIZE), position);
+	    for (ssize_t done = 0; n > 0 && done < n; ) {
+	    	ssize_t w = ::write(fd, buffer + done, n - done);
+	    	if (w < 0 && errno != EINTR) {
+	    	    return -1;
+		}
+	    	done += std::max(w, (ssize_t)0);
+	    }
+	    position += std::max(n, (ssize_t)0);
+	}
+
+    	if (n < 0 && errno == EINTR) {
+    	    continue;
+	}
+    	if (n < 0 && method != READ_WRITE) {
+    	    method = method == COPY_FILE_RANGE ? SENDFILE : READ_WRITE;
+    	    continue;
+	}
+    	if (n <= 0) {
+    	    return -1;
+	}
+    	left -= n;
+    }
+
+    // Count every block touched, as a pread of the same range would
+    count(offset / BLOCK_SIZE, ((size_t)offset % BLOCK_SIZE + length + BLOCK_SIZE - 1) / BLOCK_SIZE, false);
+    return length;
 }
 
-void Disk::write(int blocknum, char *data) {
-    sanity_check(blocknum, data);
+void Disk::count(int start, size_t count, bool write) {
+    size_t kinds[KINDS] = {0};
+    for (size_t i = 0; i < count; i++) {
+    	kinds[__atomic_load_n(&Kinds[start + i], __ATOMIC_RELAXED)]++;
+    }
+    for (size_t kind = 0; kind < KINDS; kind++) {
+    	if (kinds[kind]) {
+    	    (write ? KindWrites : KindReads)[kind] += kinds[kind];
+	}
+    }
+    (write ? Writes : Reads) += count;
+}
+
+// Tracing: records are buffered per disk and written out in batches
+
+static const size_t TRACE_BATCH = 4096;
+
+static uint32_t thread_ordinal() {
+    static std::atomic<uint32_t> next(0);
+    static thread_local uint32_t ordinal = next++;
+    return ordinal;
+}
+
+bool Disk::start_trace(const char *path) {
+    stop_trace();
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+    	return false;
+    }
+
+    TraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.Magic, TRACE_MAGIC, sizeof(header.Magic));
+    header.Version   = TRACE_VERSION;
+    header.BlockSize = BLOCK_SIZE;
+    header.Blocks    = Blocks;
+    fwrite(&header, sizeof(header), 1, file);
+
+    std::lock_guard<std::mutex> guard(TraceLock);
+    TraceFile  = file;
+    TraceStart = std::chrono::steady_clock::now();
+    Tracing    = true;
+    return true;
+}
+
+void Disk::stop_trace() {
+    std::lock_guard<std::mutex> guard(TraceLock);
+    if (TraceFile == NULL) {
+    	return;
+    }
+    Tracing = false;
+    trace_flush();
+    fclose(TraceFile);
+    TraceFile = NULL;
+}
+
+void Disk::trace(TraceType type, int start, size_t count) {
+    if (!Tracing.load(std::memory_order_relaxed)) {
+    	return;
+    }
+
+    TraceRecord record;
+    memset(&record, 0, sizeof(record));
+    record.Block     = start;
+    record.Count     = count;
+    record.Thread    = thread_ordinal();
+    record.Type      = type;
+    record.Operation = Stats::current();
+
+    std::lock_guard<std::mutex> guard(TraceLock);
+    if (TraceFile == NULL) {
+    	return;
+    }
+    record.Time = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - TraceStart).count();
+    TraceBuffer.push_back(record);
+    if (TraceBuffer.size() >= TRACE_BATCH) {
+    	trace_flush();
+    }
+}
 
-    if (lseek(FileDescriptor, blocknum*BLOCK_SIZE, SEEK_SET) < 0) {
+void Disk::trace_flush() {
+    if (!TraceBuffer.empty()) {
+    	fwrite(TraceBuffer.data(), sizeof(TraceRecord), TraceBuffer.size(), TraceFile);
+    	TraceBuffer.clear();
+    }
+}
+
+void Disk::reset_kinds() {
+    for (size_t kind = 0; kind < KINDS; kind++) {
+    	KindReads[kind]  = 0;
+    	KindWrites[kind] = 0;
+    }
+}
+
+void Disk::set_kind(size_t start, size_t count, Kind kind) {
+    for (size_t i = start; i < start + count && i < Kinds.size(); i++) {
+    	__atomic_store_n(&Kinds[i], (uint8_t)kind, __ATOMIC_RELAXED);
+    }
+}
+
+size_t Disk::run_length(const int *blocknums, size_t count) {
+    size_t n = 1;
+    while (n < count && blocknums[n] == blocknums[n - 1] + 1) {
+    	n++;
+    }
+    return n;
+}
+
+void Disk::read_block(int blocknum, char *data) {
+    if (Mapping) {
+    	memcpy(data, Mapping + (size_t)blocknum*BLOCK_SIZE, BLOCK_SIZE);
+    	count(blocknum, 1, false);
+    	return;
+    }
+
+    if (pread(FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
-    	snprintf(what, BUFSIZ, "Unable to lseek %d: %s", blocknum, strerror(errno));
+    	snprintf(what, BUFSIZ, "Unable to read %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    if (::write(FileDescriptor, data, BLOCK_SIZE) != BLOCK_SIZE) {
+    count(blocknum, 1, false);
+}
+
+void Disk::write_block(int blocknum, const char *data) {
+    if (Mapping) {
+    	memcpy(Mapping + (size_t)blocknum*BLOCK_SIZE, data, BLOCK_SIZE);
+    	count(blocknum, 1, true);
+    	return;
+    }
+
+    if (pwrite(FileDescriptor, data, BLOCK_SIZE, (off_t)blocknum*BLOCK_SIZE) != BLOCK_SIZE) {
     	char what[BUFSIZ];
     	snprintf(what, BUFSIZ, "Unable to write %d: %s", blocknum, strerror(errno));
     	throw std::runtime_error(what);
     }
 
-    Writes++;
+    count(blocknum, 1, true);
+}
+
+void Disk::read_run(int start, size_t count, char **buffers) {
+    transfer_run(start, count, buffers, false);
+    this->count(start, count, false);
+}
+
+void Disk::write_run(int start, size_t count, char **buffers) {
+    transfer_run(start, count, buffers, true);
+    this->count(start, count, true);
+}
+
+void Disk::transfer_run(int start, size_t count, char **buffers, bool write) {
+    if (Mapping) {
+    	for (size_t i = 0; i < count; i++) {
+    	    char *block = Mapping + (start + i)*BLOCK_SIZE;
+    	    if (write) {
+    	    	memcpy(block, buffers[i], BLOCK_SIZE);
+	    } else {
+	    	memcpy(buffers[i], block, BLOCK_SIZE);
+	    }
+	}
+    	return;
+    }
+
+    struct iovec iov[IOV_MAX];
+
+    // Submit up to IOV_MAX blocks per call and resume after short transfers
+    size_t done = 0;
+    while (done < count) {
+    	size_t n = std::min(count - done, (size_t)IOV_MAX);
+    	for (size_t i = 0; i < n; i++) {
+    	    iov[i].iov_base = buffers[done + i];
+    	    iov[i].iov_len  = BLOCK_SIZE;
+	}
+
+    	struct iovec *next = iov;
+    	off_t  offset	 = (off_t)(start + done)*BLOCK_SIZE;
+    	size_t remaining = n*BLOCK_SIZE;
+    	while (remaining > 0) {
+	    ssize_t result = write ? pwritev(FileDescriptor, next, iov + n - next, offset)
+	    			   : preadv(FileDescriptor, next, iov + n - next, offset);
+	    if (result <= 0) {
+		char what[BUFSIZ];
+		snprintf(what, BUFSIZ, "Unable to %s %lu blocks at %lu: %s",
+		    write ? "write" : "read", n, start + done, result < 0 ? strerror(errno) : "end of file");
+		throw std::runtime_error(what);
+	    }
+
+	    offset    += result;
+	    remaining -= result;
+	    while (result > 0 && result >= (ssize_t)next->iov_len) {
+	    	result -= next->iov_len;
+	    	next++;
+	    }
+	    if (result > 0) {
+	    	next->iov_base = (char *)next->iov_base + result;
+	    	next->iov_len -= result;
+	    }
+	}
+    	done += n;
+    }
+}
+
+void Disk::queue_read(int blocknum, char *data) {
+    sanity_check(blocknum, data);
+    Request request = {blocknum, data, false};
+    std::lock_guard<std::mutex> guard(QueueLock);
+    Queues[std::this_thread::get_id()].push_back(request);
+}
+
+void Disk::queue_write(int blocknum, char *data) {
+    sanity_check(blocknum, data);
+    Request request = {blocknum, data, true};
+    std::lock_guard<std::mutex> guard(QueueLock);
+    Queues[std::this_thread::get_id()].push_back(request);
+}
+
+size_t Disk::queued() {
+    std::lock_guard<std::mutex> guard(QueueLock);
+    auto it = Queues.find(std::this_thread::get_id());
+    return it == Queues.end() ? 0 : it->second.size();
+}
+
+void Disk::submit() {
+    // Take this thread's requests; other threads keep queueing meanwhile
+    std::vector<Request> queue;
+    {
+    	std::lock_guard<std::mutex> guard(QueueLock);
+    	auto it = Queues.find(std::this_thread::get_id());
+    	if (it == Queues.end()) {
+    	    return;
+	}
+    	queue.swap(it->second);
+    	Queues.erase(it);
+    }
+    if (queue.empty()) {
+    	return;
+    }
+
+    // Order by operation and block so consecutive blocks merge into runs
+    std::stable_sort(queue.begin(), queue.end(), [](const Request &a, const Request &b) {
+    	return a.Write != b.Write ? b.Write : a.BlockNum < b.BlockNum;
+    });
+
+    if (Ring && Cache == NULL) {
+    	std::lock_guard<std::mutex> guard(RingLock);
+    	submit_ring(queue);
+    } else {
+    	submit_sync(queue);
+    }
+}
+
+void Disk::submit_sync(std::vector<Request> &queue) {
+    std::vector<int> nums[2];
+    std::vector<char *> buffers[2];
+    for (auto &request : queue) {
+    	nums[request.Write].push_back(request.BlockNum);
+    	buffers[request.Write].push_back(request.Data);
+    }
+
+    if (!nums[0].empty()) {
+    	readv(nums[0].data(), nums[0].size(), buffers[0].data());
+    }
+    if (!nums[1].empty()) {
+    	writev(nums[1].data(), nums[1].size(), buffers[1].data());
+    }
+}
+
+void Disk::submit_ring(std::vector<Request> &queue) {
+    struct Run {
+    	int	Start;	    // First block
+    	size_t	Count;	    // Number of blocks
+    	bool	Write;	    // Whether run is a write
+    	size_t	Iov;	    // Index of first buffer
+    };
+
+    // One vectored request per run of consecutive blocks
+    std::vector<struct iovec> iov(queue.size());
+    std::vector<Run> runs;
+    for (size_t i = 0; i < queue.size(); i++) {
+    	iov[i].iov_base = queue[i].Data;
+    	iov[i].iov_len  = BLOCK_SIZE;
+
+    	Run *last = runs.empty() ? NULL : &runs.back();
+    	if (last && last->Write == queue[i].Write && last->Start + (int)last->Count == queue[i].BlockNum &&
+    	    last->Count < IOV_MAX) {
+    	    last->Count++;
+	} else {
+	    Run run = {queue[i].BlockNum, 1, queue[i].Write, i};
+	    runs.push_back(run);
+	}
+    }
+
+    for (size_t i = 0; i < runs.size(); i++) {
+    	trace(runs[i].Write ? TRACE_WRITE : TRACE_READ, runs[i].Start, runs[i].Count);
+    }
+
+    // Keep up to URING_DEPTH runs in flight; drain everything before
+    // reporting an error so no buffer is still owned by the kernel. If the
+    // ring refuses entries they are taken back, and once the runs in flight
+    // complete, the rest go through pread/pwrite
+    size_t next = 0, inflight = 0, failed = 0;
+    int error = 0;
+    bool fallback = false;
+    while ((next < runs.size() && !fallback) || inflight > 0) {
+    	while (!fallback && next < runs.size() && inflight < Ring->depth()) {
+    	    Run &run = runs[next];
+    	    Ring->prepare(run.Write, FileDescriptor, &iov[run.Iov], run.Count,
+    	    		  (off_t)run.Start*BLOCK_SIZE, next);
+    	    next++;
+    	    inflight++;
+	}
+
+    	if (Ring->submit(1) < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+    	    unsigned withdrawn = Ring->withdraw();
+    	    next     -= withdrawn;
+    	    inflight -= withdrawn;
+    	    if (fallback) {
+    	    	// Even waiting fails: let the kernel post completions meanwhile
+    	    	sched_yield();
+	    }
+    	    fallback = true;
+	}
+
+    	uint64_t id;
+    	int result;
+    	while (Ring->reap(&id, &result)) {
+    	    Run &run = runs[id];
+    	    if (result != (int)(run.Count*BLOCK_SIZE)) {
+    	    	failed = id;
+    	    	error  = result < 0 ? -result : EIO;
+	    } else {
+	    	count(run.Start, run.Count, run.Write);
+	    }
+    	    inflight--;
+	}
+    }
+
+    for (; next < runs.size(); next++) {
+    	Run &run = runs[next];
+    	std::vector<char *> buffers;
+    	for (size_t i = run.Iov; i < run.Iov + run.Count; i++) {
+    	    buffers.push_back(queue[i].Data);
+	}
+    	if (run.Write) {
+    	    write_run(run.Start, run.Count, buffers.data());
+	} else {
+	    read_run(run.Start, run.Count, buffers.data());
+	}
+    }
+
+    if (error) {
+    	char what[BUFSIZ];
+    	snprintf(what, BUFSIZ, "Unable to %s %lu blocks at %d: %s", runs[failed].Write ? "write" : "read",
+    	    runs[failed].Count, runs[failed].Start, strerror(error));
+    	throw std::runtime_error(what);
+    }
 }
@@ -0,0 +1,152 @@
+// file.cpp: Open inode handles
+
+#include "sfs/fs.h"
+
+#include <string.h>
+
+// Handles keep the decoded inode, the indirect block (or extent list, or
+// pointer tree blocks) between calls; data is written as it arrives, the
+// inode and pointer blocks only by fsync and close
+
+FileSystem::File::File(FileSystem *fs, size_t inumber, bool transient)
+    : FS(fs), Inumber(inumber), Offset(0), Transient(transient), NodeDirty(false),
+      IndirectLoaded(false), IndirectDirty(false), ExtentsLoaded(false)
+{
+    memset(&Node, 0, sizeof(Node));
+}
+
+ssize_t FileSystem::File::read(char *data, size_t length)
+{
+    if (FS == NULL)
+    {
+        return -1;
+    }
+    Stats::Timer timer(FS->op_stats, Stats::OP_READ);
+    SharedGuard mounted(FS->mount_lock);
+    SharedGuard guard(FS->node_lock(Inumber));
+    std::lock_guard<std::mutex> handle_guard(Lock);
+    ssize_t result = FS->read_file(this, data, length, Offset);
+    if (result > 0)
+    {
+        Offset += result;
+    }
+    return result;
+}
+
+ssize_t FileSystem::File::write(char *data, size_t length)
+{
+    if (FS == NULL)
+    {
+        return -1;
+    }
+    Stats::Timer timer(FS->op_stats, Stats::OP_WRITE);
+    SharedGuard mounted(FS->mount_lock);
+    std::lock_guard<RWLock> guard(FS->node_lock(Inumber));
+    ssize_t result = FS->write_file(this, data, length, Offset);
+    if (result > 0)
+    {
+        Offset += result;
+    }
+    return result;
+}
+
+ssize_t FileSystem::File::size() const
+{
+    if (FS == NULL)
+    {
+        return -1;
+    }
+    SharedGuard mounted(FS->mount_lock);
+    SharedGuard guard(FS->node_lock(Inumber));
+    return node_size(&Node, FS->features);
+}
+
+bool FileSystem::File::fsync()
+{
+    if (FS == NULL)
+    {
+        return false;
+    }
+    SharedGuard mounted(FS->mount_lock);
+    std::lock_guard<RWLock> guard(FS->node_lock(Inumber));
+    FS->flush_file(this);
+    return true;
+}
+
+bool FileSystem::File::close()
+{
+    // Nobody can be using the handle once it is out of files under the
+    // exclusive node lock
+    if (FS != NULL)
+    {
+        SharedGuard mounted(FS->mount_lock);
+        std::lock_guard<RWLock> guard(FS->node_lock(Inumber));
+        FS->flush_file(this);
+        std::lock_guard<std::mutex> files_guard(FS->files_lock);
+        FS->files.erase(Inumber);
+    }
+    bool result = FS != NULL;
+    delete this;
+    return result;
+}
+
+// Open inode ------------------------------------------------------------------
+
+FileSystem::File *FileSystem::open(size_t inumber)
+{
+    SharedGuard mounted(this->mount_lock);
+    std::lock_guard<RWLock> guard(this->node_lock(inumber));
+    if (this->disk == NULL || this->find_file(inumber))
+    {
+        return NULL;
+    }
+    File *file = new File(this, inumber, false);
+    if (!this->open_node(file))
+    {
+        delete file;
+        return NULL;
+    }
+    std::lock_guard<std::mutex> files_guard(this->files_lock);
+    this->files[inumber] = file;
+    return file;
+}
+
+// decode the inode of a handle
+
+bool FileSystem::open_node(File *file)
+{
+    return this->load_node(file->Inumber, &file->Node) >= 0;
+}
+
+// return the extent list of a handle, reading the extent block on first use
+
+std::vector<FileSystem::Extent> &FileSystem::file_extents(File *file)
+{
+    if (!file->ExtentsLoaded)
+    {
+        file->Extents.clear();
+        this->load_extents(&file->Node, file->Extents);
+        file->ExtentsLoaded = true;
+    }
+    return file->Extents;
+}
+
+// write back changed pointer blocks and the inode in one batch, then the
+// free bitmap
+
+void FileSystem::flush_file(File *file)
+{
+    if (file->IndirectDirty)
+    {
+        this->disk->queue_write(file->Node.Indirect, file->Indirect.Data);
+        file->IndirectDirty = false;
+    }
+    this->tree_flush(file->Tree);
+    if (file->NodeDirty)
+    {
+        this->save_node(file->Inumber, &file->Node);
+        file->NodeDirty = false;
+    }
+    this->flush_inodes();
+    this->save_bitmap();
+}
@@ -3,68 +3,16 @@
 #include "sfs/fs.h"
 
 #include <algorithm>
+#include <atomic>
+#include <vector>
 
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
 
-//get the details of inodes
-
-void FileSystem::debugInodeBlock(Disk *disk, int inode_block_num)
-{
-    Block block;
-    for (int i = 0; i < inode_block_num; i++)
-    {
-        disk->read(i + 1, block.Data);
-        for (int j = 0; j < INODES_PER_BLOCK; j++)
-        {
-            if (block.Inodes[j].Valid == 0)
-            {
-                continue;
-            }
-            printf("Inode %d:\n", j);
-            printf("    size: %u bytes\n", block.Inodes[j].Size);
-
-            printf("    direct blocks:");
-            for (int k = 0; k < POINTERS_PER_INODE; k++)
-            {
-                if (block.Inodes[j].Direct[k] > 0)
-                {
-                    printf(" %d", block.Inodes[j].Direct[k]);
-                }
-            }
-            printf("\n");
-
-            int indirect = block.Inodes[j].Indirect;
-            if (indirect != 0)
-            {
-                printf("    indirect block: %d\n", indirect);
-                readIndirectBlock(disk, indirect);
-            }
-        }
-    }
-}
-
-//get indirect data blocks
-
-void FileSystem::readIndirectBlock(Disk *disk, int block_num)
-{
-    Block block;
-    disk->read(block_num, block.Data);
-    printf("    indirect data blocks:");
-    for (int i = 0; i < POINTERS_PER_BLOCK; i++)
-    {
-        if (block.Pointers[i] > 0)
-        {
-            printf(" %u", block.Pointers[i]);
-        }
-    }
-    printf("\n");
-}
-
 // Debug file system -----------------------------------------------------------
 
-void FileSystem::debug(Disk *disk)
+void FileSystem::debug(Disk *disk, unsigned threads)
 {
     Block block;
     // Read Superblock
@@ -82,8 +30,95 @@ void FileSystem::debug(Disk *disk)
     printf("    %u blocks\n", block.Super.Blocks);
     printf("    %u inode blocks\n", block.Super.InodeBlocks);
     printf("    %u inodes\n", block.Super.Inodes);
-    // Read Inode blocks
-    debugInodeBlock(disk, block.Super.InodeBlocks);
+    if (block.Super.Revision > 0)
+    {
+        printf("    revision %u\n", block.Super.Revision);
+        if (block.Super.Features & FEATURE_BITMAP)
+        {
+            printf("    %u bitmap blocks\n", block.Super.BitmapBlocks);
+            printf("    %s\n", block.Super.Clean ? "clean" : "not clean");
+        }
+        if (block.Super.Features & FEATURE_EXTENTS)
+        {
+            printf("    extents\n");
+        }
+        if (block.Super.Features & FEATURE_LARGE)
+        {
+            printf("    large files\n");
+        }
+        if (block.Super.Features & FEATURE_INLINE)
+        {
+            printf("    inline data\n");
+        }
+        if (block.Super.Features & FEATURE_COMPRESS)
+        {
+            printf("    compressed data\n");
+        }
+        if (block.Super.Features & FEATURE_DEDUP)
+        {
+            printf("    %u reference blocks\n", block.Super.RefBlocks);
+        }
+    }
+    // Read Inode blocks, then print what the scan found in inode order
+    uint32_t features = block.Super.Revision > 0 ? block.Super.Features : 0;
+    Bitmap bitmap;
+    std::vector<ScanRecord> records;
+    scan_inodes(disk, block.Super, threads, &bitmap, NULL, &records, NULL);
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        Inode &inode = records[i].Node;
+        printf("Inode %u:\n", records[i].Inumber);
+        printf("    size: %lu bytes\n", (unsigned long)node_size(&inode, features));
+        if (is_inline(&inode, features))
+        {
+            printf("    inline data\n");
+            continue;
+        }
+        if (features & FEATURE_EXTENTS)
+        {
+            printf("    extents:");
+            for (size_t k = 0; k < records[i].Extents.size(); k++)
+            {
+                printf(" %u+%u", records[i].Extents[k].Start, records[i].Extents[k].Length);
+            }
+            printf("\n");
+            if (inode.Direct[POINTERS_PER_INODE - 1] > EXTENTS_PER_INODE)
+            {
+                printf("    extent block: %u\n", inode.Indirect);
+            }
+            continue;
+        }
+        printf("    direct blocks:");
+        uint32_t direct = (features & FEATURE_LARGE) ? LARGE_DIRECT : POINTERS_PER_INODE;
+        for (uint32_t k = 0; k < direct; k++)
+        {
+            if (inode.Direct[k] > 0)
+            {
+                printf(" %u", inode.Direct[k] & data_mask(features));
+            }
+        }
+        printf("\n");
+        static const char *names[LARGE_TREES] = {"indirect", "double indirect", "triple indirect"};
+        uint32_t trees = (features & FEATURE_LARGE) ? LARGE_TREES : 1;
+        for (uint32_t tree = 0; tree < trees; tree++)
+        {
+            uint32_t root = *tree_root(&inode, tree);
+            if (root == 0)
+            {
+                continue;
+            }
+            printf("    %s block: %u\n", names[tree], root);
+            if (root < disk->size())
+            {
+                printf("    %s data blocks:", names[tree]);
+                for (size_t k = 0; k < records[i].Pointers[tree].size(); k++)
+                {
+                    printf(" %u", records[i].Pointers[tree][k]);
+                }
+                printf("\n");
+            }
+        }
+    }
 }
 
 // init a free block when use it
@@ -97,78 +132,156 @@ void FileSystem::init_data_block(int block_num)
 
 // Format file system ----------------------------------------------------------
 
-bool FileSystem::format(Disk *disk)
+bool FileSystem::format(Disk *disk, uint32_t features, bool fast)
 {
     // Write superblock
-    if (disk->mounted())
+    if (disk->mounted() || (features & ~FEATURES))
     {
         return false;
     }
+    // Extents and the large pointer tree are alternative inode layouts;
+    // compressed clusters need pointers, and their top bit for the flag
     size_t size = disk->size();
+    if ((features & FEATURE_EXTENTS) && (features & (FEATURE_LARGE | FEATURE_COMPRESS)))
+    {
+        return false;
+    }
+    if ((features & FEATURE_COMPRESS) && size >= COMPRESSED_BLOCK)
+    {
+        return false;
+    }
+    // Shared blocks are counted in a table after the free bitmap, per pointer
+    if ((features & FEATURE_DEDUP) && (!(features & FEATURE_BITMAP) || (features & (FEATURE_EXTENTS | FEATURE_COMPRESS))))
+    {
+        return false;
+    }
     Block superBlock;
     memset(&superBlock, 0, 4096);
     superBlock.Super.MagicNumber = MAGIC_NUMBER;
     superBlock.Super.Blocks = size;
     superBlock.Super.InodeBlocks = (size % 10 == 0) ? size / 10 : size / 10 + 1;
     superBlock.Super.Inodes = INODES_PER_BLOCK * superBlock.Super.InodeBlocks;
+    if (features != 0)
+    {
+        superBlock.Super.Revision = FORMAT_REVISION;
+        superBlock.Super.Features = features;
+    }
+    if (features & FEATURE_BITMAP)
+    {
+        superBlock.Super.BitmapStart = superBlock.Super.InodeBlocks + 1;
+        superBlock.Super.BitmapBlocks = (size + Bitmap::REGION_BITS - 1) / Bitmap::REGION_BITS;
+        superBlock.Super.Clean = 1;
+        if (superBlock.Super.BitmapStart + superBlock.Super.BitmapBlocks > size)
+        {
+            return false;
+        }
+    }
+    if (features & FEATURE_DEDUP)
+    {
+        superBlock.Super.RefStart = superBlock.Super.BitmapStart + superBlock.Super.BitmapBlocks;
+        superBlock.Super.RefBlocks = (size + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK;
+        if (superBlock.Super.RefStart + superBlock.Super.RefBlocks > size)
+        {
+            return false;
+        }
+    }
+    mark_layout(disk, superBlock.Super);
     disk->write(0, (char *)&superBlock.Super);
-    // Clear all other blocks
-    for (int i = 0; i < size - 1; i++)
+    // Clear all other blocks except the free bitmap, written below; a fast
+    // format clears only the inode and reference tables and punches out the
+    // data region
+    uint32_t bitmap_start = superBlock.Super.BitmapStart;
+    uint32_t bitmap_end = bitmap_start + superBlock.Super.BitmapBlocks + superBlock.Super.RefBlocks;
+    uint32_t data_start = superBlock.Super.InodeBlocks + 1;
+    if (features & FEATURE_BITMAP)
+    {
+        clear_blocks(disk, 1, bitmap_start);
+        clear_blocks(disk, bitmap_start + superBlock.Super.BitmapBlocks, bitmap_end);
+        data_start = bitmap_end;
+    }
+    else
+    {
+        clear_blocks(disk, 1, data_start);
+    }
+    if (fast)
+    {
+        disk->discard(data_start, size - data_start);
+    }
+    else
+    {
+        clear_blocks(disk, data_start, size);
+    }
+    if (features & FEATURE_BITMAP)
     {
-        Block temp;
-        memset(temp.Data, 0, 4096);
-        disk->write(i + 1, (char *)&temp);
+        Bitmap bitmap;
+        bitmap.resize(size);
+        for (uint32_t i = 0; i < bitmap_end; i++)
+        {
+            bitmap.set(i);
+        }
+        for (uint32_t i = 0; i < superBlock.Super.BitmapBlocks; i++)
+        {
+            write_bitmap_block(disk, bitmap, bitmap_start, i);
+        }
     }
     return true;
 }
 
-//generate bitmap for filesystem
+// tell the disk which blocks hold the superblock, inode table, free bitmap
+// and reference table; everything else counts as data until known to hold pointers
 
-void FileSystem::get_bitmap(Block block)
+void FileSystem::mark_layout(Disk *disk, const SuperBlock &super)
 {
-    int bitmap[block.Super.Blocks];
-    for (int i = 0; i < block.Super.Blocks; i++)
+    disk->set_kind(0, disk->size(), Disk::KIND_DATA);
+    disk->set_kind(0, 1, Disk::KIND_SUPER);
+    disk->set_kind(1, super.InodeBlocks, Disk::KIND_INODE);
+    if (super.Revision > 0 && (super.Features & FEATURE_BITMAP))
     {
-        bitmap[i] = 0;
+        disk->set_kind(super.BitmapStart, super.BitmapBlocks, Disk::KIND_BITMAP);
     }
-    bitmap[0] = 1;
-    for (int i = 0; i < block.Super.InodeBlocks; i++)
+    if (super.Revision > 0 && (super.Features & FEATURE_DEDUP))
     {
-        bitmap[i + 1] = 1;
-        Block inodes_block;
-        disk->read(i + 1, inodes_block.Data);
-        for (int j = 0; j < INODES_PER_BLOCK; j++)
-        {
-            if (inodes_block.Inodes[j].Valid == 1)
-            {
+        disk->set_kind(super.RefStart, super.RefBlocks, Disk::KIND_BITMAP);
+    }
+}
 
-                for (int k = 0; k < POINTERS_PER_INODE; k++)
-                {
-                    int direct = inodes_block.Inodes[j].Direct[k];
-                    if (direct != 0)
-                    {
-                        bitmap[direct] = 1;
-                    }
-                }
-                if (inodes_block.Inodes[j].Indirect != 0)
-                {
-                    bitmap[inodes_block.Inodes[j].Indirect] = 1;
-                    Block indirect;
-                    this->disk->read(inodes_block.Inodes[j].Indirect, indirect.Data);
-                    for (int k = 0; k < POINTERS_PER_BLOCK; k++)
-                    {
-                        if (indirect.Pointers[k] != 0)
-                        {
-                            bitmap[indirect.Pointers[k]] = 1;
-                        }
-                    }
-                }
-            }
-        }
+// zero blocks [start, end), a run of blocks per vectored write
+
+void FileSystem::clear_blocks(Disk *disk, size_t start, size_t end)
+{
+    Block zero;
+    memset(zero.Data, 0, 4096);
+    std::vector<char *> buffers(FORMAT_RUN_BLOCKS, zero.Data);
+    for (; start < end; start += buffers.size())
+    {
+        size_t count = std::min(buffers.size(), end - start);
+        disk->writev(start, count, buffers.data());
     }
-    for (int i = 0; i < block.Super.Blocks; i++)
+}
+
+// write one region of the free bitmap to its on-disk block
+
+void FileSystem::write_bitmap_block(Disk *disk, const Bitmap &bitmap, uint32_t bitmap_start, size_t region)
+{
+    Block block;
+    memset(block.Data, 0, Disk::BLOCK_SIZE);
+    bitmap.copy_region(region, (uint64_t *)block.Data);
+    disk->write(bitmap_start + region, block.Data);
+}
+
+//generate bitmap for filesystem
+
+void FileSystem::get_bitmap(Block block)
+{
+    Bitmap bitmap;
+    std::vector<uint32_t> counts;
+    std::vector<uint32_t> *references = (this->features & FEATURE_DEDUP) ? &counts : NULL;
+    scan_inodes(this->disk, block.Super, this->scan_threads, &bitmap, &this->inode_map, NULL, NULL, NULL, references);
+    std::swap(this->bitmap, bitmap);
+    this->inode_known = this->inode_blocks;
+    if (references)
     {
-        this->bitmap[i] = bitmap[i];
+        this->count_references(counts);
     }
 }
 
@@ -176,21 +289,39 @@ void FileSystem::get_bitmap(Block block)
 
 bool FileSystem::mount(Disk *disk)
 {
+    std::lock_guard<RWLock> guard(this->mount_lock);
     if (disk->mounted())
     {
         return false;
     }
+    Stats::Timer timer(this->op_stats, Stats::OP_MOUNT);
     Block block;
     // Read superblock
+    disk->set_kind(0, 1, Disk::KIND_SUPER);
     disk->read(0, block.Data);
     uint32_t blocks = disk->size();
-    uint32_t inode_blocks = (blocks % 10 == 0) ? blocks / 10 : blocks / 10 + 1;
-    uint32_t inodes = inode_blocks * INODES_PER_BLOCK;
-    if (block.Super.MagicNumber != MAGIC_NUMBER || block.Super.Blocks != blocks || block.Super.InodeBlocks != inode_blocks || block.Super.Inodes != inodes)
+    if (!valid_super(block.Super, blocks))
     {
         return false;
     }
+    uint32_t inode_blocks = block.Super.InodeBlocks;
+    uint32_t inodes = block.Super.Inodes;
+    // Revision 0 images predate the feature fields
+    uint32_t features = block.Super.Revision > 0 ? block.Super.Features : 0;
+    uint32_t bitmap_start = 0;
+    uint32_t bitmap_blocks = 0;
+    uint32_t ref_blocks = 0;
+    if (features & FEATURE_BITMAP)
+    {
+        bitmap_start = block.Super.BitmapStart;
+        bitmap_blocks = block.Super.BitmapBlocks;
+    }
+    if (features & FEATURE_DEDUP)
+    {
+        ref_blocks = block.Super.RefBlocks;
+    }
     // Set device and mount
+    mark_layout(disk, block.Super);
     disk->mount();
     // Copy metadata
     this->disk = disk;
@@ -198,297 +329,1524 @@ bool FileSystem::mount(Disk *disk)
     this->blocks = blocks;
     this->inode_blocks = inode_blocks;
     this->inodes = inodes;
-    this->get_bitmap(block);
-    return true;
-}
-
-// Create inode ----------------------------------------------------------------
-
-ssize_t FileSystem::create()
-{
-    // Locate free inode in inode table
-    Block super_block;
-    this->disk->read(0, super_block.Data);
-    for (int i = 0; i < super_block.Super.InodeBlocks; i++)
+    this->features = features;
+    this->bitmap_start = bitmap_start;
+    this->bitmap_blocks = bitmap_blocks;
+    this->ref_blocks = ref_blocks;
+    // No inode block is resident yet; a scan below learns every valid inode,
+    // otherwise inode blocks are learned as they are first read
+    this->inode_cache.clear();
+    this->inode_slots.assign(inode_blocks, 0);
+    this->inode_dirty.clear();
+    this->inode_map.resize(inodes, true);
+    this->inode_known = 0;
+    this->scrub_queue.clear();
+    this->refs.clear();
+    this->refs_dirty.clear();
+    this->ref_index.clear();
+    if (!(features & FEATURE_BITMAP))
+    {
+        this->get_bitmap(block);
+        return true;
+    }
+    // Trust the saved bitmap and reference table only after a clean
+    // unmount; otherwise rebuild them from the inode table and write them
+    // back
+    if (!block.Super.Clean || !this->load_bitmap() || !this->load_references())
     {
-        Block temp;
-        this->disk->read(i + 1, temp.Data);
-        for (int j = 0; j < INODES_PER_BLOCK; j++)
+        this->get_bitmap(block);
+        for (uint32_t i = 0; i < bitmap_blocks; i++)
         {
-            if (temp.Inodes[j].Valid == 0)
-            {
-                temp.Inodes[j].Valid = 1;
-                this->disk->write(i + 1, (char *)&temp);
-                return j;
-            }
+            write_bitmap_block(disk, this->bitmap, bitmap_start, i);
         }
+        this->save_references();
     }
-    // Record inode if found
-    return -1;
+    this->write_super(false);
+    return true;
 }
 
-//load node by inumber
+// whether a superblock describes the geometry format gives a disk of
+// blocks blocks, with features this code knows
 
-ssize_t FileSystem::load_node(size_t inumber, Inode *node)
+bool FileSystem::valid_super(const SuperBlock &super, uint32_t blocks)
 {
-    int inode_block = inumber / INODES_PER_BLOCK + 1;
-    int index = inumber % INODES_PER_BLOCK;
-    Block block;
-    this->disk->read(inode_block, block.Data);
-    if (block.Inodes[index].Valid == 0)
+    uint32_t inode_blocks = (blocks % 10 == 0) ? blocks / 10 : blocks / 10 + 1;
+    uint32_t inodes = inode_blocks * INODES_PER_BLOCK;
+    if (super.MagicNumber != MAGIC_NUMBER || super.Blocks != blocks || super.InodeBlocks != inode_blocks || super.Inodes != inodes)
     {
-        return -1;
+        return false;
     }
-    // node = &block.Inodes[index];
-    memcpy(node, &block.Inodes[index], sizeof(Inode));
-    int size = block.Inodes[index].Size;
-    return size;
-}
-
-// save the inumber
-bool FileSystem::save_node(size_t inumber, Inode *node)
-{
-    int inode_block = inumber / INODES_PER_BLOCK + 1;
-    int index = inumber % INODES_PER_BLOCK;
-    Block block;
-    this->disk->read(inode_block, block.Data);
-    if (block.Inodes[index].Valid == 0)
+    uint32_t features = super.Revision > 0 ? super.Features : 0;
+    if (super.Revision > FORMAT_REVISION || (features & ~FEATURES))
     {
         return false;
     }
-    memcpy(&block.Inodes[index], node, sizeof(Inode));
-    this->disk->write(inode_block, (char *)&block);
-    return true;
-}
-// Remove inode ----------------------------------------------------------------
-
-bool FileSystem::remove(size_t inumber)
-{
-    // Load inode information
-    Inode node;
-    memset(&node, 0, sizeof(Inode));
-    if (this->load_node(inumber, &node) < 0)
+    if ((features & FEATURE_EXTENTS) && (features & (FEATURE_LARGE | FEATURE_COMPRESS)))
     {
         return false;
     }
-    node.Valid = 0;
-    node.Size = 0;
-    for (int i = 0; i < POINTERS_PER_INODE; i++)
+    if ((features & FEATURE_COMPRESS) && blocks >= COMPRESSED_BLOCK)
     {
-        if (node.Direct[i] != 0)
+        return false;
+    }
+    if ((features & FEATURE_DEDUP) && (!(features & FEATURE_BITMAP) || (features & (FEATURE_EXTENTS | FEATURE_COMPRESS))))
+    {
+        return false;
+    }
+    if (features & FEATURE_BITMAP)
+    {
+        if (super.BitmapStart != inode_blocks + 1 || super.BitmapBlocks != (blocks + Bitmap::REGION_BITS - 1) / Bitmap::REGION_BITS ||
+            super.BitmapStart + super.BitmapBlocks > blocks)
         {
-            int block_num = node.Direct[i];
-            // int data = 0;
-            this->init_data_block(block_num);
-            this->bitmap[block_num] = 0;
-            node.Direct[i] = 0;
+            return false;
         }
     }
-    // Free indirect blocks
-    if (node.Indirect != 0)
+    if (features & FEATURE_DEDUP)
     {
-        Block indirect_block;
-        this->disk->read(node.Indirect, indirect_block.Data);
-        for (int i = 0; i < POINTERS_PER_BLOCK; i++)
+        if (super.RefStart != super.BitmapStart + super.BitmapBlocks || super.RefBlocks != (blocks + REFS_PER_BLOCK - 1) / REFS_PER_BLOCK ||
+            super.RefStart + super.RefBlocks > blocks)
         {
-            if (indirect_block.Pointers[i] != 0)
-            {
-                this->init_data_block(indirect_block.Pointers[i]);
-                this->bitmap[indirect_block.Pointers[i]] = 0;
-                indirect_block.Pointers[i] = 0;
-            }
+            return false;
         }
-        this->init_data_block(node.Indirect);
-        this->bitmap[node.Indirect] = 0;
-        node.Indirect = 0;
     }
-    // Clear inode in inode table
-    return save_node(inumber, &node);
+    return true;
 }
 
-// Inode stat ------------------------------------------------------------------
+// load the free bitmap saved on disk
 
-ssize_t FileSystem::stat(size_t inumber)
+bool FileSystem::load_bitmap()
 {
-    // Load inode information
-    Inode node;
-    memset(&node, 0, sizeof(Inode));
-    return this->load_node(inumber, &node);
+    std::vector<Block> blocks(this->bitmap_blocks);
+    for (uint32_t i = 0; i < this->bitmap_blocks; i++)
+    {
+        this->disk->queue_read(this->bitmap_start + i, blocks[i].Data);
+    }
+    this->disk->submit();
+    this->bitmap.load((const uint64_t *)blocks.data(), this->blocks);
+    // Metadata blocks must be marked in use
+    for (uint32_t i = 0; i < this->metadata_end(); i++)
+    {
+        if (!this->bitmap.test(i))
+        {
+            return false;
+        }
+    }
+    std::vector<size_t> dirty;
+    this->bitmap.take_dirty(dirty);
+    return true;
 }
 
-// Read from inode -------------------------------------------------------------
+// write changed free bitmap blocks back to disk
 
-ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset)
+void FileSystem::save_bitmap()
 {
-    // Load inode information
-    Inode node;
-    memset(&node, 0, sizeof(Inode));
-    int max_size = this->load_node(inumber, &node);
+    if (!(this->features & FEATURE_BITMAP))
+    {
+        return;
+    }
+    // Held through the writes, so a newer copy of a region never goes out
+    // before an older one
+    std::lock_guard<std::mutex> guard(this->alloc_lock);
+    std::vector<size_t> dirty;
+    this->bitmap.take_dirty(dirty);
+    for (size_t i = 0; i < dirty.size(); i++)
+    {
+        write_bitmap_block(this->disk, this->bitmap, this->bitmap_start, dirty[i]);
+    }
+}
 
-    // Adjust length
-    int direct_size = POINTERS_PER_INODE * 4096;
-    if (max_size < offset)
+// write superblock with the given clean-unmount flag
+
+void FileSystem::write_super(bool clean)
+{
+    Block block;
+    memset(block.Data, 0, Disk::BLOCK_SIZE);
+    block.Super.MagicNumber = MAGIC_NUMBER;
+    block.Super.Blocks = this->blocks;
+    block.Super.InodeBlocks = this->inode_blocks;
+    block.Super.Inodes = this->inodes;
+    block.Super.Revision = FORMAT_REVISION;
+    block.Super.Features = this->features;
+    block.Super.BitmapStart = this->bitmap_start;
+    block.Super.BitmapBlocks = this->bitmap_blocks;
+    block.Super.Clean = clean;
+    if (this->features & FEATURE_DEDUP)
     {
-        return -1;
+        block.Super.RefStart = this->bitmap_start + this->bitmap_blocks;
+        block.Super.RefBlocks = this->ref_blocks;
+    }
+    this->disk->write(0, block.Data);
+}
+
+// Unmount file system ---------------------------------------------------------
+
+void FileSystem::unmount()
+{
+    std::lock_guard<RWLock> guard(this->mount_lock);
+    if (this->disk == NULL)
+    {
+        return;
     }
-    else if (max_size < offset + length)
+    // Open handles are written back and left detached until closed
+    for (std::unordered_map<size_t, File *>::iterator it = this->files.begin(); it != this->files.end(); it++)
     {
-        length = max_size - offset;
+        this->flush_file(it->second);
+        it->second->FS = NULL;
     }
-    // Read block and copy to data
-    int off_block = offset / 4096;
-    int off_byte = offset % 4096;
-    int data_offset = 0;
-    //如果从直接块开始，就读取直接块的数据
-    while (off_block < POINTERS_PER_INODE && (int)length > 0)
+    this->files.clear();
+    this->scrub(this->scrub_queue.size());
+    this->flush_inodes();
+    this->inode_cache.clear();
+    this->inode_slots.clear();
+    this->streams.clear();
+    for (uint32_t i = 0; i < READAHEAD_STAGES; i++)
     {
-        int copy_length = (length > 4096 - off_byte) ? 4096 - off_byte : length;
-        Block data_block;
-        this->disk->read(node.Direct[off_block], data_block.Data);
-        memcpy(data + data_offset, &data_block + off_byte, copy_length);
-        off_block++;
-        length = length - copy_length;
-        data_offset = data_offset + copy_length;
-        off_byte = 0;
+        this->stages[i].Count = 0;
     }
-    int indirect_off_block = off_block - 5;
-    //如果从间接块开始，或者还有数据需要读
-    //将代码这样分开可以减少读磁盘的次数，只需要读一次间接索引块
-    if ((int)length > 0)
+    // Save free bitmap and reference table and mark the image clean
+    if (this->features & FEATURE_BITMAP)
     {
-        Block indirect_block;
-        if (node.Indirect == 0)
-        {
-            return -1;
-        }
-        this->disk->read(node.Indirect, indirect_block.Data);
-        while (indirect_off_block < POINTERS_PER_BLOCK && (int)length > 0)
+        this->save_bitmap();
+        this->save_references();
+        this->write_super(true);
+    }
+    // Release device; the last unmount flushes the block cache
+    this->disk->unmount();
+    this->disk = NULL;
+}
+
+// Flush cached blocks ---------------------------------------------------------
+
+void FileSystem::sync()
+{
+    std::lock_guard<RWLock> guard(this->mount_lock);
+    if (this->disk != NULL)
+    {
+        for (std::unordered_map<size_t, File *>::iterator it = this->files.begin(); it != this->files.end(); it++)
         {
-            int copy_length = (length > 4096 - off_byte) ? 4096 - off_byte : length;
-            Block data_block;
-            this->disk->read(indirect_block.Pointers[indirect_off_block], data_block.Data);
-            memcpy(data + data_offset, &data_block + off_byte, copy_length);
-            indirect_off_block++;
-            length = length - copy_length;
-            data_offset = data_offset + copy_length;
-            off_byte = 0;
+            this->flush_file(it->second);
         }
+        this->scrub(this->scrub_queue.size());
+        this->flush_inodes();
+        this->save_references();
+        this->disk->sync();
     }
-    return data_offset;
 }
 
-// Write to inode --------------------------------------------------------------
-ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset)
+// Create inode ----------------------------------------------------------------
+
+ssize_t FileSystem::create()
 {
-    // Load inode
-    Inode node;
-    memset(&node, 0, sizeof(Inode));
-    if (this->load_node(inumber, &node) < 0)
+    Stats::Timer timer(this->op_stats, Stats::OP_CREATE);
+    // Take the lowest free inode; inode blocks not yet read count as full,
+    // so read them in order until the free inode is known to be lowest
+    SharedGuard mounted(this->mount_lock);
+    if (this->disk == NULL)
     {
         return -1;
     }
-    int off_block = offset / 4096;
-    int off_byte = offset % 4096;
-    int data_offset = 0;
-    //如果从直接块开始写
-    while (off_block < POINTERS_PER_INODE && length > 0)
+    if (this->free_policy == FREE_SCRUB)
+    {
+        this->scrub(SCRUB_BATCH_BLOCKS);
+    }
+    ssize_t inumber;
+    Block *block;
+    std::unique_lock<std::mutex> table(this->inode_lock);
+    while (true)
     {
-        Block start_block;
-        //如果没有数据块就分配数据块
-        if (node.Direct[off_block] == 0)
+        while (this->inode_known < this->inode_blocks && this->inode_slots[this->inode_known] != 0)
         {
-            int new_free = this->get_free_block();
-            //没有空闲块的话将更改的块写回，然后返回
-            if (new_free <= 0)
-            {
-                node.Size += data_offset;
-                this->save_node(inumber, &node);
-                return data_offset;
-            }
-            node.Direct[off_block] = new_free;
-            this->bitmap[new_free] = 1;
-            Block temp;
-            memset(&temp, 0, 4096);
-            this->disk->write(new_free, (char *)&temp);
+            this->inode_known++;
+        }
+        inumber = this->inode_map.find_free();
+        if (inumber >= 0 && (size_t)inumber < (size_t)this->inode_known * INODES_PER_BLOCK)
+        {
+            break;
         }
-        //从一个已有数据的数据块开始写的情况
-        if (off_byte > 0)
+        if (this->inode_known == this->inode_blocks)
         {
-            this->disk->read(node.Direct[off_block], start_block.Data);
+            return -1;
         }
-        int copy_length = (length > 4096 - off_byte) ? 4096 - off_byte : length;
-        memcpy(&start_block + off_byte, data + data_offset, copy_length);
-        this->disk->write(node.Direct[off_block], (char *)&start_block);
-        length = length - copy_length;
-        off_byte = 0;
-        data_offset = data_offset + copy_length;
-        off_block++;
+        this->load_inode_block(this->inode_known);
     }
-    int indirect_off_block = off_block - 5;
-    //如果直接块不够，分配间接块，并写入数据
-    if (length > 0)
+    // Claim inode in the map, then record it; its block is marked dirty
+    // only once it holds the new inode
+    block = this->load_inode_block(inumber / INODES_PER_BLOCK);
+    this->inode_map.set(inumber);
+    table.unlock();
     {
-        if (node.Indirect == 0)
-        {
-            //分配间接块
-            int new_free = this->get_free_block();
-            if (new_free <= 0)
+        std::lock_guard<std::mutex> guard(this->inode_block_lock(inumber / INODES_PER_BLOCK));
+        Inode *node = &block->Inodes[inumber % INODES_PER_BLOCK];
+        memset(node, 0, sizeof(Inode));
+        node->Valid = (this->features & FEATURE_INLINE) ? 1 | INODE_INLINE : 1;
+    }
+    this->mark_dirty(inumber / INODES_PER_BLOCK);
+    this->flush_inodes();
+    return inumber;
+}
+
+// read an inode block into the inode table unless it is already resident;
+// caller holds inode_lock
+
+FileSystem::Block *FileSystem::load_inode_block(uint32_t index)
+{
+    if (this->inode_slots[index] == 0)
+    {
+        this->inode_cache.push_back(Block());
+        Block &block = this->inode_cache.back();
+        this->disk->read(index + 1, block.Data);
+        this->inode_slots[index] = this->inode_cache.size();
+        for (uint32_t j = 0; j < INODES_PER_BLOCK; j++)
+        {
+            if (block.Inodes[j].Valid == 0)
+            {
+                this->inode_map.clear(index * INODES_PER_BLOCK + j);
+            }
+            else
+            {
+                this->inode_map.set(index * INODES_PER_BLOCK + j);
+            }
+        }
+    }
+    return &this->inode_cache[this->inode_slots[index] - 1];
+}
+
+// mark a resident inode block dirty
+
+void FileSystem::mark_dirty(uint32_t index)
+{
+    std::lock_guard<std::mutex> guard(this->inode_lock);
+    if (std::find(this->inode_dirty.begin(), this->inode_dirty.end(), index) == this->inode_dirty.end())
+    {
+        this->inode_dirty.push_back(index);
+    }
+}
+
+// write dirty inode blocks back in one batch with any writes already queued;
+// their locks are held until the writes complete, so a block dirtied again
+// meanwhile goes out after this copy, never before
+
+void FileSystem::flush_inodes()
+{
+    std::vector<uint32_t> dirty;
+    std::vector<Block *> blocks;
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        dirty.swap(this->inode_dirty);
+        std::sort(dirty.begin(), dirty.end());
+        for (size_t i = 0; i < dirty.size(); i++)
+        {
+            blocks.push_back(&this->inode_cache[this->inode_slots[dirty[i]] - 1]);
+        }
+    }
+    std::vector<uint32_t> stripes;
+    for (size_t i = 0; i < dirty.size(); i++)
+    {
+        stripes.push_back(dirty[i] % INODE_LOCK_STRIPES);
+    }
+    std::sort(stripes.begin(), stripes.end());
+    stripes.erase(std::unique(stripes.begin(), stripes.end()), stripes.end());
+    for (size_t i = 0; i < stripes.size(); i++)
+    {
+        this->inode_block_locks[stripes[i]].lock();
+    }
+    for (size_t i = 0; i < dirty.size(); i++)
+    {
+        this->disk->queue_write(dirty[i] + 1, blocks[i]->Data);
+    }
+    this->disk->submit();
+    for (size_t i = 0; i < stripes.size(); i++)
+    {
+        this->inode_block_locks[stripes[i]].unlock();
+    }
+}
+
+//load node by inumber
+
+ssize_t FileSystem::load_node(size_t inumber, Inode *node)
+{
+    if (this->disk == NULL || inumber >= this->inodes)
+    {
+        return -1;
+    }
+    Block *block;
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        block = this->load_inode_block(inumber / INODES_PER_BLOCK);
+    }
+    std::lock_guard<std::mutex> guard(this->inode_block_lock(inumber / INODES_PER_BLOCK));
+    Inode &inode = block->Inodes[inumber % INODES_PER_BLOCK];
+    if (inode.Valid == 0)
+    {
+        return -1;
+    }
+    memcpy(node, &inode, sizeof(Inode));
+    return node_size(&inode, this->features);
+}
+
+// save the inumber
+bool FileSystem::save_node(size_t inumber, Inode *node)
+{
+    if (this->disk == NULL || inumber >= this->inodes)
+    {
+        return false;
+    }
+    uint32_t index = inumber / INODES_PER_BLOCK;
+    Block *block;
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        block = this->load_inode_block(index);
+    }
+    {
+        std::lock_guard<std::mutex> guard(this->inode_block_lock(index));
+        if (block->Inodes[inumber % INODES_PER_BLOCK].Valid == 0)
+        {
+            return false;
+        }
+        memcpy(&block->Inodes[inumber % INODES_PER_BLOCK], node, sizeof(Inode));
+    }
+    this->mark_dirty(index);
+    if (node->Valid == 0)
+    {
+        std::lock_guard<std::mutex> guard(this->inode_lock);
+        this->inode_map.clear(inumber);
+    }
+    return true;
+}
+// Remove inode ----------------------------------------------------------------
+
+bool FileSystem::remove(size_t inumber)
+{
+    Stats::Timer timer(this->op_stats, Stats::OP_REMOVE);
+    // Load inode information; open inodes stay until closed
+    SharedGuard mounted(this->mount_lock);
+    std::lock_guard<RWLock> guard(this->node_lock(inumber));
+    Inode node;
+    memset(&node, 0, sizeof(Inode));
+    if (this->find_file(inumber) || this->load_node(inumber, &node) < 0)
+    {
+        return false;
+    }
+    // Zero blocks freed by earlier removes before freeing more
+    if (this->free_policy == FREE_SCRUB)
+    {
+        this->scrub(SCRUB_BATCH_BLOCKS);
+    }
+    this->stage_drop(inumber);
+    {
+        std::lock_guard<std::mutex> streams_guard(this->stream_lock);
+        this->streams.erase(inumber);
+    }
+    // Inline bytes are not pointers; with them gone there is nothing to free
+    if (is_inline(&node, this->features))
+    {
+        memset(inline_data(&node), 0, INLINE_BYTES);
+    }
+    node.Valid = 0;
+    node.Size = 0;
+    // Collect every freed block, then release them together
+    std::vector<int> freed;
+    if (this->features & FEATURE_EXTENTS)
+    {
+        std::vector<Extent> extents;
+        this->load_extents(&node, extents);
+        for (size_t e = 0; e < extents.size(); e++)
+        {
+            for (uint32_t i = 0; extents[e].Start != 0 && i < extents[e].Length; i++)
+            {
+                freed.push_back(extents[e].Start + i);
+            }
+        }
+        memset(node.Direct, 0, sizeof(node.Direct));
+    }
+    if (this->features & FEATURE_LARGE)
+    {
+        for (uint32_t tree = 0; tree < LARGE_TREES; tree++)
+        {
+            uint32_t *root = tree_root(&node, tree);
+            if (*root != 0)
+            {
+                this->free_tree(*root, tree, freed);
+                *root = 0;
+            }
+        }
+    }
+    uint32_t mask = data_mask(this->features);
+    for (uint32_t i = 0; i < POINTERS_PER_INODE; i++)
+    {
+        if (node.Direct[i] != 0)
+        {
+            freed.push_back(node.Direct[i] & mask);
+            node.Direct[i] = 0;
+        }
+    }
+    // Free indirect blocks
+    if (node.Indirect != 0 && (this->features & FEATURE_EXTENTS))
+    {
+        freed.push_back(node.Indirect);
+        node.Indirect = 0;
+    }
+    if (node.Indirect != 0)
+    {
+        Block indirect_block;
+        this->mark_indirect(node.Indirect);
+        this->disk->read(node.Indirect, indirect_block.Data);
+        for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+        {
+            if (indirect_block.Pointers[i] != 0)
+            {
+                freed.push_back(indirect_block.Pointers[i] & mask);
+            }
+        }
+        freed.push_back(node.Indirect);
+        node.Indirect = 0;
+    }
+    this->release_blocks(freed);
+    // Clear inode in inode table
+    bool result = save_node(inumber, &node);
+    this->flush_inodes();
+    this->save_bitmap();
+    return result;
+}
+
+// Inode stat ------------------------------------------------------------------
+
+ssize_t FileSystem::stat(size_t inumber)
+{
+    Stats::Timer timer(this->op_stats, Stats::OP_STAT);
+    // An open handle may hold a newer size than the inode table
+    SharedGuard mounted(this->mount_lock);
+    SharedGuard guard(this->node_lock(inumber));
+    File *file = this->find_file(inumber);
+    if (file != NULL)
+    {
+        return node_size(&file->Node, this->features);
+    }
+    // Load inode information
+    Inode node;
+    memset(&node, 0, sizeof(Inode));
+    return this->load_node(inumber, &node);
+}
+
+// Map file blocks to disk blocks ---------------------------------------------
+
+void FileSystem::map_blocks(File *file, size_t first, size_t count, std::vector<int> &blocks)
+{
+    Inode *node = &file->Node;
+    if (this->features & FEATURE_EXTENTS)
+    {
+        map_extents(this->file_extents(file), first, count, blocks);
+        return;
+    }
+    if (this->features & FEATURE_LARGE)
+    {
+        // Each pointer block on the way is read once while it stays cached
+        for (size_t i = first; i < first + count; i++)
+        {
+            blocks.push_back(std::max(this->tree_block(node, file->Tree, i, false, NULL), 0));
+        }
+        return;
+    }
+    // Read the indirect block at most once while the file is open
+    for (size_t i = first; i < first + count; i++)
+    {
+        if (i < POINTERS_PER_INODE)
+        {
+            blocks.push_back(node->Direct[i]);
+        }
+        else if (i - POINTERS_PER_INODE < POINTERS_PER_BLOCK && node->Indirect != 0)
+        {
+            if (!file->IndirectLoaded)
+            {
+                this->mark_indirect(node->Indirect);
+                this->disk->read(node->Indirect, file->Indirect.Data);
+                file->IndirectLoaded = true;
+            }
+            blocks.push_back(file->Indirect.Pointers[i - POINTERS_PER_INODE]);
+        }
+        else
+        {
+            blocks.push_back(0);
+        }
+    }
+}
+
+// map file blocks through an extent list; holes and blocks past the end map to 0
+
+void FileSystem::map_extents(const std::vector<Extent> &extents, size_t first, size_t count, std::vector<int> &blocks)
+{
+    size_t position = 0;
+    size_t i = first;
+    for (size_t e = 0; e < extents.size() && i < first + count; e++)
+    {
+        size_t end = position + extents[e].Length;
+        for (; i < end && i < first + count; i++)
+        {
+            blocks.push_back(extents[e].Start == 0 ? 0 : extents[e].Start + (i - position));
+        }
+        position = end;
+    }
+    for (; i < first + count; i++)
+    {
+        blocks.push_back(0);
+    }
+}
+
+// read the extent list of an inode, including its extent block
+
+void FileSystem::load_extents(Inode *node, std::vector<Extent> &extents)
+{
+    uint32_t count = node->Direct[POINTERS_PER_INODE - 1];
+    for (uint32_t i = 0; i < count && i < EXTENTS_PER_INODE; i++)
+    {
+        Extent extent = {node->Direct[2 * i], node->Direct[2 * i + 1]};
+        extents.push_back(extent);
+    }
+    if (count > EXTENTS_PER_INODE && node->Indirect != 0)
+    {
+        Block block;
+        this->mark_indirect(node->Indirect);
+        this->disk->read(node->Indirect, block.Data);
+        count = std::min(count - EXTENTS_PER_INODE, (uint32_t)EXTENTS_PER_BLOCK);
+        extents.insert(extents.end(), block.Extents, block.Extents + count);
+    }
+}
+
+// store an extent list in the inode, spilling into an extent block
+
+bool FileSystem::save_extents(Inode *node, const std::vector<Extent> &extents)
+{
+    if (extents.size() > EXTENTS_PER_INODE + EXTENTS_PER_BLOCK)
+    {
+        return false;
+    }
+    if (extents.size() > EXTENTS_PER_INODE)
+    {
+        if (node->Indirect == 0)
+        {
+            int block_num = this->allocate_block();
+            if (block_num <= 0)
+            {
+                return false;
+            }
+            node->Indirect = block_num;
+            this->mark_indirect(block_num);
+        }
+        Block block;
+        memset(block.Data, 0, Disk::BLOCK_SIZE);
+        std::copy(extents.begin() + EXTENTS_PER_INODE, extents.end(), block.Extents);
+        this->disk->write(node->Indirect, block.Data);
+    }
+    for (uint32_t i = 0; i < EXTENTS_PER_INODE; i++)
+    {
+        node->Direct[2 * i] = i < extents.size() ? extents[i].Start : 0;
+        node->Direct[2 * i + 1] = i < extents.size() ? extents[i].Length : 0;
+    }
+    node->Direct[POINTERS_PER_INODE - 1] = extents.size();
+    return true;
+}
+
+// add an extent to a list, merging it with the last one where they line up
+
+void FileSystem::append_extent(std::vector<Extent> &extents, Extent extent)
+{
+    if (extent.Length == 0)
+    {
+        return;
+    }
+    if (!extents.empty())
+    {
+        Extent &back = extents.back();
+        if ((back.Start == 0 && extent.Start == 0) ||
+            (back.Start != 0 && back.Start + back.Length == extent.Start))
+        {
+            back.Length += extent.Length;
+            return;
+        }
+    }
+    extents.push_back(extent);
+}
+
+// replace the hole (or space past the end) at logical with a run of disk
+// blocks
+
+void FileSystem::splice_extent(std::vector<Extent> &extents, uint32_t logical, uint32_t start, uint32_t count)
+{
+    std::vector<Extent> result;
+    Extent run = {start, count};
+    bool placed = false;
+    uint32_t position = 0;
+    for (size_t e = 0; e < extents.size(); e++)
+    {
+        uint32_t end = position + extents[e].Length;
+        uint32_t cut_begin = std::max(position, logical);
+        uint32_t cut_end = std::min(end, logical + count);
+        if (cut_begin >= cut_end)
+        {
+            if (!placed && position >= logical + count)
+            {
+                append_extent(result, run);
+                placed = true;
+            }
+            append_extent(result, extents[e]);
+        }
+        else
+        {
+            Extent before = {extents[e].Start, cut_begin - position};
+            Extent after = {extents[e].Start == 0 ? 0 : extents[e].Start + (cut_end - position), end - cut_end};
+            append_extent(result, before);
+            if (!placed)
+            {
+                append_extent(result, run);
+                placed = true;
+            }
+            append_extent(result, after);
+        }
+        position = end;
+    }
+    if (!placed)
+    {
+        Extent hole = {0, logical > position ? logical - position : 0};
+        append_extent(result, hole);
+        append_extent(result, run);
+    }
+    extents.swap(result);
+}
+
+// allocate up to want contiguous blocks: continue the run ending before
+// goal if possible, else take the first run of want free blocks, searching
+// the groups from the calling thread's own, else the first free blocks.
+// A run another thread claims first is searched for again
+
+int FileSystem::allocate_run(uint32_t goal, uint32_t want, uint32_t *got)
+{
+    if (goal > 0 && goal < this->bitmap.size())
+    {
+        size_t length = this->bitmap.claim_range(goal, want);
+        if (length > 0)
+        {
+            *got = length;
+            return goal;
+        }
+    }
+    size_t groups = this->bitmap.regions();
+    size_t home = allocation_group(groups);
+    while (this->bitmap.free() > 0)
+    {
+        ssize_t first = -1;
+        ssize_t start = -1;
+        for (size_t i = 0; i < groups && start < 0; i++)
+        {
+            size_t group = (home + i) % groups;
+            size_t end = std::min((group + 1) * Bitmap::REGION_BITS, this->bitmap.size());
+            size_t length = 0;
+            for (ssize_t candidate = this->bitmap.next_free(group * Bitmap::REGION_BITS);
+                 candidate >= 0 && (size_t)candidate < end;
+                 candidate = this->bitmap.next_free(candidate + length + 1))
+            {
+                if (first < 0)
+                {
+                    first = candidate;
+                }
+                length = this->bitmap.run_length(candidate, want);
+                if (length == want)
+                {
+                    start = candidate;
+                    break;
+                }
+            }
+        }
+        if (start < 0)
+        {
+            start = first;
+        }
+        if (start <= 0)
+        {
+            return -1;
+        }
+        size_t length = this->bitmap.claim_range(start, want);
+        if (length > 0)
+        {
+            *got = length;
+            return start;
+        }
+    }
+    return -1;
+}
+
+// map file blocks [first, last] of an extent inode, allocating runs for
+// holes; stops early when the disk is full
+
+bool FileSystem::allocate_extents(File *file, size_t first, size_t last, std::vector<int> &blocks, std::vector<int> &fresh)
+{
+    std::vector<Extent> extents = this->file_extents(file);
+    std::vector<int> mapped;
+    map_extents(extents, first, last - first + 1, mapped);
+    // Disk block just after the file block before first, to grow in place
+    std::vector<int> before;
+    if (first > 0)
+    {
+        map_extents(extents, first - 1, 1, before);
+    }
+    uint32_t goal = (first > 0 && before[0] != 0) ? before[0] + 1 : 0;
+    size_t i = first;
+    while (i <= last)
+    {
+        if (mapped[i - first] != 0)
+        {
+            blocks.push_back(mapped[i - first]);
+            goal = mapped[i - first] + 1;
+            i++;
+            continue;
+        }
+        size_t j = i;
+        while (j <= last && mapped[j - first] == 0)
+        {
+            j++;
+        }
+        uint32_t got = 0;
+        int start = this->allocate_run(goal, j - i, &got);
+        if (start < 0)
+        {
+            break;
+        }
+        splice_extent(extents, i, start, got);
+        for (uint32_t k = 0; k < got; k++)
+        {
+            blocks.push_back(start + k);
+            fresh.push_back(start + k);
+        }
+        goal = start + got;
+        i += got;
+    }
+    if (!fresh.empty() && !this->save_extents(&file->Node, extents))
+    {
+        // Too many extents: give the blocks back
+        for (size_t k = 0; k < fresh.size(); k++)
+        {
+            this->bitmap.release(fresh[k]);
+        }
+        blocks.clear();
+        fresh.clear();
+        return false;
+    }
+    file->Extents.swap(extents);
+    return true;
+}
+
+// return the inode field holding the root of a pointer tree: the single
+// indirect block, or the double or triple indirect block (FEATURE_LARGE)
+
+uint32_t *FileSystem::tree_root(Inode *node, uint32_t tree)
+{
+    return tree == 0 ? &node->Indirect : &node->Direct[LARGE_DIRECT + tree - 1];
+}
+
+bool FileSystem::is_inline(const Inode *node, uint32_t features)
+{
+    return (features & FEATURE_INLINE) && (node->Valid & INODE_INLINE);
+}
+
+uint64_t FileSystem::node_size(const Inode *node, uint32_t features)
+{
+    if (features & FEATURE_LARGE)
+    {
+        return node->Size | (uint64_t)(node->Valid >> 8) << 32;
+    }
+    return node->Size;
+}
+
+void FileSystem::set_node_size(Inode *node, uint64_t size, uint32_t features)
+{
+    node->Size = (uint32_t)size;
+    if (features & FEATURE_LARGE)
+    {
+        node->Valid = (node->Valid & 0xff) | (uint32_t)(size >> 32) << 8;
+    }
+}
+
+// map file block index of a large inode to its disk block, walking the
+// pointer tree through cache so each pointer block is read once per request;
+// with allocate, missing pointer and data blocks are allocated (data blocks
+// are added to fresh). Returns 0 for a hole, -1 when the disk is full.
+
+int FileSystem::tree_block(Inode *node, TreeCache &cache, size_t index, bool allocate, std::vector<int> *fresh)
+{
+    bool *parent_dirty = NULL;
+    uint32_t *pointer = this->tree_slot(node, cache, index, allocate, &parent_dirty);
+    if (pointer == NULL)
+    {
+        return allocate ? -1 : 0;
+    }
+    if (*pointer == 0 && allocate)
+    {
+        int block_num = this->allocate_block();
+        if (block_num <= 0)
+        {
+            return -1;
+        }
+        *pointer = block_num;
+        if (parent_dirty)
+        {
+            *parent_dirty = true;
+        }
+        fresh->push_back(block_num);
+    }
+    return *pointer;
+}
+
+// return the pointer to file block index of a large inode: a direct pointer
+// in the inode, or an entry of a cached pointer block, whose dirty flag is
+// left in dirty (NULL for the inode). With allocate, missing pointer blocks
+// are allocated on the way. NULL for an index past the trees, a missing
+// pointer block or a full disk; the entry is only valid until the next walk
+
+uint32_t *FileSystem::tree_slot(Inode *node, TreeCache &cache, size_t index, bool allocate, bool **dirty)
+{
+    *dirty = NULL;
+    if (index < LARGE_DIRECT)
+    {
+        return &node->Direct[index];
+    }
+    // Find the tree and the index within it
+    index -= LARGE_DIRECT;
+    uint32_t tree = 0;
+    size_t span = POINTERS_PER_BLOCK;
+    while (tree < LARGE_TREES && index >= span)
+    {
+        index -= span;
+        span *= POINTERS_PER_BLOCK;
+        tree++;
+    }
+    if (tree == LARGE_TREES)
+    {
+        return NULL;
+    }
+    uint32_t *pointer = tree_root(node, tree);
+    for (uint32_t level = 0; level <= tree; level++)
+    {
+        span /= POINTERS_PER_BLOCK;
+        Block &block = cache.Blocks[tree][level];
+        if (*pointer == 0)
+        {
+            if (!allocate)
+            {
+                return NULL;
+            }
+            int block_num = this->allocate_block();
+            if (block_num <= 0)
+            {
+                return NULL;
+            }
+            *pointer = block_num;
+            this->mark_indirect(block_num);
+            if (*dirty)
             {
-                node.Size += data_offset;
-                this->save_node(inumber, &node);
-                return data_offset;
+                **dirty = true;
             }
-            node.Indirect = new_free;
-            this->bitmap[new_free] = 1;
-            this->init_data_block(new_free);
+            // A new pointer block starts out empty; no need to read it
+            if (cache.Dirty[tree][level])
+            {
+                this->disk->write(cache.BlockNum[tree][level], block.Data);
+            }
+            memset(block.Data, 0, Disk::BLOCK_SIZE);
+            cache.BlockNum[tree][level] = block_num;
+            cache.Dirty[tree][level] = true;
         }
-        Block indirect_block;
-        this->disk->read(node.Indirect, indirect_block.Data);
-        while (indirect_off_block < POINTERS_PER_BLOCK && length > 0)
+        else if (cache.BlockNum[tree][level] != *pointer)
+        {
+            if (cache.Dirty[tree][level])
+            {
+                this->disk->write(cache.BlockNum[tree][level], block.Data);
+            }
+            this->mark_indirect(*pointer);
+            this->disk->read(*pointer, block.Data);
+            cache.BlockNum[tree][level] = *pointer;
+            cache.Dirty[tree][level] = false;
+        }
+        pointer = &block.Pointers[(index / span) % POINTERS_PER_BLOCK];
+        *dirty = &cache.Dirty[tree][level];
+    }
+    return pointer;
+}
+
+// queue pointer blocks changed during a request; they go out with the
+// next submit
+
+void FileSystem::tree_flush(TreeCache &cache)
+{
+    for (uint32_t tree = 0; tree < LARGE_TREES; tree++)
+    {
+        for (uint32_t level = 0; level <= tree; level++)
+        {
+            if (cache.Dirty[tree][level])
+            {
+                this->disk->queue_write(cache.BlockNum[tree][level], cache.Blocks[tree][level].Data);
+                cache.Dirty[tree][level] = false;
+            }
+        }
+    }
+}
+
+// collect every block of a pointer tree, reading each pointer block once;
+// level is the number of pointer blocks below this one
+
+void FileSystem::free_tree(uint32_t block_num, uint32_t level, std::vector<int> &freed)
+{
+    Block block;
+    this->mark_indirect(block_num);
+    this->disk->read(block_num, block.Data);
+    for (uint32_t i = 0; i < POINTERS_PER_BLOCK; i++)
+    {
+        if (block.Pointers[i] == 0)
+        {
+            continue;
+        }
+        if (level > 0)
+        {
+            this->free_tree(block.Pointers[i], level - 1, freed);
+        }
+        else
+        {
+            freed.push_back(block.Pointers[i] & data_mask(this->features));
+        }
+    }
+    freed.push_back(block_num);
+}
+
+// deal with the contents of freed blocks per free_policy and mark them
+// free; contents are dealt with first so that no other thread can have
+// allocated a block and written it before it is zeroed
+
+void FileSystem::release_blocks(std::vector<int> &freed)
+{
+    // Shared blocks only lose a reference (FEATURE_DEDUP)
+    if (this->features & FEATURE_DEDUP)
+    {
+        this->drop_references(freed);
+    }
+    if (this->free_policy == FREE_ZERO)
+    {
+        // Zero every freed block in one batch of writes
+        Block zero;
+        memset(zero.Data, 0, Disk::BLOCK_SIZE);
+        for (size_t i = 0; i < freed.size(); i++)
+        {
+            this->disk->queue_write(freed[i], zero.Data);
+        }
+        this->disk->submit();
+    }
+    else if (this->free_policy == FREE_DISCARD)
+    {
+        // One hole per run of consecutive blocks
+        std::sort(freed.begin(), freed.end());
+        for (size_t i = 0; i < freed.size(); )
+        {
+            size_t n = 1;
+            while (i + n < freed.size() && freed[i + n] == freed[i] + (int)n)
+            {
+                n++;
+            }
+            this->disk->discard(freed[i], n);
+            i += n;
+        }
+    }
+    for (size_t i = 0; i < freed.size(); i++)
+    {
+        this->disk->set_kind(freed[i], 1, Disk::KIND_DATA);
+        this->bitmap.release(freed[i]);
+    }
+    if (this->free_policy == FREE_SCRUB)
+    {
+        std::lock_guard<std::mutex> guard(this->alloc_lock);
+        this->scrub_queue.insert(this->scrub_queue.end(), freed.begin(), freed.end());
+    }
+}
+
+// zero up to max queued blocks, oldest first; blocks allocated again since
+// they were freed are skipped, and none can be allocated until the zeros
+// are written. Returns number of blocks zeroed
+
+size_t FileSystem::scrub(size_t max)
+{
+    if (this->disk == NULL)
+    {
+        return 0;
+    }
+    std::vector<int> blocks;
+    {
+        std::lock_guard<std::mutex> guard(this->alloc_lock);
+        size_t taken = std::min(max, this->scrub_queue.size());
+        blocks.assign(this->scrub_queue.begin(), this->scrub_queue.begin() + taken);
+        this->scrub_queue.erase(this->scrub_queue.begin(), this->scrub_queue.begin() + taken);
+    }
+    std::sort(blocks.begin(), blocks.end());
+    blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+    // Claim the blocks still free while their zeros are written
+    size_t claimed = 0;
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        if (this->bitmap.claim_range(blocks[i], 1) == 1)
+        {
+            blocks[claimed++] = blocks[i];
+        }
+    }
+    blocks.resize(claimed);
+    Block zero;
+    memset(zero.Data, 0, Disk::BLOCK_SIZE);
+    std::vector<char *> buffers(blocks.size(), zero.Data);
+    this->disk->writev(blocks.data(), blocks.size(), buffers.data());
+    for (size_t i = 0; i < blocks.size(); i++)
+    {
+        this->bitmap.release(blocks[i]);
+    }
+    return blocks.size();
+}
+
+size_t FileSystem::scrub_pending() const
+{
+    std::lock_guard<std::mutex> guard(this->alloc_lock);
+    return this->scrub_queue.size();
+}
+
+void FileSystem::set_free_policy(FreePolicy policy)
+{
+    std::lock_guard<RWLock> guard(this->mount_lock);
+    // Blocks queued under the old policy still get zeroed
+    if (policy != FREE_SCRUB)
+    {
+        this->scrub(this->scrub_queue.size());
+    }
+    this->free_policy = policy;
+}
+
+// allocation group of the calling thread: threads take groups in the order
+// they first allocate, so a lone writer starts from group 0
+
+size_t FileSystem::allocation_group(size_t groups)
+{
+    static std::atomic<unsigned> next(0);
+    static thread_local unsigned ordinal = next++;
+    return groups > 0 ? ordinal % groups : 0;
+}
+
+// allocate a free block and mark it used: the first free block of the
+// calling thread's group, else of the groups after it
+
+int FileSystem::allocate_block()
+{
+    size_t groups = this->bitmap.regions();
+    size_t home = allocation_group(groups);
+    for (size_t i = 0; i < groups; i++)
+    {
+        ssize_t block_num = this->bitmap.claim((home + i) % groups);
+        if (block_num >= 0)
+        {
+            return block_num;
+        }
+    }
+    return -1;
+}
+
+// Read from inode -------------------------------------------------------------
+
+ssize_t FileSystem::read(size_t inumber, char *data, size_t length, size_t offset)
+{
+    Stats::Timer timer(this->op_stats, Stats::OP_READ);
+    // An open handle holds the newest inode; otherwise decode it for this call
+    SharedGuard mounted(this->mount_lock);
+    SharedGuard guard(this->node_lock(inumber));
+    File *handle = this->find_file(inumber);
+    if (handle != NULL)
+    {
+        std::lock_guard<std::mutex> handle_guard(handle->Lock);
+        return this->read_file(handle, data, length, offset);
+    }
+    File file(this, inumber, true);
+    if (!this->open_node(&file))
+    {
+        return -1;
+    }
+    return this->read_file(&file, data, length, offset);
+}
+
+ssize_t FileSystem::read_file(File *file, char *data, size_t length, size_t offset)
+{
+    size_t inumber = file->Inumber;
+    ssize_t max_size = node_size(&file->Node, this->features);
+
+    // Adjust length
+    if ((size_t)max_size < offset)
+    {
+        return -1;
+    }
+    length = std::min(length, (size_t)max_size - offset);
+    if (length == 0)
+    {
+        return 0;
+    }
+    if (is_inline(&file->Node, this->features))
+    {
+        memcpy(data, inline_data(&file->Node) + offset, length);
+        this->op_stats.add_read(length);
+        return length;
+    }
+    // Compressed clusters are read whole and never staged
+    if (this->features & FEATURE_COMPRESS)
+    {
+        ssize_t result = this->compressed_read(file, data, length, offset);
+        this->op_stats.add_read(std::max(result, (ssize_t)0));
+        return result;
+    }
+    // Streams, and ranges already read ahead, go through the stage
+    size_t first = offset / Disk::BLOCK_SIZE;
+    size_t last = (offset + length - 1) / Disk::BLOCK_SIZE;
+    uint32_t window = this->stream_window(inumber, offset, length);
+    {
+        std::lock_guard<std::mutex> guard(this->stage_of(inumber).Lock);
+        if (window > 0 || this->staged(inumber, first, last))
+        {
+            ssize_t result = this->stage_read(file, max_size, window, data, length, offset);
+            this->op_stats.add_read(std::max(result, (ssize_t)0));
+            return result;
+        }
+    }
+    // Map the whole request, reading the indirect block only once
+    std::vector<int> blocks;
+    this->map_blocks(file, first, last - first + 1, blocks);
+
+    // Full blocks are read straight into data, partial head and tail blocks
+    // into bounce blocks; consecutive blocks go to disk as one vectored read
+    Block head, tail;
+    std::vector<int> nums;
+    std::vector<char *> buffers;
+    for (size_t i = first; i <= last; i++)
+    {
+        size_t start = std::max(offset, i * Disk::BLOCK_SIZE);
+        size_t end = std::min(offset + length, (i + 1) * Disk::BLOCK_SIZE);
+        char *buffer = data + (start - offset);
+        if (end - start < Disk::BLOCK_SIZE)
+        {
+            buffer = (i == first) ? head.Data : tail.Data;
+        }
+        if (blocks[i - first] == 0)
+        {
+            memset(buffer, 0, Disk::BLOCK_SIZE);
+            continue;
+        }
+        nums.push_back(blocks[i - first]);
+        buffers.push_back(buffer);
+    }
+    if (!nums.empty())
+    {
+        this->disk->readv(nums.data(), nums.size(), buffers.data());
+    }
+    // Copy partial blocks to data
+    size_t head_byte = offset % Disk::BLOCK_SIZE;
+    if (head_byte > 0 || length < Disk::BLOCK_SIZE)
+    {
+        size_t copy_length = std::min(length, Disk::BLOCK_SIZE - head_byte);
+        memcpy(data, head.Data + head_byte, copy_length);
+    }
+    size_t tail_length = (offset + length) % Disk::BLOCK_SIZE;
+    if (last > first && tail_length > 0)
+    {
+        memcpy(data + length - tail_length, tail.Data, tail_length);
+    }
+    this->op_stats.add_read(length);
+    return length;
+}
+
+// Write to inode --------------------------------------------------------------
+ssize_t FileSystem::write(size_t inumber, char *data, size_t length, size_t offset)
+{
+    Stats::Timer timer(this->op_stats, Stats::OP_WRITE);
+    // A call without a handle writes its inode back before returning
+    SharedGuard mounted(this->mount_lock);
+    std::lock_guard<RWLock> guard(this->node_lock(inumber));
+    File *handle = this->find_file(inumber);
+    if (handle != NULL)
+    {
+        return this->write_file(handle, data, length, offset);
+    }
+    File file(this, inumber, true);
+    if (!this->open_node(&file))
+    {
+        return -1;
+    }
+    return this->write_file(&file, data, length, offset);
+}
+
+ssize_t FileSystem::write_file(File *file, char *data, size_t length, size_t offset)
+{
+    size_t inumber = file->Inumber;
+    Inode &node = file->Node;
+    size_t max_blocks = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+    if (this->features & FEATURE_EXTENTS)
+    {
+        // Size is 32 bits wide
+        max_blocks = UINT32_MAX / Disk::BLOCK_SIZE;
+    }
+    else if (this->features & FEATURE_LARGE)
+    {
+        max_blocks = LARGE_DIRECT + POINTERS_PER_BLOCK + (size_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK +
+                     (size_t)POINTERS_PER_BLOCK * POINTERS_PER_BLOCK * POINTERS_PER_BLOCK;
+    }
+    size_t first = offset / Disk::BLOCK_SIZE;
+    if (length == 0 || first >= max_blocks)
+    {
+        return 0;
+    }
+    size_t last = std::min((offset + length - 1) / Disk::BLOCK_SIZE, max_blocks - 1);
+    this->stage_drop(inumber);
+    if (this->free_policy == FREE_SCRUB)
+    {
+        this->scrub(SCRUB_BATCH_BLOCKS);
+    }
+
+    // Inline data is written into the inode, which goes out like any
+    // other inode change; a write reaching past it moves it to a block
+    if (is_inline(&node, this->features))
+    {
+        if (offset + length <= INLINE_BYTES)
+        {
+            memcpy(inline_data(&node) + offset, data, length);
+            set_node_size(&node, std::max((size_t)node_size(&node, this->features), offset + length), this->features);
+            file->NodeDirty = true;
+            if (file->Transient)
+            {
+                this->flush_file(file);
+            }
+            this->op_stats.add_written(length);
+            return length;
+        }
+        if (!this->unpack_inline(file))
+        {
+            return 0;
+        }
+    }
+
+    // Compressed data is rewritten a cluster at a time (compress.cpp), and
+    // deduplicated data a block at a time (dedup.cpp)
+    if (this->features & (FEATURE_COMPRESS | FEATURE_DEDUP))
+    {
+        ssize_t result = (this->features & FEATURE_COMPRESS) ? this->compressed_write(file, data, length, offset, max_blocks)
+                                                             : this->shared_write(file, data, length, offset, max_blocks);
+        if (file->Transient)
+        {
+            this->flush_file(file);
+        }
+        else
+        {
+            this->disk->submit();
+        }
+        this->op_stats.add_written(result);
+        return result;
+    }
+
+    // Plan: map every block of the request, allocating missing ones in file
+    // order; nothing but pointer blocks is read or written yet
+    std::vector<int> blocks;
+    std::vector<int> fresh;
+    file->NodeDirty = true;
+    if (this->features & FEATURE_EXTENTS)
+    {
+        this->allocate_extents(file, first, last, blocks, fresh);
+    }
+    else if (this->features & FEATURE_LARGE)
+    {
+        for (size_t i = first; i <= last; i++)
+        {
+            int block_num = this->tree_block(&node, file->Tree, i, true, &fresh);
+            if (block_num <= 0)
+            {
+                break;
+            }
+            blocks.push_back(block_num);
+        }
+    }
+    else
+    {
+        bool full = false;
+        for (size_t i = first; i <= last && i < POINTERS_PER_INODE; i++)
         {
-            Block start_block;
-            //如果没有数据块就分配数据块
-            if (indirect_block.Pointers[indirect_off_block] == 0)
+            if (node.Direct[i] == 0)
             {
-                int new_free = this->get_free_block();
+                int new_free = this->allocate_block();
                 if (new_free <= 0)
                 {
-                    this->disk->write(node.Indirect, (char *)&indirect_block);
-                    node.Size += data_offset;
-                    this->save_node(inumber, &node);
-                    return data_offset;
+                    full = true;
+                    break;
+                }
+                node.Direct[i] = new_free;
+                fresh.push_back(new_free);
+            }
+            blocks.push_back(node.Direct[i]);
+        }
+        bool indirect = !full && last >= POINTERS_PER_INODE;
+        if (indirect && node.Indirect == 0)
+        {
+            //分配间接块
+            int new_free = this->allocate_block();
+            if (new_free <= 0)
+            {
+                indirect = false;
+            }
+            else
+            {
+                // A new indirect block starts out empty; no need to read it
+                node.Indirect = new_free;
+                this->mark_indirect(new_free);
+                memset(file->Indirect.Data, 0, Disk::BLOCK_SIZE);
+                file->IndirectLoaded = true;
+                file->IndirectDirty = true;
+            }
+        }
+        if (indirect && !file->IndirectLoaded)
+        {
+            this->mark_indirect(node.Indirect);
+            this->disk->read(node.Indirect, file->Indirect.Data);
+            file->IndirectLoaded = true;
+        }
+        if (indirect)
+        {
+            for (size_t i = std::max(first, (size_t)POINTERS_PER_INODE); i <= last; i++)
+            {
+                uint32_t &pointer = file->Indirect.Pointers[i - POINTERS_PER_INODE];
+                if (pointer == 0)
+                {
+                    int new_free = this->allocate_block();
+                    if (new_free <= 0)
+                    {
+                        break;
+                    }
+                    pointer = new_free;
+                    file->IndirectDirty = true;
+                    fresh.push_back(new_free);
                 }
-                indirect_block.Pointers[indirect_off_block] = new_free;
-                this->bitmap[new_free] = 1;
-                this->init_data_block(new_free);
+                blocks.push_back(pointer);
+            }
+        }
+    }
+    //没有空闲块的话只写已经分配到的部分
+    if (blocks.empty())
+    {
+        if (file->Transient)
+        {
+            this->flush_file(file);
+        }
+        return 0;
+    }
+    last = first + blocks.size() - 1;
+    length = std::min(length, (last + 1) * Disk::BLOCK_SIZE - offset);
+
+    // Full blocks are written straight from data; partial head and tail
+    // blocks merge with the existing contents (or zeros, if newly allocated)
+    // in bounce blocks, so every block is written exactly once
+    Block head, tail;
+    for (size_t i = first; i <= last; i++)
+    {
+        size_t start = std::max(offset, i * Disk::BLOCK_SIZE);
+        size_t end = std::min(offset + length, (i + 1) * Disk::BLOCK_SIZE);
+        char *buffer = data + (start - offset);
+        if (end - start < Disk::BLOCK_SIZE)
+        {
+            int block_num = blocks[i - first];
+            buffer = (i == first) ? head.Data : tail.Data;
+            if (std::find(fresh.begin(), fresh.end(), block_num) == fresh.end())
+            {
+                this->disk->read(block_num, buffer);
             }
-            if (off_byte > 0)
+            else
             {
-                this->disk->read(indirect_block.Pointers[indirect_off_block], start_block.Data);
-                off_byte = 0;
+                memset(buffer, 0, Disk::BLOCK_SIZE);
             }
-            int copy_length = ((int)length > 4096 - off_byte) ? 4096 - off_byte : length;
-            memcpy(&start_block + off_byte, data + data_offset, copy_length);
-            this->disk->write(indirect_block.Pointers[indirect_off_block], (char *)&start_block);
-            length = length - copy_length;
-            data_offset = data_offset + copy_length;
-            indirect_off_block++;
+            memcpy(buffer + start % Disk::BLOCK_SIZE, data + (start - offset), end - start);
         }
-        this->disk->write(node.Indirect, (char *)&indirect_block);
+        this->disk->queue_write(blocks[i - first], buffer);
+    }
+    set_node_size(&node, std::max((size_t)node_size(&node, this->features), offset + length), this->features);
+    // Issue: without a handle, data, pointer blocks and the inode go out in
+    // one batch; an open handle writes the data now and the rest on close
+    if (file->Transient)
+    {
+        this->flush_file(file);
     }
-    node.Size += data_offset;
-    this->save_node(inumber, &node);
-    return data_offset;
+    else
+    {
+        this->disk->submit();
+    }
+    this->op_stats.add_written(length);
+    return length;
 }
 
-int FileSystem::get_free_block()
+// move the data of an inline inode to a new data block, which is file
+// block 0 in every layout; false if the disk is full
+
+bool FileSystem::unpack_inline(File *file)
 {
-    for (int i = 0; i < this->blocks; i++)
+    Inode &node = file->Node;
+    Block block;
+    memset(block.Data, 0, Disk::BLOCK_SIZE);
+    memcpy(block.Data, inline_data(&node), INLINE_BYTES);
+    int block_num = 0;
+    if (node_size(&node, this->features) > 0)
     {
-        if (this->bitmap[i] == 0)
+        block_num = this->allocate_block();
+        if (block_num <= 0)
         {
-            return i;
+            return false;
         }
+        this->disk->write(block_num, block.Data);
     }
-    return -1;
+    memset(inline_data(&node), 0, INLINE_BYTES);
+    node.Valid &= ~INODE_INLINE;
+    file->NodeDirty = true;
+    if (block_num == 0)
+    {
+        return true;
+    }
+    if (this->features & FEATURE_EXTENTS)
+    {
+        Extent extent = {(uint32_t)block_num, 1};
+        file->Extents.assign(1, extent);
+        file->ExtentsLoaded = true;
+        this->save_extents(&node, file->Extents);
+    }
+    else
+    {
+        node.Direct[0] = block_num;
+    }
+    return true;
+}
+
+int FileSystem::get_free_block()
+{
+    return this->bitmap.next_free(0);
+}
+
+// Statistics -------------------------------------------------------------------
+
+void FileSystem::get_stats(Stats::Snapshot *snapshot) const
+{
+    this->op_stats.snapshot(snapshot);
+}
+
+void FileSystem::reset_stats()
+{
+    this->op_stats.reset();
+    SharedGuard mounted(this->mount_lock);
+    if (this->disk != NULL)
+    {
+        this->disk->reset_kinds();
+    }
+}
+
+// return the open handle of an inode, or NULL; caller holds its node lock
+
+FileSystem::File *FileSystem::find_file(size_t inumber)
+{
+    std::lock_guard<std::mutex> guard(this->files_lock);
+    std::unordered_map<size_t, File *>::iterator it = this->files.find(inumber);
+    return it != this->files.end() ? it->second : NULL;
 }
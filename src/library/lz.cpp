@@ -0,0 +1,150 @@
+// lz.cpp: Small LZ77 block codec
+
+#include "sfs/lz.h"
+
+#include <string.h>
+
+// Read four bytes at any alignment
+
+static uint32_t load32(const uint8_t *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+// Append a length that did not fit in its token half as 255s and a remainder
+
+static bool emit_length(uint8_t *&out, uint8_t *end, size_t length) {
+    for (; length >= 255; length -= 255) {
+    	if (out == end) {
+    	    return false;
+	}
+    	*out++ = 255;
+    }
+    if (out == end) {
+    	return false;
+    }
+    *out++ = length;
+    return true;
+}
+
+bool LZ::emit(uint8_t *&out, uint8_t *end, const uint8_t *literals, size_t count, size_t offset, size_t match) {
+    if (out == end) {
+    	return false;
+    }
+    size_t extra = match > 0 ? match - MIN_MATCH : 0;
+    *out++ = (count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15);
+    if (count >= 15 && !emit_length(out, end, count - 15)) {
+    	return false;
+    }
+    if ((size_t)(end - out) < count) {
+    	return false;
+    }
+    memcpy(out, literals, count);
+    out += count;
+    if (match == 0) {
+    	return true;
+    }
+    if (end - out < 2) {
+    	return false;
+    }
+    *out++ = offset & 0xff;
+    *out++ = offset >> 8;
+    return extra < 15 || emit_length(out, end, extra - 15);
+}
+
+size_t LZ::compress(const char *src, size_t length, char *dst, size_t capacity) {
+    const uint8_t *in  = (const uint8_t *)src;
+    uint8_t	  *out = (uint8_t *)dst;
+    uint8_t	  *end = out + capacity;
+
+    // Greedy parse: the last position seen with each hash of four bytes is
+    // the only match candidate (positions are stored plus one; 0 is empty)
+    uint32_t table[1 << HASH_BITS];
+    memset(table, 0, sizeof(table));
+    size_t anchor = 0;
+    size_t position = 0;
+    while (position + MIN_MATCH <= length) {
+    	uint32_t sequence  = load32(in + position);
+    	uint32_t hash	   = (sequence * 2654435761u) >> (32 - HASH_BITS);
+    	size_t	 candidate = table[hash];
+    	table[hash] = position + 1;
+    	if (candidate == 0 || position - (candidate - 1) > MAX_OFFSET || load32(in + candidate - 1) != sequence) {
+    	    position++;
+    	    continue;
+	}
+    	candidate--;
+    	size_t match = MIN_MATCH;
+    	while (position + match < length && in[candidate + match] == in[position + match]) {
+    	    match++;
+	}
+    	if (!emit(out, end, in + anchor, position - anchor, position - candidate, match)) {
+    	    return 0;
+	}
+    	position += match;
+    	anchor = position;
+    }
+    if (!emit(out, end, in + anchor, length - anchor, 0, 0)) {
+    	return 0;
+    }
+    return out - (uint8_t *)dst;
+}
+
+ssize_t LZ::decompress(const char *src, size_t length, char *dst, size_t capacity) {
+    const uint8_t *in	  = (const uint8_t *)src;
+    const uint8_t *in_end = in + length;
+    uint8_t	  *out	  = (uint8_t *)dst;
+    uint8_t	  *end	  = out + capacity;
+
+    while (in < in_end) {
+    	uint8_t token = *in++;
+
+    	// Literals
+    	size_t count = token >> 4;
+    	if (count == 15) {
+    	    uint8_t byte;
+    	    do {
+    	    	if (in == in_end) {
+    	    	    return -1;
+		}
+    	    	byte = *in++;
+    	    	count += byte;
+	    } while (byte == 255);
+	}
+    	if ((size_t)(in_end - in) < count || (size_t)(end - out) < count) {
+    	    return -1;
+	}
+    	memcpy(out, in, count);
+    	in  += count;
+    	out += count;
+    	if (in == in_end) {
+    	    break;
+	}
+
+    	// Match, which may overlap the bytes it produces
+    	if (in_end - in < 2) {
+    	    return -1;
+	}
+    	size_t offset = in[0] | in[1] << 8;
+    	in += 2;
+    	size_t match = token & 15;
+    	if (match == 15) {
+    	    uint8_t byte;
+    	    do {
+    	    	if (in == in_end) {
+    	    	    return -1;
+		}
+    	    	byte = *in++;
+    	    	match += byte;
+	    } while (byte == 255);
+	}
+    	match += MIN_MATCH;
+    	if (offset == 0 || offset > (size_t)(out - (uint8_t *)dst) || (size_t)(end - out) < match) {
+    	    return -1;
+	}
+    	for (const uint8_t *from = out - offset; match > 0; match--) {
+    	    *out++ = *from++;
+	}
+    }
+    return out - (uint8_t *)dst;
+}
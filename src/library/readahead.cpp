@@ -0,0 +1,181 @@
+// readahead.cpp: Sequential read detection and readahead staging
+
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <string.h>
+
+// A read that starts where the last one ended doubles the inode's window;
+// any other read closes it. Returns the window for this read. Once
+// READAHEAD_STREAMS inodes are tracked, a new one forgets every pattern
+// that was not set with advise, so those streams start over
+
+uint32_t FileSystem::stream_window(size_t inumber, size_t offset, size_t length)
+{
+    std::lock_guard<std::mutex> guard(this->stream_lock);
+    if (this->streams.size() >= READAHEAD_STREAMS && this->streams.count(inumber) == 0)
+    {
+        for (std::unordered_map<size_t, Stream>::iterator it = this->streams.begin(); it != this->streams.end(); )
+        {
+            if (it->second.Hint == HINT_NORMAL)
+            {
+                it = this->streams.erase(it);
+            }
+            else
+            {
+                it++;
+            }
+        }
+    }
+    Stream &stream = this->streams[inumber];
+    if (stream.Hint == HINT_RANDOM)
+    {
+        stream.Window = 0;
+    }
+    else if (stream.Hint == HINT_SEQUENTIAL)
+    {
+        stream.Window = READAHEAD_MAX_BLOCKS;
+    }
+    else if (offset == stream.Next)
+    {
+        stream.Window = stream.Window == 0 ? READAHEAD_MIN_BLOCKS
+                                           : std::min(2 * stream.Window, (uint32_t)READAHEAD_MAX_BLOCKS);
+    }
+    else
+    {
+        stream.Window = 0;
+    }
+    stream.Next = offset + length;
+    return stream.Window;
+}
+
+// Each inode reads ahead into stage inumber % READAHEAD_STAGES, so streams
+// over different files mostly use different stages; callers of staged,
+// stage_fill and stage_read hold the stage's Lock
+
+bool FileSystem::staged(size_t inumber, size_t first, size_t last) const
+{
+    const Stage &stage = this->stages[inumber % READAHEAD_STAGES];
+    return stage.Count > 0 && stage.Inumber == inumber &&
+           first >= stage.First && last < stage.First + stage.Count;
+}
+
+// read count file blocks from first into the stage, mapping them (and
+// reading the pointer blocks on the way) once for the whole run
+
+void FileSystem::stage_fill(File *file, size_t first, size_t count)
+{
+    Stage &stage = this->stage_of(file->Inumber);
+    std::vector<int> blocks;
+    this->map_blocks(file, first, count, blocks);
+    if (stage.Blocks.size() < count)
+    {
+        stage.Blocks.resize(count);
+    }
+    std::vector<int> nums;
+    std::vector<char *> buffers;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (blocks[i] == 0)
+        {
+            memset(stage.Blocks[i].Data, 0, Disk::BLOCK_SIZE);
+            continue;
+        }
+        nums.push_back(blocks[i]);
+        buffers.push_back(stage.Blocks[i].Data);
+    }
+    if (!nums.empty())
+    {
+        this->disk->readv(nums.data(), nums.size(), buffers.data());
+    }
+    stage.Inumber = file->Inumber;
+    stage.First = first;
+    stage.Count = count;
+}
+
+void FileSystem::stage_drop(size_t inumber)
+{
+    Stage &stage = this->stage_of(inumber);
+    std::lock_guard<std::mutex> guard(stage.Lock);
+    if (stage.Inumber == inumber)
+    {
+        stage.Count = 0;
+    }
+}
+
+// copy a read out of the stage, refilling it with the request and the
+// inode's window whenever the reader runs past its end
+
+ssize_t FileSystem::stage_read(File *file, size_t size, size_t window, char *data, size_t length, size_t offset)
+{
+    size_t inumber = file->Inumber;
+    Stage &stage = this->stage_of(inumber);
+    size_t file_blocks = (size + Disk::BLOCK_SIZE - 1) / Disk::BLOCK_SIZE;
+    size_t last = (offset + length - 1) / Disk::BLOCK_SIZE;
+    for (size_t i = offset / Disk::BLOCK_SIZE; i <= last; i++)
+    {
+        if (!this->staged(inumber, i, i))
+        {
+            size_t count = std::min(last - i + 1 + window, file_blocks - i);
+            this->stage_fill(file, i, std::min(count, (size_t)READAHEAD_MAX_BLOCKS));
+        }
+        size_t start = std::max(offset, i * Disk::BLOCK_SIZE);
+        size_t end = std::min(offset + length, (i + 1) * Disk::BLOCK_SIZE);
+        memcpy(data + (start - offset), stage.Blocks[i - stage.First].Data + start % Disk::BLOCK_SIZE, end - start);
+    }
+    return length;
+}
+
+// Give access pattern hint ----------------------------------------------------
+
+bool FileSystem::advise(size_t inumber, size_t offset, size_t length, AccessHint hint)
+{
+    // Map through the open handle if there is one
+    SharedGuard mounted(this->mount_lock);
+    SharedGuard guard(this->node_lock(inumber));
+    File transient(this, inumber, true);
+    File *file = this->find_file(inumber);
+    std::unique_lock<std::mutex> handle_guard;
+    if (file != NULL)
+    {
+        handle_guard = std::unique_lock<std::mutex>(file->Lock);
+    }
+    else if (!this->open_node(&transient))
+    {
+        return false;
+    }
+    else
+    {
+        file = &transient;
+    }
+    ssize_t size = node_size(&file->Node, this->features);
+    if (hint != HINT_WILLNEED)
+    {
+        // Applies to the whole file, from the next read on
+        std::lock_guard<std::mutex> streams_guard(this->stream_lock);
+        Stream &stream = this->streams[inumber];
+        stream.Hint = hint;
+        stream.Window = 0;
+        return true;
+    }
+    // Stage the range now (length 0 means to the end of the file); inline
+    // data is in the inode already, and compressed data is never staged
+    if ((size_t)size <= offset || is_inline(&file->Node, this->features) || (this->features & FEATURE_COMPRESS))
+    {
+        return true;
+    }
+    if (length == 0 || length > (size_t)size - offset)
+    {
+        length = size - offset;
+    }
+    size_t first = offset / Disk::BLOCK_SIZE;
+    size_t last = (offset + length - 1) / Disk::BLOCK_SIZE;
+    std::lock_guard<std::mutex> stage_guard(this->stage_of(inumber).Lock);
+    if (!this->staged(inumber, first, last))
+    {
+        this->stage_fill(file, first, std::min(last - first + 1, (size_t)READAHEAD_MAX_BLOCKS));
+    }
+    return true;
+}
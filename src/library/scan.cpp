@@ -0,0 +1,679 @@
+// scan.cpp: Parallel inode table scan
+
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Each worker walks a contiguous range of inode blocks and marks the blocks
+// its inodes reference in a private bitmap; nothing is shared until the
+// workers are joined and their bitmaps merged
+
+struct FileSystem::ScanWorker
+{
+    uint32_t First;		// First inode block to scan (0 is block 1)
+    uint32_t Last;		// One past the last inode block to scan
+    bool Queued;		// Whether to batch reads with queue_read/submit
+    bool Record;		// Whether to keep a ScanRecord per valid inode
+    bool Extents;		// Whether inodes map data with extents
+    bool Large;			// Whether inodes have double and triple indirect trees
+    bool Inline;		// Whether inodes may hold data instead of pointers
+    bool Check;			// Whether to check sizes and collect repairs
+    uint32_t DataMask;		// Bits of a data pointer that number its block
+    Bitmap Used;		// Blocks referenced by inodes in range
+    Bitmap Valid;		// Valid inodes in range (if sized)
+    std::vector<uint32_t> *Counts; // Pointers to each block, shared by all workers (or NULL)
+    std::vector<ScanRecord> Records;
+    CheckState Problems;	// Bad sizes and repairs (if Check)
+    size_t Reads;
+    size_t Inodes;
+    size_t Invalid;
+    size_t Duplicates;
+
+    void fetch(Disk *disk, const std::vector<int> &blocknums, char **buffers);
+    bool claim(uint32_t pointer, uint32_t block, uint32_t word);
+    void mark(uint32_t pointer);
+    bool claim_run(const Extent &extent, uint32_t block, uint32_t word);
+    void check_size(Inode &inode, uint32_t block, uint32_t slot, int64_t last);
+    void run(Disk *disk);
+};
+
+// return whether every pointer of a pointer block, masked with mask, is
+// below limit; SSE2 compares four at a time, flipping the top bit so signed
+// compares order them as unsigned
+
+static bool pointers_below(const uint32_t *pointers, uint32_t limit, uint32_t mask)
+{
+#ifdef __SSE2__
+    const __m128i bias = _mm_set1_epi32(INT32_MIN);
+    const __m128i bits = _mm_set1_epi32((int32_t)mask);
+    const __m128i max = _mm_set1_epi32((int32_t)((limit - 1) ^ 0x80000000u));
+    __m128i over = _mm_setzero_si128();
+    for (uint32_t i = 0; i < FileSystem::POINTERS_PER_BLOCK; i += 4)
+    {
+        __m128i words = _mm_and_si128(_mm_loadu_si128((const __m128i *)(pointers + i)), bits);
+        over = _mm_or_si128(over, _mm_cmpgt_epi32(_mm_xor_si128(words, bias), max));
+    }
+    return _mm_movemask_epi8(over) == 0;
+#else
+    uint32_t max = 0;
+    for (uint32_t i = 0; i < FileSystem::POINTERS_PER_BLOCK; i++)
+    {
+        max = std::max(max, pointers[i] & mask);
+    }
+    return max < limit;
+#endif
+}
+
+void FileSystem::ScanWorker::fetch(Disk *disk, const std::vector<int> &blocknums, char **buffers)
+{
+    if (Queued)
+    {
+        for (size_t i = 0; i < blocknums.size(); i++)
+        {
+            disk->queue_read(blocknums[i], buffers[i]);
+        }
+        disk->submit();
+    }
+    else
+    {
+        disk->readv(blocknums.data(), blocknums.size(), buffers);
+    }
+    Reads += blocknums.size();
+}
+
+// mark a pointer found in word of block in use; false if it points past
+// the end of the disk, in which case a check clears it
+
+bool FileSystem::ScanWorker::claim(uint32_t pointer, uint32_t block, uint32_t word)
+{
+    if (pointer >= Used.size())
+    {
+        Invalid++;
+        if (Check)
+        {
+            Repair repair = {block, word, 0};
+            Problems.Repairs.push_back(repair);
+        }
+        return false;
+    }
+    mark(pointer);
+    return true;
+}
+
+// mark a pointer known to be in range in use
+
+void FileSystem::ScanWorker::mark(uint32_t pointer)
+{
+    if (Used.test(pointer))
+    {
+        Duplicates++;
+    }
+    Used.set(pointer);
+    if (Counts)
+    {
+        __atomic_add_fetch(&(*Counts)[pointer], 1, __ATOMIC_RELAXED);
+    }
+}
+
+// mark a run of blocks in use at once; false for a hole or a run past the
+// end of the disk, which a check turns into a hole
+
+bool FileSystem::ScanWorker::claim_run(const Extent &extent, uint32_t block, uint32_t word)
+{
+    if (extent.Start == 0)
+    {
+        return false;
+    }
+    if (extent.Start >= Used.size() || extent.Length > Used.size() - extent.Start)
+    {
+        Invalid++;
+        if (Check)
+        {
+            Repair repair = {block, word, 0};
+            Problems.Repairs.push_back(repair);
+        }
+        return false;
+    }
+    Duplicates += Used.set_range(extent.Start, extent.Length);
+    return true;
+}
+
+// compare an inode's size with the last file block it maps (-1 if none);
+// a size ending before that block, or an inline size past INLINE_BYTES, is
+// fixed to cover exactly what the inode holds
+
+void FileSystem::ScanWorker::check_size(Inode &inode, uint32_t block, uint32_t slot, int64_t last)
+{
+    uint32_t features = Large ? FEATURE_LARGE : 0;
+    uint64_t size = node_size(&inode, features);
+    uint64_t fixed = size;
+    if (Inline && (inode.Valid & INODE_INLINE))
+    {
+        fixed = std::min(size, (uint64_t)INLINE_BYTES);
+    }
+    else if (last >= 0 && size <= (uint64_t)last * Disk::BLOCK_SIZE)
+    {
+        fixed = (uint64_t)(last + 1) * Disk::BLOCK_SIZE;
+    }
+    if (fixed == size)
+    {
+        return;
+    }
+    Problems.BadSizes++;
+    Inode node = inode;
+    set_node_size(&node, fixed, features);
+    uint32_t word = slot * (sizeof(Inode) / sizeof(uint32_t));
+    if (node.Valid != inode.Valid)
+    {
+        Repair valid = {block, word, node.Valid};
+        Problems.Repairs.push_back(valid);
+    }
+    Repair length = {block, word + 1, node.Size};
+    Problems.Repairs.push_back(length);
+}
+
+void FileSystem::ScanWorker::run(Disk *disk)
+{
+    // Pointer or extent block still to be read
+    struct Pending
+    {
+        uint32_t Block;		// Block to read
+        size_t Record;		// Record of the inode it belongs to
+        uint32_t Tree;		// Pointer tree (0 single, 1 double, 2 triple)
+        uint32_t Level;		// Number of pointer blocks below this one
+        uint32_t Count;		// Number of extents (Extents only)
+        uint32_t Slot;		// Inode within the batch (Check only)
+        uint64_t Base;		// File block of its first entry (Check only)
+    };
+    const uint32_t words = sizeof(Inode) / sizeof(uint32_t);
+    std::vector<Block> inode_blocks(SCAN_BATCH_BLOCKS);
+    std::vector<Block> indirect_blocks(SCAN_BATCH_BLOCKS);
+    std::vector<char *> buffers(SCAN_BATCH_BLOCKS);
+    std::vector<int> blocknums;
+    std::vector<int64_t> last_block;	// Last mapped file block per inode of the batch (Check only)
+    uint32_t direct = Large ? LARGE_DIRECT : POINTERS_PER_INODE;
+    uint32_t trees = Large ? LARGE_TREES : 1;
+    for (uint32_t start = First; start < Last; start += SCAN_BATCH_BLOCKS)
+    {
+        uint32_t count = std::min(Last - start, (uint32_t)SCAN_BATCH_BLOCKS);
+        blocknums.clear();
+        for (uint32_t i = 0; i < count; i++)
+        {
+            blocknums.push_back(start + i + 1);
+            buffers[i] = inode_blocks[i].Data;
+        }
+        fetch(disk, blocknums, buffers.data());
+        if (Check)
+        {
+            last_block.assign(count * INODES_PER_BLOCK, -1);
+        }
+        std::vector<Pending> pending;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            for (uint32_t j = 0; j < INODES_PER_BLOCK; j++)
+            {
+                Inode &inode = inode_blocks[i].Inodes[j];
+                if (inode.Valid == 0)
+                {
+                    continue;
+                }
+                Inodes++;
+                uint32_t inumber = (start + i) * INODES_PER_BLOCK + j;
+                uint32_t slot = i * INODES_PER_BLOCK + j;
+                uint32_t block = start + i + 1;
+                if (inumber < Valid.size())
+                {
+                    Valid.set(inumber);
+                }
+                if (Record)
+                {
+                    ScanRecord record;
+                    record.Inumber = inumber;
+                    record.Node = inode;
+                    Records.push_back(record);
+                }
+                if (Inline && (inode.Valid & INODE_INLINE))
+                {
+                    continue;
+                }
+                if (Extents)
+                {
+                    uint32_t extents = inode.Direct[POINTERS_PER_INODE - 1];
+                    uint64_t position = 0;
+                    for (uint32_t k = 0; k < extents && k < EXTENTS_PER_INODE; k++)
+                    {
+                        Extent extent = {inode.Direct[2 * k], inode.Direct[2 * k + 1]};
+                        if (claim_run(extent, block, j * words + 2 + 2 * k) && Check)
+                        {
+                            last_block[slot] = position + extent.Length - 1;
+                        }
+                        position += extent.Length;
+                        if (Record)
+                        {
+                            Records.back().Extents.push_back(extent);
+                        }
+                    }
+                    if (extents > EXTENTS_PER_INODE && inode.Indirect != 0 &&
+                        claim(inode.Indirect, block, j * words + 2 + POINTERS_PER_INODE))
+                    {
+                        Pending extent_block = {inode.Indirect, Records.size() - 1, 0, 0,
+                                                std::min(extents - EXTENTS_PER_INODE, (uint32_t)EXTENTS_PER_BLOCK),
+                                                slot, position};
+                        pending.push_back(extent_block);
+                    }
+                    continue;
+                }
+                for (uint32_t k = 0; k < direct; k++)
+                {
+                    if (inode.Direct[k] != 0 && claim(inode.Direct[k] & DataMask, block, j * words + 2 + k) && Check)
+                    {
+                        last_block[slot] = k;
+                    }
+                }
+                // Tree t maps the file blocks after the direct blocks and
+                // the trees before it
+                uint64_t base = direct;
+                uint64_t span = POINTERS_PER_BLOCK;
+                for (uint32_t tree = 0; tree < trees; tree++, base += span, span *= POINTERS_PER_BLOCK)
+                {
+                    uint32_t *root = tree_root(&inode, tree);
+                    if (*root != 0 && claim(*root, block, j * words + (root - (uint32_t *)&inode)))
+                    {
+                        Pending tree_block = {*root, Records.size() - 1, tree, tree, 0, slot, base};
+                        pending.push_back(tree_block);
+                    }
+                }
+            }
+        }
+        // Read pointer blocks a batch at a time, breadth first; blocks found
+        // at one level join the end of the list, so data pointers of each
+        // tree are seen in file order
+        for (size_t done = 0; done < pending.size(); )
+        {
+            size_t batch = std::min(pending.size() - done, (size_t)SCAN_BATCH_BLOCKS);
+            blocknums.clear();
+            for (size_t i = 0; i < batch; i++)
+            {
+                blocknums.push_back(pending[done + i].Block);
+                disk->set_kind(pending[done + i].Block, 1, Disk::KIND_INDIRECT);
+                buffers[i] = indirect_blocks[i].Data;
+            }
+            fetch(disk, blocknums, buffers.data());
+            for (size_t i = 0; i < batch; i++)
+            {
+                Pending current = pending[done + i];
+                if (Extents)
+                {
+                    uint64_t position = current.Base;
+                    for (uint32_t k = 0; k < current.Count; k++)
+                    {
+                        Extent &extent = indirect_blocks[i].Extents[k];
+                        if (claim_run(extent, current.Block, 2 * k) && Check)
+                        {
+                            last_block[current.Slot] = position + extent.Length - 1;
+                        }
+                        position += extent.Length;
+                        if (Record)
+                        {
+                            Records[current.Record].Extents.push_back(extent);
+                        }
+                    }
+                    continue;
+                }
+                // Each entry of a block Level levels above the data maps
+                // POINTERS_PER_BLOCK^Level file blocks
+                uint64_t span = 1;
+                for (uint32_t level = 0; level < current.Level; level++)
+                {
+                    span *= POINTERS_PER_BLOCK;
+                }
+                // Data pointers may carry flags (FEATURE_COMPRESS)
+                const uint32_t *pointers = indirect_blocks[i].Pointers;
+                uint32_t mask = current.Level == 0 ? DataMask : ~0u;
+                bool in_range = pointers_below(pointers, Used.size(), mask);
+                for (uint32_t k = 0; k < POINTERS_PER_BLOCK; k++)
+                {
+                    uint32_t pointer = pointers[k] & mask;
+                    if (pointer == 0)
+                    {
+                        continue;
+                    }
+                    bool valid = true;
+                    if (in_range)
+                    {
+                        mark(pointer);
+                    }
+                    else
+                    {
+                        valid = claim(pointer, current.Block, k);
+                    }
+                    if (current.Level > 0)
+                    {
+                        if (!valid)
+                        {
+                            continue;
+                        }
+                        Pending block = {pointer, current.Record, current.Tree, current.Level - 1, 0,
+                                         current.Slot, current.Base + k * span};
+                        pending.push_back(block);
+                        continue;
+                    }
+                    if (Check && valid)
+                    {
+                        last_block[current.Slot] = std::max(last_block[current.Slot], (int64_t)(current.Base + k));
+                    }
+                    if (Record)
+                    {
+                        Records[current.Record].Pointers[current.Tree].push_back(pointer);
+                    }
+                }
+            }
+            done += batch;
+        }
+        if (!Check)
+        {
+            continue;
+        }
+        for (uint32_t slot = 0; slot < count * INODES_PER_BLOCK; slot++)
+        {
+            Inode &inode = inode_blocks[slot / INODES_PER_BLOCK].Inodes[slot % INODES_PER_BLOCK];
+            if (inode.Valid != 0)
+            {
+                check_size(inode, start + slot / INODES_PER_BLOCK + 1, slot % INODES_PER_BLOCK, last_block[slot]);
+            }
+        }
+    }
+}
+
+// Scan the inode table with up to threads workers, leaving every block in
+// use marked in bitmap, every valid inode marked in inode_map if given and,
+// if records is given, every valid inode in order; with check, sizes are
+// checked too and every fix is collected in check, and with counts the
+// number of pointers to each block is counted there
+
+void FileSystem::scan_inodes(Disk *disk, const SuperBlock &super, unsigned threads, Bitmap *bitmap,
+                             Bitmap *inode_map, std::vector<ScanRecord> *records, ScanStats *stats,
+                             CheckState *check, std::vector<uint32_t> *counts)
+{
+    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+
+    // Superblock, inode table, free bitmap and reference table are always
+    // in use
+    uint32_t blocks = disk->size();
+    uint32_t inode_blocks = std::min(super.InodeBlocks, blocks > 0 ? blocks - 1 : 0);
+    bitmap->resize(blocks);
+    for (uint32_t i = 0; i <= inode_blocks && i < blocks; i++)
+    {
+        bitmap->set(i);
+    }
+    if (super.Revision > 0 && (super.Features & FEATURE_BITMAP) && super.BitmapStart + super.BitmapBlocks <= blocks)
+    {
+        for (uint32_t i = 0; i < super.BitmapBlocks; i++)
+        {
+            bitmap->set(super.BitmapStart + i);
+        }
+    }
+    if (super.Revision > 0 && (super.Features & FEATURE_DEDUP) && super.RefStart + super.RefBlocks <= blocks)
+    {
+        for (uint32_t i = 0; i < super.RefBlocks; i++)
+        {
+            bitmap->set(super.RefStart + i);
+        }
+    }
+    if (counts)
+    {
+        counts->assign(blocks, 0);
+    }
+
+    threads = std::max(1u, std::min(threads, inode_blocks));
+    uint32_t per_worker = (inode_blocks + threads - 1) / threads;
+    std::vector<ScanWorker> workers(threads);
+    for (unsigned w = 0; w < threads; w++)
+    {
+        ScanWorker &worker = workers[w];
+        worker.First = std::min(w * per_worker, inode_blocks);
+        worker.Last = std::min(worker.First + per_worker, inode_blocks);
+        // Queued reads on io_uring take turns on the one ring, so parallel
+        // workers read directly instead; only a lone worker batches
+        worker.Queued = threads == 1;
+        worker.Record = records != NULL;
+        worker.Extents = super.Revision > 0 && (super.Features & FEATURE_EXTENTS);
+        worker.Large = super.Revision > 0 && (super.Features & FEATURE_LARGE);
+        worker.Inline = super.Revision > 0 && (super.Features & FEATURE_INLINE);
+        worker.Check = check != NULL;
+        worker.DataMask = data_mask(super.Revision > 0 ? super.Features : 0);
+        worker.Problems.BadSizes = 0;
+        worker.Counts = counts;
+        worker.Used.resize(blocks);
+        if (inode_map)
+        {
+            worker.Valid.resize(inode_blocks * INODES_PER_BLOCK);
+        }
+        worker.Reads = worker.Inodes = worker.Invalid = worker.Duplicates = 0;
+    }
+    if (threads == 1)
+    {
+        workers[0].run(disk);
+    }
+    else
+    {
+        std::vector<std::thread> pool;
+        for (unsigned w = 0; w < threads; w++)
+        {
+            pool.push_back(std::thread(&ScanWorker::run, &workers[w], disk));
+        }
+        for (unsigned w = 0; w < threads; w++)
+        {
+            pool[w].join();
+        }
+    }
+
+    // Merge partial results; blocks set in more than one bitmap are shared
+    // between workers or with metadata
+    size_t inodes = 0;
+    size_t invalid = 0;
+    size_t duplicates = 0;
+    if (inode_map)
+    {
+        inode_map->resize(inode_blocks * INODES_PER_BLOCK);
+    }
+    for (unsigned w = 0; w < threads; w++)
+    {
+        ScanWorker &worker = workers[w];
+        duplicates += worker.Duplicates + bitmap->merge(worker.Used);
+        inodes += worker.Inodes;
+        if (inode_map)
+        {
+            inode_map->merge(worker.Valid);
+        }
+        invalid += worker.Invalid;
+        if (records)
+        {
+            records->insert(records->end(), worker.Records.begin(), worker.Records.end());
+        }
+        if (check)
+        {
+            check->BadSizes += worker.Problems.BadSizes;
+            check->Repairs.insert(check->Repairs.end(), worker.Problems.Repairs.begin(), worker.Problems.Repairs.end());
+        }
+    }
+
+    if (stats)
+    {
+        stats->Threads = threads;
+        stats->Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        stats->Inodes = inodes;
+        stats->Blocks = bitmap->size() - bitmap->free();
+        stats->Invalid = invalid;
+        stats->Duplicates = duplicates;
+        stats->Reads.clear();
+        for (unsigned w = 0; w < threads; w++)
+        {
+            stats->Reads.push_back(workers[w].Reads);
+        }
+    }
+}
+
+// Check file system ------------------------------------------------------------
+
+bool FileSystem::scan(Disk *disk, unsigned threads, ScanStats *stats)
+{
+    Block block;
+    disk->read(0, block.Data);
+    if (block.Super.MagicNumber != MAGIC_NUMBER)
+    {
+        return false;
+    }
+    Bitmap bitmap;
+    scan_inodes(disk, block.Super, threads, &bitmap, NULL, NULL, stats);
+    return true;
+}
+
+bool FileSystem::check(Disk *disk, unsigned threads, bool repair, CheckReport *report)
+{
+    Block block;
+    if (disk->mounted())
+    {
+        return false;
+    }
+    disk->read(0, block.Data);
+    if (!valid_super(block.Super, disk->size()))
+    {
+        return false;
+    }
+    SuperBlock super = block.Super;
+    Bitmap bitmap;
+    CheckState problems;
+    problems.BadSizes = 0;
+    bool dedup = super.Revision > 0 && (super.Features & FEATURE_DEDUP);
+    std::vector<uint32_t> counts;
+    scan_inodes(disk, super, threads, &bitmap, NULL, NULL, &report->Scan, &problems, dedup ? &counts : NULL);
+    report->BadSizes = problems.BadSizes;
+    report->Leaked = 0;
+    report->Lost = 0;
+    report->BadRefs = 0;
+    report->Repairs = 0;
+
+    // Compare the saved reference table with the pointers found: a block
+    // with several pointers must count them all, any other block at most its
+    // one pointer. Blocks shared as counted are no duplicates; wrong entries
+    // are recounted (and hashed again, if shared) in place
+    std::vector<Block> table(dedup ? super.RefBlocks : 0);
+    std::vector<size_t> ref_regions;
+    if (dedup)
+    {
+        for (uint32_t i = 0; i < super.RefBlocks; i++)
+        {
+            disk->queue_read(super.RefStart + i, table[i].Data);
+        }
+        disk->submit();
+        for (uint32_t b = 0; b < counts.size(); b++)
+        {
+            Reference &ref = table[b / REFS_PER_BLOCK].Refs[b % REFS_PER_BLOCK];
+            if (counts[b] > 1 && ref.Count == counts[b])
+            {
+                report->Scan.Duplicates -= counts[b] - 1;
+                continue;
+            }
+            if (counts[b] <= 1 && ref.Count <= counts[b])
+            {
+                continue;
+            }
+            report->BadRefs++;
+            ref.Count = counts[b] > 1 ? counts[b] : 0;
+            ref.Hash = 0;
+            if (repair && ref.Count > 0)
+            {
+                disk->read(b, block.Data);
+                ref.Hash = block_hash(block.Data);
+            }
+            if (ref_regions.empty() || ref_regions.back() != b / REFS_PER_BLOCK)
+            {
+                ref_regions.push_back(b / REFS_PER_BLOCK);
+            }
+        }
+    }
+
+    // Compare the saved free bitmap with the blocks found in use, noting
+    // the regions that differ
+    std::vector<size_t> regions;
+    bool bitmap_saved = super.Revision > 0 && (super.Features & FEATURE_BITMAP);
+    if (bitmap_saved)
+    {
+        std::vector<Block> blocks(super.BitmapBlocks);
+        for (uint32_t i = 0; i < super.BitmapBlocks; i++)
+        {
+            disk->queue_read(super.BitmapStart + i, blocks[i].Data);
+        }
+        disk->submit();
+        Bitmap saved;
+        saved.load((const uint64_t *)blocks.data(), bitmap.size());
+        for (size_t b = 0; b < bitmap.size(); b++)
+        {
+            if (saved.test(b) == bitmap.test(b))
+            {
+                continue;
+            }
+            (bitmap.test(b) ? report->Lost : report->Leaked)++;
+            if (regions.empty() || regions.back() != b / Bitmap::REGION_BITS)
+            {
+                regions.push_back(b / Bitmap::REGION_BITS);
+            }
+        }
+    }
+    if (!repair)
+    {
+        return true;
+    }
+
+    // Rewrite each block needing fixes once, in block order
+    std::vector<Repair> &repairs = problems.Repairs;
+    std::stable_sort(repairs.begin(), repairs.end(),
+                     [](const Repair &a, const Repair &b) { return a.Block < b.Block; });
+    for (size_t i = 0; i < repairs.size(); )
+    {
+        disk->read(repairs[i].Block, block.Data);
+        size_t j = i;
+        for (; j < repairs.size() && repairs[j].Block == repairs[i].Block; j++)
+        {
+            block.Pointers[repairs[j].Word] = repairs[j].Value;
+        }
+        disk->write(repairs[i].Block, block.Data);
+        i = j;
+    }
+    report->Repairs = repairs.size();
+    for (size_t i = 0; i < ref_regions.size(); i++)
+    {
+        disk->write(super.RefStart + ref_regions[i], table[ref_regions[i]].Data);
+    }
+    report->Repairs += ref_regions.size();
+    if (bitmap_saved)
+    {
+        for (size_t i = 0; i < regions.size(); i++)
+        {
+            write_bitmap_block(disk, bitmap, super.BitmapStart, regions[i]);
+        }
+        report->Repairs += regions.size();
+        // The saved bitmap now matches the inode table, so the next mount
+        // can trust it
+        if (!super.Clean)
+        {
+            memset(block.Data, 0, Disk::BLOCK_SIZE);
+            block.Super = super;
+            block.Super.Clean = 1;
+            disk->write(0, block.Data);
+            report->Repairs++;
+        }
+    }
+    return true;
+}
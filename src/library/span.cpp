@@ -0,0 +1,186 @@
+// span.cpp: File data as runs of the disk image
+
+#include "sfs/fs.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include <errno.h>
+#include <stddef.h>
+#include <unistd.h>
+
+// Spans ------------------------------------------------------------------------
+
+ssize_t FileSystem::spans(size_t inumber, size_t offset, size_t length, std::vector<Span> &spans)
+{
+    SharedGuard mounted(this->mount_lock);
+    SharedGuard guard(this->node_lock(inumber));
+    File *handle = this->find_file(inumber);
+    if (handle != NULL)
+    {
+        std::lock_guard<std::mutex> handle_guard(handle->Lock);
+        return this->map_spans(handle, offset, length, spans);
+    }
+    File file(this, inumber, true);
+    if (!this->open_node(&file))
+    {
+        return -1;
+    }
+    return this->map_spans(&file, offset, length, spans);
+}
+
+// map a byte range a batch of blocks at a time; blocks that follow each other
+// on disk (or holes that follow holes) grow the last span
+
+ssize_t FileSystem::map_spans(File *file, size_t offset, size_t length, std::vector<Span> &spans)
+{
+    ssize_t size = node_size(&file->Node, this->features);
+    if ((size_t)size < offset)
+    {
+        return -1;
+    }
+    length = std::min(length, (size_t)size - offset);
+    if (length == 0)
+    {
+        return 0;
+    }
+    // Inline data lies in the inode's slot of its inode block, once the
+    // handle's copy of the inode is written back
+    if (is_inline(&file->Node, this->features))
+    {
+        if (file->NodeDirty)
+        {
+            this->save_node(file->Inumber, &file->Node);
+            file->NodeDirty = false;
+        }
+        this->flush_inodes();
+        this->disk->flush();
+        uint64_t image = (uint64_t)(file->Inumber / INODES_PER_BLOCK + 1) * Disk::BLOCK_SIZE +
+                         (file->Inumber % INODES_PER_BLOCK) * sizeof(Inode) + offsetof(Inode, Direct) + offset;
+        Span span = {image, length, this->disk->mapped(image)};
+        spans.push_back(span);
+        return length;
+    }
+    // Compressed clusters hold no file bytes as they are
+    if (this->features & FEATURE_COMPRESS)
+    {
+        return -1;
+    }
+    this->disk->flush();
+
+    size_t mine = spans.size();
+    size_t end = offset + length;
+    std::vector<int> blocks;
+    for (size_t first = offset / Disk::BLOCK_SIZE; first * Disk::BLOCK_SIZE < end; first += POINTERS_PER_BLOCK)
+    {
+        size_t count = std::min((size_t)POINTERS_PER_BLOCK, (end - 1) / Disk::BLOCK_SIZE + 1 - first);
+        blocks.clear();
+        this->map_blocks(file, first, count, blocks);
+        for (size_t i = 0; i < count; i++)
+        {
+            size_t start = std::max(offset, (first + i) * Disk::BLOCK_SIZE);
+            size_t stop = std::min(end, (first + i + 1) * Disk::BLOCK_SIZE);
+            uint64_t image = blocks[i] ? (uint64_t)blocks[i] * Disk::BLOCK_SIZE + start % Disk::BLOCK_SIZE : 0;
+            if (spans.size() > mine)
+            {
+                Span &last = spans.back();
+                if ((image == 0 && last.Offset == 0) || (image != 0 && last.Offset != 0 && last.Offset + last.Length == image))
+                {
+                    last.Length += stop - start;
+                    continue;
+                }
+            }
+            Span span = {image, stop - start, image ? this->disk->mapped(image) : NULL};
+            spans.push_back(span);
+        }
+    }
+    return length;
+}
+
+// Copy out ---------------------------------------------------------------------
+
+ssize_t FileSystem::copy_to(size_t inumber, int fd)
+{
+    // The inode stays locked until the copy is done, so its blocks cannot be
+    // freed and reused under it
+    Stats::Timer timer(this->op_stats, Stats::OP_READ);
+    SharedGuard mounted(this->mount_lock);
+    SharedGuard guard(this->node_lock(inumber));
+    File transient(this, inumber, true);
+    File *file = this->find_file(inumber);
+    std::unique_lock<std::mutex> handle_guard;
+    if (file != NULL)
+    {
+        handle_guard = std::unique_lock<std::mutex>(file->Lock);
+    }
+    else if (!this->open_node(&transient))
+    {
+        return -1;
+    }
+    else
+    {
+        file = &transient;
+    }
+    if ((this->features & FEATURE_COMPRESS) && !is_inline(&file->Node, this->features))
+    {
+        return this->copy_read(file, fd);
+    }
+    std::vector<Span> runs;
+    ssize_t length = this->map_spans(file, 0, std::numeric_limits<size_t>::max(), runs);
+    if (length < 0)
+    {
+        return -1;
+    }
+    Block zero;
+    memset(zero.Data, 0, Disk::BLOCK_SIZE);
+    for (size_t i = 0; i < runs.size(); i++)
+    {
+        if (runs[i].Offset != 0)
+        {
+            if (this->disk->copy_range(runs[i].Offset, runs[i].Length, fd) < 0)
+            {
+                return -1;
+            }
+            continue;
+        }
+        // holes are written out as zeros
+        for (size_t done = 0; done < runs[i].Length; )
+        {
+            ssize_t n = ::write(fd, zero.Data, std::min(runs[i].Length - done, (size_t)Disk::BLOCK_SIZE));
+            if (n < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+            done += std::max(n, (ssize_t)0);
+        }
+    }
+    this->op_stats.add_read(length);
+    return length;
+}
+
+// copy a compressed file to fd through read_file, a cluster at a time
+
+ssize_t FileSystem::copy_read(File *file, int fd)
+{
+    std::vector<char> buffer(CLUSTER_BLOCKS * Disk::BLOCK_SIZE);
+    size_t offset = 0;
+    while (true)
+    {
+        ssize_t length = this->read_file(file, buffer.data(), buffer.size(), offset);
+        if (length <= 0)
+        {
+            return length < 0 ? -1 : offset;
+        }
+        for (ssize_t done = 0; done < length; )
+        {
+            ssize_t n = ::write(fd, buffer.data() + done, length - done);
+            if (n < 0 && errno != EINTR)
+            {
+                return -1;
+            }
+            done += std::max(n, (ssize_t)0);
+        }
+        offset += length;
+    }
+}
@@ -0,0 +1,82 @@
+// stats.cpp: File system operation statistics
+
+#include "sfs/stats.h"
+
+#include <algorithm>
+
+const char *Stats::name(Operation op) {
+    static const char *names[OPERATIONS] = {"create", "remove", "stat", "read", "write", "mount"};
+    return names[op];
+}
+
+static thread_local Stats::Operation Current = Stats::OPERATIONS;
+
+Stats::Operation Stats::current() {
+    return Current;
+}
+
+Stats::Operation Stats::enter(Operation op) {
+    Operation previous = Current;
+    Current = op;
+    return previous;
+}
+
+void Stats::record(Operation op, uint64_t nanoseconds) {
+    Counters &counters = Operations[op];
+    size_t bucket = nanoseconds ? 63 - __builtin_clzll(nanoseconds) : 0;
+
+    counters.Calls.fetch_add(1, std::memory_order_relaxed);
+    counters.Nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+    counters.Buckets[std::min(bucket, BUCKETS - 1)].fetch_add(1, std::memory_order_relaxed);
+
+    // Raise the maximum unless another call already raised it further
+    uint64_t max = counters.Max.load(std::memory_order_relaxed);
+    while (nanoseconds > max && !counters.Max.compare_exchange_weak(max, nanoseconds, std::memory_order_relaxed)) {
+    }
+}
+
+void Stats::snapshot(Snapshot *snapshot) const {
+    for (size_t op = 0; op < OPERATIONS; op++) {
+    	const Counters &counters = Operations[op];
+    	Histogram &histogram = snapshot->Operations[op];
+    	histogram.Calls	      = counters.Calls.load(std::memory_order_relaxed);
+    	histogram.Nanoseconds = counters.Nanoseconds.load(std::memory_order_relaxed);
+    	histogram.Max	      = counters.Max.load(std::memory_order_relaxed);
+    	for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+    	    histogram.Buckets[bucket] = counters.Buckets[bucket].load(std::memory_order_relaxed);
+	}
+    }
+    snapshot->BytesRead	   = BytesRead.load(std::memory_order_relaxed);
+    snapshot->BytesWritten = BytesWritten.load(std::memory_order_relaxed);
+}
+
+void Stats::reset() {
+    for (size_t op = 0; op < OPERATIONS; op++) {
+    	Counters &counters = Operations[op];
+    	counters.Calls	     = 0;
+    	counters.Nanoseconds = 0;
+    	counters.Max	     = 0;
+    	for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+    	    counters.Buckets[bucket] = 0;
+	}
+    }
+    BytesRead	 = 0;
+    BytesWritten = 0;
+}
+
+uint64_t Stats::Histogram::percentile(double p) const {
+    if (Calls == 0) {
+    	return 0;
+    }
+
+    // Walk buckets until rank calls are covered
+    uint64_t rank = std::max((uint64_t)1, (uint64_t)(p * Calls + 0.5));
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < BUCKETS; bucket++) {
+    	seen += Buckets[bucket];
+    	if (seen >= rank) {
+    	    return std::min(2ULL << bucket, (unsigned long long)Max);
+	}
+    }
+    return Max;
+}
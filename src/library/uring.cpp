@@ -0,0 +1,163 @@
+// uring.cpp: Minimal io_uring submission/completion ring
+
+#include "sfs/uring.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SFS_HAVE_IO_URING
+#endif
+#endif
+
+#ifdef SFS_HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+
+IoRing::~IoRing() {
+    if (Sqes) {
+    	munmap(Sqes, SqesSize);
+    }
+    if (CqRing && CqRing != SqRing) {
+    	munmap(CqRing, CqRingSize);
+    }
+    if (SqRing) {
+    	munmap(SqRing, SqRingSize);
+    }
+    if (RingFd >= 0) {
+    	close(RingFd);
+    }
+}
+
+bool IoRing::setup(unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    RingFd = syscall(__NR_io_uring_setup, entries, &params);
+    if (RingFd < 0) {
+    	return false;
+    }
+
+    SqRingSize = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    CqRingSize = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	SqRingSize = CqRingSize = SqRingSize > CqRingSize ? SqRingSize : CqRingSize;
+    }
+
+    SqRing = mmap(NULL, SqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFd, IORING_OFF_SQ_RING);
+    if (SqRing == MAP_FAILED) {
+    	SqRing = NULL;
+    	return false;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    	CqRing = SqRing;
+    } else {
+    	CqRing = mmap(NULL, CqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFd, IORING_OFF_CQ_RING);
+    	if (CqRing == MAP_FAILED) {
+    	    CqRing = NULL;
+    	    return false;
+	}
+    }
+
+    SqesSize = params.sq_entries*sizeof(struct io_uring_sqe);
+    Sqes = mmap(NULL, SqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, RingFd, IORING_OFF_SQES);
+    if (Sqes == MAP_FAILED) {
+    	Sqes = NULL;
+    	return false;
+    }
+
+    char *sq = (char *)SqRing;
+    SqHead  = (unsigned *)(sq + params.sq_off.head);
+    SqTail  = (unsigned *)(sq + params.sq_off.tail);
+    SqMask  = (unsigned *)(sq + params.sq_off.ring_mask);
+    SqArray = (unsigned *)(sq + params.sq_off.array);
+
+    char *cq = (char *)CqRing;
+    CqHead = (unsigned *)(cq + params.cq_off.head);
+    CqTail = (unsigned *)(cq + params.cq_off.tail);
+    CqMask = (unsigned *)(cq + params.cq_off.ring_mask);
+    Cqes   = cq + params.cq_off.cqes;
+
+    Entries = params.sq_entries;
+    return true;
+}
+
+void IoRing::prepare(bool write, int fd, const struct iovec *iov, unsigned nr, off_t offset, uint64_t user_data) {
+    unsigned tail  = *SqTail;
+    unsigned index = tail & *SqMask;
+    struct io_uring_sqe *sqe = (struct io_uring_sqe *)Sqes + index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode	   = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd	   = fd;
+    sqe->addr	   = (uint64_t)(uintptr_t)iov;
+    sqe->len	   = nr;
+    sqe->off	   = offset;
+    sqe->user_data = user_data;
+
+    SqArray[index] = index;
+    __atomic_store_n(SqTail, tail + 1, __ATOMIC_RELEASE);
+    Queued++;
+}
+
+int IoRing::submit(unsigned min_complete) {
+    unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    int result = syscall(__NR_io_uring_enter, RingFd, Queued, min_complete, flags, NULL, 0);
+    if (result >= 0) {
+    	Queued -= result;
+    }
+    return result;
+}
+
+unsigned IoRing::withdraw() {
+    // The kernel only reads the tail inside io_uring_enter
+    unsigned withdrawn = Queued;
+    __atomic_store_n(SqTail, *SqTail - withdrawn, __ATOMIC_RELEASE);
+    Queued = 0;
+    return withdrawn;
+}
+
+bool IoRing::reap(uint64_t *user_data, int *result) {
+    unsigned head = *CqHead;
+    if (head == __atomic_load_n(CqTail, __ATOMIC_ACQUIRE)) {
+    	return false;
+    }
+
+    struct io_uring_cqe *cqe = (struct io_uring_cqe *)Cqes + (head & *CqMask);
+    *user_data = cqe->user_data;
+    *result    = cqe->res;
+    __atomic_store_n(CqHead, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+#else
+
+// io_uring is unavailable: setup fails and Disk falls back to synchronous I/O
+
+IoRing::~IoRing() {}
+
+bool IoRing::setup(unsigned entries) {
+    return false;
+}
+
+void IoRing::prepare(bool write, int fd, const struct iovec *iov, unsigned nr, off_t offset, uint64_t user_data) {}
+
+int IoRing::submit(unsigned min_complete) {
+    errno = ENOSYS;
+    return -1;
+}
+
+unsigned IoRing::withdraw() {
+    return 0;
+}
+
+bool IoRing::reap(uint64_t *user_data, int *result) {
+    return false;
+}
+
+#endif
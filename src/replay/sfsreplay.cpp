@@ -0,0 +1,213 @@
+// sfsreplay.cpp: Replay a block I/O trace against a disk image
+
+#include "sfs/disk.h"
+#include "sfs/stats.h"
+#include "sfs/trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Macros
+
+#define streq(a, b) (strcmp((a), (b)) == 0)
+
+// Measurements of one request type
+
+struct Result {
+    const char		*Name;
+    std::vector<double>  Latencies;	// Seconds per request
+    size_t		 Blocks;	// Blocks moved by all requests
+};
+
+// Function prototypes
+
+bool load_trace(const char *path, TraceHeader *header, std::vector<TraceRecord> &records);
+double percentile(const std::vector<double> &sorted, double p);
+void usage(const char *program);
+
+// Main execution
+
+int main(int argc, char *argv[]) {
+    Disk::Backend backend  = Disk::BACKEND_PREAD;
+    size_t	  cache	   = 0;
+    bool	  timed	   = false;
+    bool	  machine  = false;
+
+    int c;
+    while ((c = getopt(argc, argv, "B:c:mth")) != -1) {
+    	switch (c) {
+    	    case 'c': cache = strtoul(optarg, NULL, 0); break;
+    	    case 'm': machine = true; break;
+    	    case 't': timed = true; break;
+    	    case 'B':
+		if (streq(optarg, "mmap")) {
+		    backend = Disk::BACKEND_MMAP;
+		} else if (streq(optarg, "uring")) {
+		    backend = Disk::BACKEND_URING;
+		} else if (!streq(optarg, "pread")) {
+		    fprintf(stderr, "Unknown backend: %s\n", optarg);
+		    return EXIT_FAILURE;
+		}
+		break;
+    	    default:
+		usage(argv[0]);
+		return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+    }
+    if (argc - optind != 2 && argc - optind != 3) {
+    	usage(argv[0]);
+    	return EXIT_FAILURE;
+    }
+
+    TraceHeader header;
+    std::vector<TraceRecord> records;
+    if (!load_trace(argv[optind], &header, records)) {
+    	return EXIT_FAILURE;
+    }
+    size_t blocks = argc - optind == 3 ? strtoul(argv[optind + 2], NULL, 0) : header.Blocks;
+
+    Result results[] = {{"read", {}, 0}, {"write", {}, 0}, {"discard", {}, 0}};
+    size_t operations[Stats::OPERATIONS + 1] = {0};
+    size_t skipped = 0;
+    double seconds = 0;
+    {
+    	Disk disk;
+    	try {
+    	    disk.open(argv[optind + 1], blocks, backend);
+	} catch (std::runtime_error &e) {
+	    fprintf(stderr, "Unable to open disk %s: %s\n", argv[optind + 1], e.what());
+	    return EXIT_FAILURE;
+	}
+    	disk.set_cache(cache);
+
+    	// Writes carry no data in the trace, so they write a filler pattern
+    	size_t longest = 1;
+    	for (size_t i = 0; i < records.size(); i++) {
+    	    longest = std::max(longest, (size_t)records[i].Count);
+	}
+    	std::vector<char> data(longest * Disk::BLOCK_SIZE, 'r');
+    	std::vector<char *> buffers(longest);
+    	for (size_t i = 0; i < longest; i++) {
+    	    buffers[i] = data.data() + i * Disk::BLOCK_SIZE;
+	}
+
+    	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    	for (size_t i = 0; i < records.size(); i++) {
+    	    const TraceRecord &record = records[i];
+    	    if (record.Type > TRACE_DISCARD || record.Count == 0 || (size_t)record.Block + record.Count > blocks) {
+    	    	skipped++;
+    	    	continue;
+	    }
+
+	    // With original timing, wait until the request's offset into the trace
+	    if (timed) {
+	    	std::this_thread::sleep_until(start + std::chrono::nanoseconds(record.Time));
+	    }
+
+	    std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	    switch (record.Type) {
+	    	case TRACE_READ:    disk.readv(record.Block, record.Count, buffers.data()); break;
+	    	case TRACE_WRITE:   disk.writev(record.Block, record.Count, buffers.data()); break;
+	    	case TRACE_DISCARD: disk.discard(record.Block, record.Count); break;
+	    }
+	    results[record.Type].Latencies.push_back(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+	    results[record.Type].Blocks += record.Count;
+	    operations[std::min((size_t)record.Operation, (size_t)Stats::OPERATIONS)]++;
+	}
+    	disk.flush();
+    	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Disk printed its totals above; the replay results follow
+    size_t requests = records.size() - skipped;
+    size_t moved    = results[TRACE_READ].Blocks + results[TRACE_WRITE].Blocks;
+    if (machine) {
+    	printf("name\trequests\tblocks\tseconds\trequests_per_sec\tmb_per_sec\tp50_us\tp90_us\tp99_us\tmax_us\n");
+    } else {
+    	printf("replayed %lu requests (%lu skipped) in %.6f seconds%s\n", requests, skipped, seconds, timed ? " with original timing" : "");
+    	printf("    %.1f requests/s, %.2f MB/s\n", seconds > 0 ? requests / seconds : 0,
+    	       seconds > 0 ? moved * Disk::BLOCK_SIZE / seconds / (1 << 20) : 0);
+    }
+    for (size_t type = 0; type <= TRACE_DISCARD; type++) {
+    	Result &result = results[type];
+    	std::sort(result.Latencies.begin(), result.Latencies.end());
+    	double busy = 0;
+    	for (size_t i = 0; i < result.Latencies.size(); i++) {
+    	    busy += result.Latencies[i];
+	}
+    	size_t count = result.Latencies.size();
+    	if (machine) {
+    	    printf("%s\t%lu\t%lu\t%.6f\t%.1f\t%.2f\t%.1f\t%.1f\t%.1f\t%.1f\n", result.Name, count, result.Blocks, busy,
+    	    	   busy > 0 ? count / busy : 0, busy > 0 ? result.Blocks * Disk::BLOCK_SIZE / busy / (1 << 20) : 0,
+    	    	   percentile(result.Latencies, 0.50), percentile(result.Latencies, 0.90),
+    	    	   percentile(result.Latencies, 0.99), percentile(result.Latencies, 1.00));
+	} else {
+	    printf("    %s: %lu requests, %lu blocks, p50 %.1f us, p90 %.1f us, p99 %.1f us, max %.1f us\n",
+	    	   result.Name, count, result.Blocks, percentile(result.Latencies, 0.50), percentile(result.Latencies, 0.90),
+	    	   percentile(result.Latencies, 0.99), percentile(result.Latencies, 1.00));
+	}
+    }
+    if (!machine) {
+    	for (size_t op = 0; op <= Stats::OPERATIONS; op++) {
+    	    if (operations[op]) {
+    	    	printf("    %s: %lu requests\n", op < Stats::OPERATIONS ? Stats::name((Stats::Operation)op) : "other", operations[op]);
+	    }
+	}
+    }
+    return EXIT_SUCCESS;
+}
+
+// Utility functions
+
+bool load_trace(const char *path, TraceHeader *header, std::vector<TraceRecord> &records) {
+    FILE *stream = fopen(path, "r");
+    if (stream == nullptr) {
+    	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
+    	return false;
+    }
+
+    if (fread(header, sizeof(*header), 1, stream) != 1 || memcmp(header->Magic, TRACE_MAGIC, sizeof(header->Magic)) ||
+    	header->Version != TRACE_VERSION || header->BlockSize != Disk::BLOCK_SIZE) {
+    	fprintf(stderr, "%s is not a trace of %lu byte blocks\n", path, Disk::BLOCK_SIZE);
+    	fclose(stream);
+    	return false;
+    }
+
+    TraceRecord record;
+    while (fread(&record, sizeof(record), 1, stream) == 1) {
+    	records.push_back(record);
+    }
+    fclose(stream);
+    return true;
+}
+
+// Return latency at percentile p of sorted latencies, in microseconds
+
+double percentile(const std::vector<double> &sorted, double p) {
+    if (sorted.empty()) {
+    	return 0;
+    }
+    size_t rank = std::max((size_t)1, (size_t)(p * sorted.size() + 0.999999));
+    return sorted[std::min(rank, sorted.size()) - 1] * 1e6;
+}
+
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [options] <trace> <diskfile> [nblocks]\n", program);
+    fprintf(stderr, "Replays the reads, writes and discards of a trace recorded with\n");
+    fprintf(stderr, "Disk::start_trace (sfssh: trace <file>); writes fill blocks with a\n");
+    fprintf(stderr, "pattern, so replay against a copy of the image.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "    -B <backend>    pread, mmap or uring (default pread)\n");
+    fprintf(stderr, "    -c <blocks>     Block cache size (default 0)\n");
+    fprintf(stderr, "    -m              Print tab-separated results\n");
+    fprintf(stderr, "    -t              Keep the original timing between requests\n");
+}
@@ -20,6 +20,15 @@
 void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_cache(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_threads(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_scan(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_fsck(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_free(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_stats(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_create(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
@@ -28,7 +37,8 @@ void do_stat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2);
 
-bool copyout(FileSystem &fs, size_t inumber, const char *path);
+bool copyout(FileSystem &fs, size_t inumber, const char *path, bool direct);
+bool parse_features(char *list, uint32_t *features);
 bool copyin(FileSystem &fs, const char *path, size_t inumber);
 
 // Main execution
@@ -37,13 +47,25 @@ int main(int argc, char *argv[]) {
     Disk	disk;
     FileSystem	fs;
 
-    if (argc != 3) {
-    	fprintf(stderr, "Usage: %s <diskfile> <nblocks>\n", argv[0]);
+    if (argc != 3 && argc != 4) {
+    	fprintf(stderr, "Usage: %s <diskfile> <nblocks> [pread|mmap|uring]\n", argv[0]);
     	return EXIT_FAILURE;
     }
 
+    Disk::Backend backend = Disk::BACKEND_PREAD;
+    if (argc == 4) {
+    	if (streq(argv[3], "mmap")) {
+    	    backend = Disk::BACKEND_MMAP;
+	} else if (streq(argv[3], "uring")) {
+	    backend = Disk::BACKEND_URING;
+	} else if (!streq(argv[3], "pread")) {
+	    fprintf(stderr, "Unknown backend: %s\n", argv[3]);
+	    return EXIT_FAILURE;
+	}
+    }
+
     try {
-    	disk.open(argv[1], atoi(argv[2]));
+    	disk.open(argv[1], atoi(argv[2]), backend);
     } catch (std::runtime_error &e) {
     	fprintf(stderr, "Unable to open disk %s: %s\n", argv[1], e.what());
     	return EXIT_FAILURE;
@@ -70,6 +92,24 @@ int main(int argc, char *argv[]) {
 	    do_format(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "mount")) {
 	    do_mount(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "unmount")) {
+	    do_unmount(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "sync")) {
+	    do_sync(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "cache")) {
+	    do_cache(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "threads")) {
+	    do_threads(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "scan")) {
+	    do_scan(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "fsck")) {
+	    do_fsck(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "free")) {
+	    do_free(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "stats")) {
+	    do_stats(disk, fs, args, arg1, arg2);
+	} else if (streq(cmd, "trace")) {
+	    do_trace(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "cat")) {
 	    do_cat(disk, fs, args, arg1, arg2);
 	} else if (streq(cmd, "copyout")) {
@@ -103,16 +143,24 @@ void do_debug(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     	return;
     }
 
-    fs.debug(&disk);
+    fs.debug(&disk, fs.get_scan_threads());
 }
 
 void do_format(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
-    if (args != 1) {
-    	printf("Usage: format\n");
+    // Trailing "fast" clears only the inode table
+    bool fast = args > 1 && streq(args == 2 ? arg1 : arg2, "fast");
+    if (args > 3 || (args == 3 && !fast)) {
+    	printf("Usage: format [feature,...] [fast]\n");
+    	return;
+    }
+
+    uint32_t features = 0;
+    if (args - fast == 2 && !parse_features(arg1, &features)) {
+    	printf("Unknown feature in %s\n", arg1);
     	return;
     }
 
-    if (fs.format(&disk)) {
+    if (fs.format(&disk, features, fast)) {
     	printf("disk formatted.\n");
     } else {
     	printf("format failed!\n");
@@ -132,13 +180,175 @@ void do_mount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     }
 }
 
+void do_unmount(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: unmount\n");
+    	return;
+    }
+
+    if (disk.mounted()) {
+    	fs.unmount();
+    	printf("disk unmounted.\n");
+    } else {
+    	printf("unmount failed!\n");
+    }
+}
+
+void do_sync(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: sync\n");
+    	return;
+    }
+
+    fs.sync();
+    disk.sync();
+    printf("disk synced.\n");
+}
+
+void do_cache(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: cache <blocks>\n");
+    	return;
+    }
+
+    disk.set_cache(atoi(arg1));
+    printf("cache set to %d blocks.\n", atoi(arg1));
+}
+
+void do_threads(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2 || atoi(arg1) < 1) {
+    	printf("Usage: threads <count>\n");
+    	return;
+    }
+
+    fs.set_scan_threads(atoi(arg1));
+    printf("scan threads set to %u.\n", fs.get_scan_threads());
+}
+
+void do_scan(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 1) {
+    	printf("Usage: scan\n");
+    	return;
+    }
+
+    FileSystem::ScanStats stats;
+    if (!FileSystem::scan(&disk, fs.get_scan_threads(), &stats)) {
+    	printf("scan failed!\n");
+    	return;
+    }
+
+    printf("scanned %lu inodes with %u threads in %.6f seconds.\n", stats.Inodes, stats.Threads, stats.Seconds);
+    printf("    %lu blocks in use\n", stats.Blocks);
+    printf("    %lu invalid pointers\n", stats.Invalid);
+    printf("    %lu duplicate blocks\n", stats.Duplicates);
+    for (size_t i = 0; i < stats.Reads.size(); i++) {
+    	printf("    worker %lu: %lu block reads\n", i, stats.Reads[i]);
+    }
+}
+
+void do_fsck(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "repair"))) {
+    	printf("Usage: fsck [repair]\n");
+    	return;
+    }
+
+    FileSystem::CheckReport report;
+    if (!FileSystem::check(&disk, fs.get_scan_threads(), args == 2, &report)) {
+    	printf("fsck failed!\n");
+    	return;
+    }
+
+    printf("checked %lu inodes with %u threads in %.6f seconds.\n", report.Scan.Inodes, report.Scan.Threads, report.Scan.Seconds);
+    printf("    %lu blocks in use\n", report.Scan.Blocks);
+    printf("    %lu invalid pointers\n", report.Scan.Invalid);
+    printf("    %lu duplicate blocks\n", report.Scan.Duplicates);
+    printf("    %lu bad sizes\n", report.BadSizes);
+    printf("    %lu leaked blocks\n", report.Leaked);
+    printf("    %lu lost blocks\n", report.Lost);
+    printf("    %lu bad reference counts\n", report.BadRefs);
+    if (args == 2) {
+    	printf("    %lu repairs\n", report.Repairs);
+    }
+}
+
+void do_free(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    static const char *names[] = {"zero", "lazy", "discard", "scrub"};
+
+    if (args == 1) {
+    	printf("free policy is %s, %lu blocks waiting to be scrubbed.\n",
+    	       names[fs.get_free_policy()], fs.scrub_pending());
+    	return;
+    }
+
+    for (size_t i = 0; args == 2 && i < sizeof(names) / sizeof(names[0]); i++) {
+    	if (streq(arg1, names[i])) {
+    	    fs.set_free_policy((FileSystem::FreePolicy)i);
+    	    printf("free policy set to %s.\n", names[i]);
+    	    return;
+	}
+    }
+    printf("Usage: free [zero|lazy|discard|scrub]\n");
+}
+
+void do_stats(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args > 2 || (args == 2 && !streq(arg1, "reset"))) {
+    	printf("Usage: stats [reset]\n");
+    	return;
+    }
+
+    if (args == 2) {
+    	fs.reset_stats();
+    	printf("stats reset.\n");
+    	return;
+    }
+
+    Stats::Snapshot snapshot;
+    fs.get_stats(&snapshot);
+    printf("operations:\n");
+    for (size_t op = 0; op < Stats::OPERATIONS; op++) {
+    	const Stats::Histogram &histogram = snapshot.Operations[op];
+    	printf("    %s: %lu calls", Stats::name((Stats::Operation)op), histogram.Calls);
+    	if (histogram.Calls) {
+    	    printf(", mean %.1f us, p50 %.1f us, p99 %.1f us, max %.1f us",
+    	    	   histogram.Nanoseconds / 1e3 / histogram.Calls, histogram.percentile(0.50) / 1e3,
+    	    	   histogram.percentile(0.99) / 1e3, histogram.Max / 1e3);
+	}
+    	printf("\n");
+    }
+
+    const char *kinds[Disk::KINDS] = {"data", "super", "inode", "bitmap", "indirect"};
+    printf("disk blocks:\n");
+    for (size_t kind = 0; kind < Disk::KINDS; kind++) {
+    	printf("    %s: %lu reads, %lu writes\n", kinds[kind], disk.reads((Disk::Kind)kind), disk.writes((Disk::Kind)kind));
+    }
+    printf("bytes copied:\n");
+    printf("    %lu read\n", snapshot.BytesRead);
+    printf("    %lu written\n", snapshot.BytesWritten);
+}
+
+void do_trace(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
+    if (args != 2) {
+    	printf("Usage: trace <file>|off\n");
+    	return;
+    }
+
+    if (streq(arg1, "off")) {
+    	disk.stop_trace();
+    	printf("trace stopped.\n");
+    } else if (disk.start_trace(arg1)) {
+    	printf("tracing to %s.\n", arg1);
+    } else {
+    	printf("Unable to open %s: %s\n", arg1, strerror(errno));
+    }
+}
+
 void do_cat(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     if (args != 2) {
     	printf("Usage: cat <inode>\n");
     	return;
     }
 
-    if (!copyout(fs, atoi(arg1), "/dev/stdout")) {
+    if (!copyout(fs, atoi(arg1), "/dev/stdout", false)) {
     	printf("cat failed!\n");
     }
 }
@@ -149,7 +359,7 @@ void do_copyout(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     	return;
     }
 
-    if (!copyout(fs, atoi(arg1), arg2)) {
+    if (!copyout(fs, atoi(arg1), arg2, true)) {
     	printf("copyout failed!\n");
     }
 }
@@ -210,9 +420,18 @@ void do_copyin(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
 
 void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("Commands are:\n");
-    printf("    format\n");
+    printf("    format  [feature,...] [fast]\n");
     printf("    mount\n");
+    printf("    unmount\n");
+    printf("    sync\n");
+    printf("    cache   <blocks>\n");
+    printf("    threads <count>\n");
     printf("    debug\n");
+    printf("    scan\n");
+    printf("    fsck    [repair]\n");
+    printf("    free    [zero|lazy|discard|scrub]\n");
+    printf("    stats   [reset]\n");
+    printf("    trace   <file>|off\n");
     printf("    create\n");
     printf("    remove  <inode>\n");
     printf("    cat     <inode>\n");
@@ -224,17 +443,33 @@ void do_help(Disk &disk, FileSystem &fs, int args, char *arg1, char *arg2) {
     printf("    exit\n");
 }
 
-bool copyout(FileSystem &fs, size_t inumber, const char *path) {
+bool copyout(FileSystem &fs, size_t inumber, const char *path, bool direct) {
     FILE *stream = fopen(path, "w");
     if (stream == nullptr) {
     	fprintf(stderr, "Unable to open %s: %s\n", path, strerror(errno));
     	return false;
     }
 
+    // Data runs go from the disk image to the file inside the kernel
+    if (direct) {
+    	ssize_t result = fs.copy_to(inumber, fileno(stream));
+    	fclose(stream);
+    	if (result < 0) {
+    	    fprintf(stderr, "Unable to copy inode %lu to %s\n", inumber, path);
+    	    return false;
+	}
+    	printf("%lu bytes copied\n", result);
+    	return true;
+    }
+
+    // Whole file is streamed in order through one handle
+    FileSystem::File *file = fs.open(inumber);
+    fs.advise(inumber, 0, 0, FileSystem::HINT_SEQUENTIAL);
+
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
     while (true) {
-    	ssize_t result = fs.read(inumber, buffer, sizeof(buffer), offset);
+    	ssize_t result = file ? file->read(buffer, sizeof(buffer)) : -1;
     	if (result <= 0) {
     	    break;
 	}
@@ -242,6 +477,9 @@ bool copyout(FileSystem &fs, size_t inumber, const char *path) {
 	offset += result;
     }
 
+    if (file) {
+    	file->close();
+    }
     printf("%lu bytes copied\n", offset);
     fclose(stream);
     return true;
@@ -254,6 +492,9 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     	return false;
     }
 
+    // Inode and indirect block are written back once, on close
+    FileSystem::File *file = fs.open(inumber);
+
     char buffer[4*BUFSIZ] = {0};
     size_t offset = 0;
     while (true) {
@@ -262,7 +503,7 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
     	    break;
 	}
 
-	ssize_t actual = fs.write(inumber, buffer, result, offset);
+	ssize_t actual = file ? file->write(buffer, result) : -1;
 	if (actual < 0) {
 	    fprintf(stderr, "fs.write returned invalid result %ld\n", actual);
 	    break;
@@ -274,7 +515,31 @@ bool copyin(FileSystem &fs, const char *path, size_t inumber) {
 	}
     }
 
+    if (file) {
+    	file->close();
+    }
     printf("%lu bytes copied\n", offset);
     fclose(stream);
     return true;
 }
+
+bool parse_features(char *list, uint32_t *features) {
+    for (char *name = strtok(list, ","); name != NULL; name = strtok(NULL, ",")) {
+    	if (streq(name, "bitmap")) {
+    	    *features |= FileSystem::FEATURE_BITMAP;
+	} else if (streq(name, "extents")) {
+	    *features |= FileSystem::FEATURE_EXTENTS;
+	} else if (streq(name, "large")) {
+	    *features |= FileSystem::FEATURE_LARGE;
+	} else if (streq(name, "inline")) {
+	    *features |= FileSystem::FEATURE_INLINE;
+	} else if (streq(name, "compress")) {
+	    *features |= FileSystem::FEATURE_COMPRESS;
+	} else if (streq(name, "dedup")) {
+	    *features |= FileSystem::FEATURE_DEDUP;
+	} else {
+	    return false;
+	}
+    }
+    return true;
+}
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: machine-readable benchmark results have one row per benchmark, each
+# with the operations and bytes asked for
+
+bench-output() {
+    cat <<EOF
+name ops bytes
+format 2 0
+format-fast 2 0
+mount-empty 2 0
+create 50 0
+remove 50 0
+seq-write-4k 64 262144
+seq-read-4k 64 262144
+rand-write-4k 64 262144
+rand-read-4k 64 262144
+seq-write-64k 4 262144
+seq-read-64k 4 262144
+rand-write-64k 64 4194304
+rand-read-64k 64 4194304
+copyin 2 524288
+copyout 2 524288
+mount-full 2 0
+EOF
+}
+
+for backend in pread mmap uring; do
+    echo -n "Testing sfsbench with $backend in $SCRATCH/bench.img ... "
+    if diff -u <(./bin/sfsbench -m -b 2000 -r 2 -n 50 -s 262144 -B $backend -d $SCRATCH/bench.img 2> /dev/null | awk -F '\t' 'NF == 12 {print $1, $2, $3}') <(bench-output) > $SCRATCH/test.log &&
+       [ ! -e $SCRATCH/bench.img ]; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: an image that cannot be formatted is reported
+
+echo -n "Testing sfsbench with conflicting features ... "
+if ! ./bin/sfsbench -f extents,large -d $SCRATCH/bench.img format > $SCRATCH/test.log 2>&1 &&
+   grep -q "Unable to format" $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,118 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+printf "format bitmap\nmount\ncreate\ncopyin README.md 0\n" | ./bin/sfssh $SCRATCH/image.50 50 > /dev/null 2>&1
+
+# Test: clean mount loads the saved bitmap instead of scanning inodes
+
+clean-input() {
+    cat <<EOF
+mount
+stat 0
+EOF
+}
+
+clean-output() {
+    cat <<EOF
+disk mounted.
+inode 0 has size 3230 bytes.
+3 disk block reads
+2 disk block writes
+EOF
+}
+
+echo -n "Testing bitmap clean mount in $SCRATCH/image.50 ... "
+if diff -u <(clean-input | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null) <(clean-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: unclean mount rebuilds the bitmap from the inode table
+
+printf '\x00' | dd of=$SCRATCH/image.50 bs=1 seek=32 conv=notrunc 2> /dev/null
+
+unclean-input() {
+    cat <<EOF
+mount
+create
+copyin README.md 1
+EOF
+}
+
+unclean-output() {
+    cat <<EOF
+disk mounted.
+created inode 1.
+3230 bytes copied
+7 disk block reads
+7 disk block writes
+EOF
+}
+
+debug-output() {
+    cat <<EOF
+SuperBlock:
+    magic number is valid
+    50 blocks
+    5 inode blocks
+    640 inodes
+    revision 1
+    1 bitmap blocks
+    clean
+Inode 0:
+    size: 3230 bytes
+    direct blocks: 7
+Inode 1:
+    size: 3230 bytes
+    direct blocks: 8
+6 disk block reads
+0 disk block writes
+EOF
+}
+
+echo -n "Testing bitmap unclean mount in $SCRATCH/image.50 ... "
+if diff -u <(unclean-input | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null) <(unclean-output) > $SCRATCH/test.log &&
+   diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null) <(debug-output) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: a bitmap resized with every bit in use has no free bit, also when
+# its size is not a multiple of 64
+
+resize-program() {
+    cat <<EOF
+#include "sfs/bitmap.h"
+#include <stdio.h>
+int main() {
+    Bitmap bitmap;
+    bitmap.resize(100, true);
+    printf("%d %d %ld %lu %lu\n", bitmap.test(70), bitmap.test(99), (long)bitmap.next_free(0), bitmap.free(), bitmap.region_free(0));
+    bitmap.clear(70);
+    printf("%d %ld %lu %lu\n", bitmap.test(70), (long)bitmap.next_free(0), bitmap.free(), bitmap.region_free(0));
+    return 0;
+}
+EOF
+}
+
+resize-output() {
+    cat <<EOF
+1 1 -1 0 0
+0 70 1 1
+EOF
+}
+
+echo -n "Testing bitmap resize in use ... "
+if resize-program | g++ -std=gnu++11 -Iinclude -x c++ - -Llib -lsfs -pthread -o $SCRATCH/resize 2> $SCRATCH/test.log &&
+   diff -u <($SCRATCH/resize) <(resize-output) >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
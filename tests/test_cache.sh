@@ -0,0 +1,66 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: inode table reads its first block through the cache
+
+stat-input() {
+    cat <<EOF
+cache 32
+mount
+stat 1
+stat 2
+stat 3
+stat 9
+EOF
+}
+
+stat-output() {
+    cat <<EOF
+cache set to 32 blocks.
+disk mounted.
+inode 1 has size 1523 bytes.
+inode 2 has size 105421 bytes.
+stat failed!
+inode 9 has size 409305 bytes.
+23 disk block reads
+0 disk block writes
+1 cache hits
+23 cache misses
+0 cache evictions
+EOF
+}
+
+echo -n "Testing cache stat on data/image.200 ... "
+if diff -u <(stat-input | ./bin/sfssh data/image.200 200 2> /dev/null) <(stat-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: write-back through a small cache survives eviction and remount
+
+cp data/image.200 $SCRATCH/image.200
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+cache 4
+mount
+copyout 2 $SCRATCH/2.txt
+create
+copyin $SCRATCH/2.txt 0
+unmount
+mount
+copyout 0 $SCRATCH/2.copy
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/2.disk
+EOF
+echo -n "Testing cache write-back in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/2.copy | awk '{print $1}') = '307fe5cee7ac87c3b06ea5bda80301ee' ] &&
+   [ $(md5sum $SCRATCH/2.disk | awk '{print $1}') = '307fe5cee7ac87c3b06ea5bda80301ee' ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -0,0 +1,92 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: text files take fewer blocks compressed than as is, and copy back
+# out unchanged
+
+compress-input() {
+    cat <<EOF
+format $1
+mount
+create
+copyin data/2.txt 0
+create
+copyin data/1.txt 1
+copyout 0 $SCRATCH/2.txt
+copyout 1 $SCRATCH/1.txt
+unmount
+fsck
+EOF
+}
+
+compress-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+105421 bytes copied
+created inode 1.
+1523 bytes copied
+105421 bytes copied
+1523 bytes copied
+disk unmounted.
+checked 2 inodes with 1 threads in X seconds.
+    $1 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+EOF
+}
+
+for layout in "legacy 39 32" "large 39 32" "bitmap,inline 40 33"; do
+    set -- $layout
+    features=$1
+    [ $features = legacy ] && features=
+    echo -n "Testing compressed data with $1 inodes in $SCRATCH/image.100 ... "
+    rm -f $SCRATCH/image.100 $SCRATCH/plain.100
+    if diff -u <(compress-input $features | ./bin/sfssh $SCRATCH/plain.100 100 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(compress-output $2) > $SCRATCH/test.log &&
+       diff -u <(compress-input ${features:+$features,}compress | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(compress-output $3) >> $SCRATCH/test.log &&
+       cmp -s data/2.txt $SCRATCH/2.txt && cmp -s data/1.txt $SCRATCH/1.txt; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: overwriting the start of a compressed cluster keeps the rest
+
+(cat data/1.txt; tail -c +1524 data/2.txt) > $SCRATCH/expected
+
+rewrite-output() {
+    cat <<EOF
+disk mounted.
+1523 bytes copied
+105421 bytes copied
+disk unmounted.
+EOF
+}
+
+echo -n "Testing compressed rewrite in $SCRATCH/image.100 ... "
+if diff -u <(printf "mount\ncopyin data/1.txt 0\ncopyout 0 $SCRATCH/rewritten\nunmount\n" | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | grep -v "disk block") <(rewrite-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/expected $SCRATCH/rewritten; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: compressed data needs pointers, so extents are refused
+
+echo -n "Testing compressed extents format ... "
+if diff -u <(printf "format compress,extents\n" | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | head -n 1) <(echo "format failed!") > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
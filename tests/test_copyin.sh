@@ -75,3 +75,26 @@ if [ $(md5sum $SCRATCH/1.copy | awk '{print $1}') = '0af623d6d8cb0a514816e17c738
 else
     echo "Failure"
 fi
+
+# Test: copyin through one handle writes the inode and indirect block once
+
+for i in $(seq 20); do cat README.md; done > $SCRATCH/input
+
+handle-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+64600 bytes copied
+22 disk block reads
+219 disk block writes
+EOF
+}
+
+echo -n "Testing copyin through a handle in $SCRATCH/image.handle ... "
+if diff -u <(printf "format\nmount\ncreate\ncopyin $SCRATCH/input 0\n" | ./bin/sfssh $SCRATCH/image.handle 200 2> /dev/null) <(handle-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
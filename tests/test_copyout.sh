@@ -49,3 +49,13 @@ if [ $(md5sum $SCRATCH/1.txt | awk '{print $1}') = '0af623d6d8cb0a514816e17c7386
 else
     echo "Failure"
 fi
+
+# Test: copyout of an invalid inode fails
+
+echo -n "Testing copyout of invalid inode in data/image.5 ... "
+if diff -u <(printf "mount\ncopyout 0 $SCRATCH/0.txt\n" | ./bin/sfssh data/image.5 5 2> /dev/null | grep -v "disk block") <(printf "disk mounted.\ncopyout failed!\n") > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -537,7 +537,7 @@ Inode 126:
 Inode 127:
     size: 0 bytes
     direct blocks:
-262 disk block reads
+7 disk block reads
 127 disk block writes
 EOF
 }
@@ -552,3 +552,39 @@ if diff -q <(test-input | ./bin/sfssh data/image.5.create 5 2> /dev/null) <(test
 else
     echo "False"
 fi
+
+# Test: inode numbers continue into the second inode block
+
+test-20-input() {
+    echo mount
+    for i in $(seq 130); do
+    	echo create
+    done
+    echo stat 131
+    echo stat 132
+}
+
+test-20-output() {
+    cat <<EOF
+disk mounted.
+EOF
+    for i in 0 1 $(seq 4 131); do
+    	echo "created inode $i."
+    done
+    cat <<EOF
+inode 131 has size 0 bytes.
+stat failed!
+6 disk block reads
+130 disk block writes
+EOF
+}
+
+cp data/image.20 data/image.20.create
+trap "rm -f data/image.5.create data/image.20.create" INT QUIT TERM EXIT
+
+echo -n "Testing create in data/image.20.create ... "
+if diff -q <(test-20-input | ./bin/sfssh data/image.20.create 20 2> /dev/null) <(test-20-output) > /dev/null; then
+    echo "Success"
+else
+    echo "False"
+fi
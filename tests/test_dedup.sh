@@ -0,0 +1,158 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: a second copy of a file and blocks repeated between near-identical
+# files are stored once, and every file copies back out unchanged
+
+dedup-input() {
+    cat <<EOF
+format $1
+mount
+create
+copyin data/2.txt 0
+create
+copyin data/2.txt 1
+create
+copyin data/3.txt 2
+create
+copyin data/3.copy 3
+copyout 1 $SCRATCH/2.txt
+copyout 3 $SCRATCH/3.copy
+unmount
+fsck
+EOF
+}
+
+dedup-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+105421 bytes copied
+created inode 1.
+105421 bytes copied
+created inode 2.
+9546 bytes copied
+created inode 3.
+9546 bytes copied
+105421 bytes copied
+9546 bytes copied
+disk unmounted.
+checked 4 inodes with 1 threads in X seconds.
+    $1 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+EOF
+}
+
+for features in bitmap bitmap,large bitmap,inline; do
+    echo -n "Testing shared blocks with $features in $SCRATCH/image.100 ... "
+    rm -f $SCRATCH/image.100 $SCRATCH/plain.100
+    if diff -u <(dedup-input $features | ./bin/sfssh $SCRATCH/plain.100 100 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(dedup-output 72) > $SCRATCH/test.log &&
+       diff -u <(dedup-input $features,dedup | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(dedup-output 45) >> $SCRATCH/test.log &&
+       cmp -s data/2.txt $SCRATCH/2.txt && cmp -s data/3.copy $SCRATCH/3.copy; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: rewriting a shared block copies it, and blocks are freed with their
+# last reference
+
+(cat data/5.txt; tail -c +1579 data/2.txt) > $SCRATCH/expected
+
+rewrite-output() {
+    cat <<EOF
+disk mounted.
+1578 bytes copied
+105421 bytes copied
+105421 bytes copied
+removed inode 2.
+disk unmounted.
+checked 3 inodes with 1 threads in X seconds.
+    44 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+disk mounted.
+removed inode 0.
+removed inode 1.
+removed inode 3.
+disk unmounted.
+checked 0 inodes with 1 threads in X seconds.
+    13 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+EOF
+}
+
+cp $SCRATCH/image.100 $SCRATCH/shared.100
+echo -n "Testing shared block rewrite and remove in $SCRATCH/image.100 ... "
+if diff -u <(printf "mount\ncopyin data/5.txt 0\ncopyout 0 $SCRATCH/rewritten\ncopyout 1 $SCRATCH/2.txt\nremove 2\nunmount\nfsck\nmount\nremove 0\nremove 1\nremove 3\nunmount\nfsck\n" | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(rewrite-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/expected $SCRATCH/rewritten && cmp -s data/2.txt $SCRATCH/2.txt; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: fsck repair recounts a reference table that lost its counts
+
+refs-output() {
+    cat <<EOF
+checked 4 inodes with 1 threads in X seconds.
+    45 blocks in use
+    0 invalid pointers
+    28 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    27 bad reference counts
+    1 repairs
+checked 4 inodes with 1 threads in X seconds.
+    45 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+EOF
+}
+
+# Zero the reference table (block 12)
+dd if=/dev/zero of=$SCRATCH/shared.100 bs=4096 seek=12 count=1 conv=notrunc 2> /dev/null
+
+echo -n "Testing fsck reference repair in $SCRATCH/shared.100 ... "
+if diff -u <(printf "fsck repair\nfsck\n" | ./bin/sfssh $SCRATCH/shared.100 100 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(refs-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: shared blocks are counted next to the free bitmap, per pointer, so
+# dedup needs the bitmap and refuses extents and compression
+
+echo -n "Testing dedup format combinations ... "
+if diff -u <(printf "format dedup\nformat bitmap,dedup,extents\nformat bitmap,dedup,compress\nformat bitmap,dedup\n" | ./bin/sfssh $SCRATCH/image.100 100 2> /dev/null | head -n 4) <(printf "format failed!\nformat failed!\nformat failed!\ndisk formatted.\n") > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,90 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+for i in $(seq 30); do cat README.md; done | head -c 65536 > $SCRATCH/big.txt
+for i in 1 2 3 4; do cat README.md; done | head -c 8000 > $SCRATCH/2.txt
+for i in 1 2 3 4; do cat README.md; done | head -c 12000 > $SCRATCH/3.txt
+
+# Test: a large file is written as one extent
+
+big-input() {
+    cat <<EOF
+format extents
+mount
+create
+copyin $SCRATCH/big.txt 0
+unmount
+debug
+EOF
+}
+
+big-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+65536 bytes copied
+disk unmounted.
+SuperBlock:
+    magic number is valid
+    30 blocks
+    3 inode blocks
+    384 inodes
+    revision 1
+    extents
+Inode 0:
+    size: 65536 bytes
+    extents: 4+16
+9 disk block reads
+48 disk block writes
+EOF
+}
+
+echo -n "Testing extents contiguous file in $SCRATCH/image.30 ... "
+if diff -u <(big-input | ./bin/sfssh $SCRATCH/image.30 30 2> /dev/null) <(big-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: interleaved growth spills extents into an extent block
+
+rm -f $SCRATCH/image.30
+cat <<EOF | ./bin/sfssh $SCRATCH/image.30 30 > /dev/null 2>&1
+format extents
+mount
+create
+create
+copyin README.md 0
+copyin README.md 1
+copyin $SCRATCH/2.txt 0
+copyin $SCRATCH/2.txt 1
+copyin $SCRATCH/3.txt 0
+copyin $SCRATCH/3.txt 1
+EOF
+
+fragmented-output() {
+    cat <<EOF
+Inode 0:
+    size: 12000 bytes
+    extents: 4+1 6+1 8+1
+    extent block: 9
+Inode 1:
+    size: 12000 bytes
+    extents: 5+1 7+1 10+1
+    extent block: 11
+EOF
+}
+
+echo -n "Testing extents extent block in $SCRATCH/image.30 ... "
+printf "mount\ncopyout 0 $SCRATCH/0.copy\ncopyout 1 $SCRATCH/1.copy\n" | ./bin/sfssh $SCRATCH/image.30 30 > /dev/null 2>&1
+if diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.30 30 2> /dev/null | sed -n '/^Inode/,/extent block/p') <(fragmented-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/0.copy $SCRATCH/3.txt && cmp -s $SCRATCH/1.copy $SCRATCH/3.txt; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
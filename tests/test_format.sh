@@ -65,3 +65,32 @@ test-format() {
 test-format data/image.5   5   image-5-output
 test-format data/image.20  20  image-20-output
 test-format data/image.200 200 image-200-output
+
+# Test: fast format writes only the superblock and inode table, and leaves
+# the same image as a full format
+
+image-200-fast-output() {
+    cat <<EOF
+disk formatted.
+SuperBlock:
+    magic number is valid
+    200 blocks
+    20 inode blocks
+    2560 inodes
+21 disk block reads
+21 disk block writes
+EOF
+}
+
+cp data/image.200 data/image.200.fast
+cp data/image.200 data/image.200.full
+echo -n "Testing fast format on data/image.200.fast ... "
+if diff -u <(printf "format fast\ndebug\n" | ./bin/sfssh data/image.200.fast 200 2> /dev/null) <(image-200-fast-output) > test.log &&
+   echo format | ./bin/sfssh data/image.200.full 200 > /dev/null 2>&1 &&
+   cmp data/image.200.fast data/image.200.full >> test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat test.log
+fi
+rm -f data/image.200.fast data/image.200.full test.log
@@ -0,0 +1,51 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: each free policy frees the same blocks, at different write costs
+
+free-output() {
+    cat <<EOF
+disk mounted.
+free policy set to $1.
+removed inode 0.
+free policy is $1, $2 blocks waiting to be scrubbed.
+disk unmounted.
+24 disk block reads
+$3 disk block writes
+EOF
+}
+
+# Bytes left in the data region (after the superblock and 20 inode blocks)
+data-residue() {
+    tail -c +$((21*4096 + 1)) $1 | tr -d '\0' | wc -c
+}
+
+for i in $(seq 20); do cat README.md; done > $SCRATCH/input
+
+for args in "zero 0 18 0" "lazy 0 1 64611" "discard 0 1 0" "scrub 17 18 0"; do
+    set -- $args
+    printf "format\nmount\ncreate\ncopyin $SCRATCH/input 0\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+    echo -n "Testing free $1 in $SCRATCH/image.200 ... "
+    if diff -u <(printf "mount\nfree $1\nremove 0\nfree\nunmount\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | sed -E 's/^(sfs> )+//') \
+	       <(free-output $1 $2 $3) > $SCRATCH/test.log && [ $(data-residue $SCRATCH/image.200) -eq $4 ]; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+    rm -f $SCRATCH/image.200
+done
+
+# Test: discarded blocks are dropped from the block cache, not written back
+
+printf "format\nmount\ncreate\ncopyin $SCRATCH/input 0\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+echo -n "Testing free discard with cache in $SCRATCH/image.200 ... "
+printf "cache 8\nmount\nfree discard\nremove 0\ncreate\ncopyin README.md 0\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+printf "mount\ncopyout 0 $SCRATCH/output\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+if cmp -s README.md $SCRATCH/output && [ $(data-residue $SCRATCH/image.200) -le $(stat -c %s README.md) ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
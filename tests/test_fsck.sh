@@ -0,0 +1,141 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+for i in $(seq 20); do cat README.md; done | head -c 40000 > $SCRATCH/40k.txt
+
+# Test: fsck finds nothing wrong with the sample images, with any number of
+# threads
+
+clean-output() {
+    cat <<EOF
+checked $1 inodes with X threads in X seconds.
+    $2 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+EOF
+}
+
+for image in "5 1 3" "20 2 14" "200 3 150"; do
+    set -- $image
+    for threads in 1 4; do
+	echo -n "Testing fsck with $threads threads on data/image.$1 ... "
+	if diff -u <(printf "threads $threads\nfsck\n" | ./bin/sfssh data/image.$1 $1 2> /dev/null | sed -E '1d; s/with [0-9]+ threads in [0-9.]+ seconds/with X threads in X seconds/' | grep -v "disk block") <(clean-output $2 $3) > $SCRATCH/test.log; then
+	    echo "Success"
+	else
+	    echo "Failure"
+	    cat $SCRATCH/test.log
+	fi
+    done
+done
+
+# Test: fsck repair clears invalid pointers and extends sizes over their blocks
+
+repair-output() {
+    cat <<EOF
+checked 2 inodes with 1 threads in X seconds.
+    17 blocks in use
+    2 invalid pointers
+    0 duplicate blocks
+    1 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+checked 2 inodes with 1 threads in X seconds.
+    17 blocks in use
+    2 invalid pointers
+    0 duplicate blocks
+    1 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+    3 repairs
+checked 2 inodes with 1 threads in X seconds.
+    17 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+disk mounted.
+inode 1 has size 40960 bytes.
+3230 bytes copied
+EOF
+}
+
+printf "format\nmount\ncreate\ncopyin README.md 0\ncreate\ncopyin $SCRATCH/40k.txt 1\n" | ./bin/sfssh $SCRATCH/image.50 50 > /dev/null 2>&1
+# Inode 0 direct pointer 1 and entry 3 of inode 1's indirect block (block
+# 12) point past the end of the disk; inode 1 claims to be 100 bytes long
+printf '\x0f\x27\x00\x00' | dd of=$SCRATCH/image.50 bs=1 seek=$((4096 + 12)) conv=notrunc 2> /dev/null
+printf '\x64\x00\x00\x00' | dd of=$SCRATCH/image.50 bs=1 seek=$((4096 + 32 + 4)) conv=notrunc 2> /dev/null
+printf '\xb8\x22\x00\x00' | dd of=$SCRATCH/image.50 bs=1 seek=$((12 * 4096 + 12)) conv=notrunc 2> /dev/null
+
+echo -n "Testing fsck repair in $SCRATCH/image.50 ... "
+if diff -u <(printf "fsck\nfsck repair\nfsck\nmount\nstat 1\ncopyout 0 $SCRATCH/README.copy\n" | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(repair-output) > $SCRATCH/test.log &&
+   cmp -s README.md $SCRATCH/README.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: fsck repair rewrites a free bitmap that lost blocks in use
+
+bitmap-output() {
+    cat <<EOF
+checked 1 inodes with 1 threads in X seconds.
+    8 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    7 lost blocks
+    0 bad reference counts
+    1 repairs
+checked 1 inodes with 1 threads in X seconds.
+    8 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    0 bad sizes
+    0 leaked blocks
+    0 lost blocks
+    0 bad reference counts
+EOF
+}
+
+rm -f $SCRATCH/image.50
+printf "format bitmap\nmount\ncreate\ncopyin README.md 0\n" | ./bin/sfssh $SCRATCH/image.50 50 > /dev/null 2>&1
+# Mark blocks 1 to 7 free in the bitmap (block 6)
+printf '\x01' | dd of=$SCRATCH/image.50 bs=1 seek=$((6 * 4096)) conv=notrunc 2> /dev/null
+
+echo -n "Testing fsck bitmap repair in $SCRATCH/image.50 ... "
+if diff -u <(printf "fsck repair\nfsck\n" | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(bitmap-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: fsck refuses a mounted disk and takes no argument but repair
+
+usage-output() {
+    cat <<EOF
+disk mounted.
+fsck failed!
+Usage: fsck [repair]
+EOF
+}
+
+echo -n "Testing fsck usage ... "
+if diff -u <(printf "mount\nfsck\nfsck all\n" | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null | grep -v "disk block") <(usage-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,112 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+printf "hello, world\n" > $SCRATCH/small.txt
+head -c 24 README.md > $SCRATCH/24.txt
+head -c 25 README.md > $SCRATCH/25.txt
+
+# Test: files of up to 24 bytes are kept in the inode
+
+small-input() {
+    cat <<EOF
+format inline
+mount
+create
+copyin $SCRATCH/small.txt 0
+create
+copyin $SCRATCH/24.txt 1
+create
+copyin $SCRATCH/25.txt 2
+unmount
+debug
+EOF
+}
+
+small-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+13 bytes copied
+created inode 1.
+24 bytes copied
+created inode 2.
+25 bytes copied
+disk unmounted.
+SuperBlock:
+    magic number is valid
+    30 blocks
+    3 inode blocks
+    384 inodes
+    revision 1
+    inline data
+Inode 0:
+    size: 13 bytes
+    inline data
+Inode 1:
+    size: 24 bytes
+    inline data
+Inode 2:
+    size: 25 bytes
+    direct blocks: 4
+9 disk block reads
+37 disk block writes
+EOF
+}
+
+echo -n "Testing inline small files in $SCRATCH/image.30 ... "
+if diff -u <(small-input | ./bin/sfssh $SCRATCH/image.30 30 2> /dev/null) <(small-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: reading an inline file takes no data block read
+
+cat-output() {
+    cat <<EOF
+hello, world
+disk mounted.
+13 bytes copied
+5 disk block reads
+0 disk block writes
+EOF
+}
+
+echo -n "Testing inline cat in $SCRATCH/image.30 ... "
+if diff -u <(printf "mount\ncat 0\n" | ./bin/sfssh $SCRATCH/image.30 30 2> /dev/null) <(cat-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: an inline file grows into a data block, and removing an inline
+# file frees no blocks
+
+grow-output() {
+    cat <<EOF
+disk mounted.
+3230 bytes copied
+3230 bytes copied
+removed inode 0.
+disk unmounted.
+scanned 2 inodes with 1 threads in X seconds.
+    6 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    worker 0: 3 block reads
+EOF
+}
+
+echo -n "Testing inline file growth in $SCRATCH/image.30 ... "
+if diff -u <(printf "mount\ncopyin README.md 1\ncopyout 1 $SCRATCH/README.copy\nremove 0\nunmount\nscan\n" | ./bin/sfssh $SCRATCH/image.30 30 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(grow-output) > $SCRATCH/test.log &&
+   cmp -s README.md $SCRATCH/README.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,57 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+for i in $(seq 1500); do cat README.md; done | head -c 4500000 > $SCRATCH/large.txt
+
+# Test: a file past the single indirect limit grows into the double indirect tree
+
+cat <<EOF | ./bin/sfssh $SCRATCH/image.1300 1300 > $SCRATCH/copyin.log 2>&1
+format large
+mount
+create
+copyin $SCRATCH/large.txt 0
+EOF
+
+large-output() {
+    cat <<EOF
+    size: 4500000 bytes
+    direct blocks: 131 132 133
+    indirect block: 134
+    double indirect block: 1159
+EOF
+}
+
+echo -n "Testing large file in $SCRATCH/image.1300 ... "
+printf "mount\ncopyout 0 $SCRATCH/large.copy\n" | ./bin/sfssh $SCRATCH/image.1300 1300 > /dev/null 2>&1
+if diff -u <(echo debug | ./bin/sfssh $SCRATCH/image.1300 1300 2> /dev/null | grep -E "size|direct blocks|block:") <(large-output) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/large.txt $SCRATCH/large.copy; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+# Test: remove frees every block of the tree
+
+remove-output() {
+    cat <<EOF
+disk mounted.
+removed inode 0.
+disk unmounted.
+scanned 0 inodes with 1 threads in X seconds.
+    131 blocks in use
+    0 invalid pointers
+    0 duplicate blocks
+    worker 0: 130 block reads
+EOF
+}
+
+echo -n "Testing large file remove in $SCRATCH/image.1300 ... "
+if diff -u <(printf "mount\nremove 0\nunmount\nscan\n" | ./bin/sfssh $SCRATCH/image.1300 1300 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/' | grep -v "disk block") <(remove-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,56 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: mmap backend reports the same data and block counts as pread
+
+test-input() {
+    cat <<EOF
+debug
+mount
+stat 1
+stat 2
+stat 3
+cat 1
+cat 2
+cat 3
+EOF
+}
+
+test-mmap() {
+    BLOCKS=$1
+
+    echo -n "Testing mmap on data/image.$BLOCKS ... "
+    if diff -u <(test-input | ./bin/sfssh data/image.$BLOCKS $BLOCKS pread 2> /dev/null) \
+    	       <(test-input | ./bin/sfssh data/image.$BLOCKS $BLOCKS mmap 2> /dev/null) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-mmap 5
+test-mmap 20
+test-mmap 200
+
+# Test: writes through the mapping reach the disk image
+
+cp data/image.200 $SCRATCH/image.200
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 mmap > /dev/null 2>&1
+mount
+copyout 2 $SCRATCH/2.txt
+create
+copyin $SCRATCH/2.txt 0
+EOF
+cat <<EOF | ./bin/sfssh $SCRATCH/image.200 200 pread > /dev/null 2>&1
+mount
+copyout 0 $SCRATCH/2.copy
+EOF
+echo -n "Testing mmap copyin in $SCRATCH/image.200 ... "
+if [ $(md5sum $SCRATCH/2.copy | awk '{print $1}') = '307fe5cee7ac87c3b06ea5bda80301ee' ]; then
+    echo "Success"
+else
+    echo "Failure"
+fi
@@ -0,0 +1,29 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: streaming a file reads each pointer block once per readahead window
+# rather than once per cat buffer (copyout skips the buffer altogether)
+
+for i in $(seq 1400); do cat README.md; done > $SCRATCH/input
+printf "format large\nmount\ncreate\ncopyin $SCRATCH/input 0\n" | ./bin/sfssh $SCRATCH/image.1300 1300 > /dev/null 2>&1
+
+stream-output() {
+    cat <<EOF
+4522000 bytes copied
+1243 disk block reads
+0 disk block writes
+EOF
+}
+
+echo -n "Testing readahead cat in $SCRATCH/image.1300 ... "
+printf "mount\ncat 0\n" | ./bin/sfssh $SCRATCH/image.1300 1300 2> /dev/null | cat > $SCRATCH/output
+if diff -u <(tail -n 3 $SCRATCH/output) <(stream-output) > $SCRATCH/test.log &&
+   head -c 4522000 $SCRATCH/output | cmp - $SCRATCH/input >> $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
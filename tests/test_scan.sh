@@ -0,0 +1,49 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: parallel debug and mount match the single-threaded scan
+
+for threads in 2 4 32; do
+    echo -n "Testing debug with $threads threads on data/image.200 ... "
+    if diff -u <(echo debug | ./bin/sfssh data/image.200 200 2> /dev/null) \
+	       <(printf "threads $threads\ndebug\n" | ./bin/sfssh data/image.200 200 2> /dev/null | sed 1d) > $SCRATCH/test.log &&
+       diff -u <(echo mount | ./bin/sfssh data/image.200 200 2> /dev/null) \
+	       <(printf "threads $threads\nmount\n" | ./bin/sfssh data/image.200 200 2> /dev/null | sed 1d) >> $SCRATCH/test.log; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: scan reports per-worker reads and catches blocks shared across workers
+
+scan-output() {
+    cat <<EOF
+scan threads set to 4.
+scanned 2 inodes with 4 threads in X seconds.
+    7 blocks in use
+    0 invalid pointers
+    1 duplicate blocks
+    worker 0: 2 block reads
+    worker 1: 2 block reads
+    worker 2: 1 block reads
+    worker 3: 0 block reads
+6 disk block reads
+0 disk block writes
+EOF
+}
+
+printf "format\nmount\ncreate\ncopyin README.md 0\n" | ./bin/sfssh $SCRATCH/image.50 50 > /dev/null 2>&1
+# Copy inode 0 over inode 384 (inode block 4), so both claim the same block
+dd if=$SCRATCH/image.50 of=$SCRATCH/image.50 bs=1 skip=4096 seek=$((4*4096)) count=32 conv=notrunc 2> /dev/null
+
+echo -n "Testing scan with 4 threads in $SCRATCH/image.50 ... "
+if diff -u <(printf "threads 4\nscan\n" | ./bin/sfssh $SCRATCH/image.50 50 2> /dev/null | sed -E 's/in [0-9.]+ seconds/in X seconds/') <(scan-output) > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,48 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: copyout moves data runs from the image to the file in the kernel,
+# reading each data block once, whatever the layout and backend
+
+head -c 300000 /dev/urandom > $SCRATCH/input
+
+span-output() {
+    cat <<EOF
+disk mounted.
+300000 bytes copied
+$1 disk block reads
+$2 disk block writes
+EOF
+}
+
+for layout in "bitmap 78 2" "extents 96 0" "large 98 0"; do
+    set -- $layout
+    features=$1
+    reads=$2
+    writes=$3
+    rm -f $SCRATCH/image.200
+    printf "format $features\nmount\ncreate\ncopyin $SCRATCH/input 0\n" | ./bin/sfssh $SCRATCH/image.200 200 > /dev/null 2>&1
+    for backend in pread mmap uring; do
+	echo -n "Testing $features copyout with $backend in $SCRATCH/image.200 ... "
+	rm -f $SCRATCH/output
+	if diff -u <(printf "mount\ncopyout 0 $SCRATCH/output\n" | ./bin/sfssh $SCRATCH/image.200 200 $backend 2> /dev/null) <(span-output $reads $writes) > $SCRATCH/test.log &&
+	   cmp $SCRATCH/input $SCRATCH/output >> $SCRATCH/test.log; then
+	    echo "Success"
+	else
+	    echo "Failure"
+	    cat $SCRATCH/test.log
+	fi
+    done
+done
+
+# Test: a destination copy_file_range refuses (a pipe) falls back to sendfile
+
+echo -n "Testing copyout to a pipe in $SCRATCH/image.200 ... "
+if printf "mount\ncopyout 0 /dev/stdout\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | head -c 300000 | cmp - $SCRATCH/input > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
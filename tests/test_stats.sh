@@ -0,0 +1,65 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: stats counts calls, disk blocks by kind and bytes copied since the
+# last reset (latencies vary, so only call counts are compared)
+
+head -c 300000 /dev/urandom > $SCRATCH/input
+
+stats-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+created inode 0.
+stats reset.
+300000 bytes copied
+disk unmounted.
+disk mounted.
+stats reset.
+inode 0 has size 300000 bytes.
+300000 bytes copied
+removed inode 0.
+operations:
+    create: 0 calls
+    remove: 1 calls
+    stat: 1 calls
+    read: 1 calls
+    write: 0 calls
+    mount: 0 calls
+disk blocks:
+    data: 74 reads, 74 writes
+    super: 0 reads, 0 writes
+    inode: 1 reads, 1 writes
+    bitmap: 0 reads, $1 writes
+    indirect: $2 reads, $3 writes
+bytes copied:
+    300000 read
+    0 written
+EOF
+}
+
+for layout in "legacy 0 2 1" "bitmap 1 2 1" "extents 0 0 0" "large 0 2 1"; do
+    set -- $layout
+    features=$1
+    [ $features = legacy ] && features=
+    echo -n "Testing stats with $1 inodes in $SCRATCH/image.200 ... "
+    rm -f $SCRATCH/image.200
+    if diff -u <(printf "format $features\nmount\ncreate\nstats reset\ncopyin $SCRATCH/input 0\nunmount\nmount\nstats reset\nstat 0\ncopyout 0 $SCRATCH/output\nremove 0\nstats\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | sed 's/ calls,.*/ calls/' | head -n -2) <(stats-output $2 $3 $4) > $SCRATCH/test.log; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: stats takes no argument but reset
+
+echo -n "Testing stats usage ... "
+if diff -u <(printf "stats all\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | head -n 1) <(echo "Usage: stats [reset]") > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
@@ -0,0 +1,68 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: trace records every block request of a copyin, cat and remove, and
+# sfsreplay repeats the same requests on each backend (latencies vary, so
+# only request and block counts are compared)
+
+head -c 300000 /dev/urandom > $SCRATCH/input
+
+trace-output() {
+    cat <<EOF
+disk formatted.
+disk mounted.
+tracing to $SCRATCH/trace.
+created inode 0.
+300000 bytes copied
+300000 bytes copied
+removed inode 0.
+trace stopped.
+EOF
+}
+
+replay-output() {
+    cat <<EOF
+77 disk block reads
+153 disk block writes
+replayed 21 requests (0 skipped)
+    read: 5 requests, 77 blocks
+    write: 16 requests, 153 blocks
+    discard: 0 requests, 0 blocks
+    create: 2 requests
+    remove: 3 requests
+    read: 3 requests
+    write: 11 requests
+    other: 2 requests
+EOF
+}
+
+echo -n "Testing trace in $SCRATCH/image.200 ... "
+if diff -u <(printf "format\nmount\ntrace $SCRATCH/trace\ncreate\ncopyin $SCRATCH/input 0\ncopyout 0 $SCRATCH/output\nremove 0\ntrace off\n" | ./bin/sfssh $SCRATCH/image.200 200 2> /dev/null | grep -v "disk block") <(trace-output) > $SCRATCH/test.log && [ $(stat -c %s $SCRATCH/trace) -eq $((32 + 24 * 21)) ]; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
+
+for backend in pread mmap uring; do
+    echo -n "Testing sfsreplay with $backend backend ... "
+    cp $SCRATCH/image.200 $SCRATCH/replay.200
+    if diff -u <(./bin/sfsreplay -B $backend $SCRATCH/trace $SCRATCH/replay.200 2> /dev/null | sed 's/ in .* seconds//; s/, p50.*//; /requests\/s/d') <(replay-output) > $SCRATCH/test.log; then
+	echo "Success"
+    else
+	echo "Failure"
+	cat $SCRATCH/test.log
+    fi
+done
+
+# Test: sfsreplay rejects files that are not traces
+
+echo -n "Testing sfsreplay on a bad trace ... "
+if diff -u <(./bin/sfsreplay $SCRATCH/input $SCRATCH/replay.200 2>&1) <(echo "$SCRATCH/input is not a trace of 4096 byte blocks") > $SCRATCH/test.log; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi
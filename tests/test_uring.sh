@@ -0,0 +1,61 @@
+#!/bin/bash
+
+SCRATCH=$(mktemp -d)
+trap "rm -fr $SCRATCH" INT QUIT TERM EXIT
+
+# Test: uring backend reports the same data and block counts as pread
+
+test-input() {
+    cat <<EOF
+debug
+mount
+stat 1
+stat 2
+stat 3
+cat 1
+cat 2
+cat 3
+EOF
+}
+
+test-uring() {
+    BLOCKS=$1
+
+    echo -n "Testing uring on data/image.$BLOCKS ... "
+    if diff -u <(test-input | ./bin/sfssh data/image.$BLOCKS $BLOCKS pread 2> /dev/null) \
+    	       <(test-input | ./bin/sfssh data/image.$BLOCKS $BLOCKS uring 2> /dev/null) > $SCRATCH/test.log; then
+    	echo "Success"
+    else
+    	echo "Failure"
+    	cat $SCRATCH/test.log
+    fi
+}
+
+test-uring 5
+test-uring 20
+test-uring 200
+
+# Test: batched removes and mount scans on io_uring
+
+remove-input() {
+    cat <<EOF
+mount
+remove 2
+remove 9
+unmount
+mount
+debug
+EOF
+}
+
+cp data/image.200 $SCRATCH/pread.200
+cp data/image.200 $SCRATCH/uring.200
+echo -n "Testing uring remove in $SCRATCH/uring.200 ... "
+if diff -u <(remove-input | ./bin/sfssh $SCRATCH/pread.200 200 pread 2> /dev/null) \
+	   <(remove-input | ./bin/sfssh $SCRATCH/uring.200 200 uring 2> /dev/null) > $SCRATCH/test.log &&
+   cmp -s $SCRATCH/pread.200 $SCRATCH/uring.200; then
+    echo "Success"
+else
+    echo "Failure"
+    cat $SCRATCH/test.log
+fi